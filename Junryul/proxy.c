@@ -1,5 +1,10 @@
+#define _GNU_SOURCE // splice
 #include <stdio.h>
+#include <netdb.h>
+// _GNU_SOURCE에서는 netdb.h의 gai_error와 csapp.h의 gai_error가 충돌하므로 csapp 쪽 선언 이름만 바꿔서 include
+#define gai_error csapp_gai_error
 #include "csapp.h"
+#undef gai_error
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
@@ -13,6 +18,7 @@ static const char *user_agent_hdr =
 void doit(int fd);
 int parse_uri(char *uri, char *hostname, char *port, char *path);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
+void relay_splice(int from_fd, int to_fd);
 
 int main(int argc, char **argv)
 {
@@ -46,7 +52,7 @@ void doit(int fd)
 {
   int clientfd;
   char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-  char request_buf[MAX_CACHE_SIZE], response_buf[MAX_CACHE_SIZE];
+  char request_buf[MAX_CACHE_SIZE];
   rio_t rio;
   char hostname[MAXLINE], port[MAXLINE], path[MAXLINE];
 
@@ -79,12 +85,63 @@ void doit(int fd)
 
   // 서버에 요청하고, 응답 전부 클라이언트에 전송
   Rio_writen(clientfd, request_buf, strlen(request_buf)); // 요청 라인 전송
-  int n;
-  while ((n = Rio_readn(clientfd, response_buf, MAX_CACHE_SIZE)) > 0)
+  relay_splice(clientfd, fd); // 응답은 사용자 공간 버퍼를 거치지 않고 서버 -> pipe -> 클라이언트로
+  Close(clientfd);
+}
+
+// 서버 응답을 splice로 클라이언트에 옮기는 함수 (splice를 못 쓰는 fd면 작은 버퍼로 복사)
+void relay_splice(int from_fd, int to_fd)
+{
+  int pipe_fds[2], err;
+  ssize_t n, m;
+  char buf[MAXBUF];
+
+  if (pipe(pipe_fds) == 0)
   {
-    Rio_writen(fd, response_buf, n);
+    while (1)
+    {
+      n = splice(from_fd, NULL, pipe_fds[1], NULL, 65536, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (n <= 0)
+      {
+        break;
+      }
+      // pipe에 들어간 만큼 모두 클라이언트로
+      while (n > 0)
+      {
+        m = splice(pipe_fds[0], NULL, to_fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (m < 0 && errno == EINTR)
+        {
+          continue;
+        }
+        if (m <= 0)
+        {
+          close(pipe_fds[0]);
+          close(pipe_fds[1]);
+          return; // 클라이언트가 끊김
+        }
+        n -= m;
+      }
+    }
+    err = n < 0 ? errno : 0;
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    if (err != EINVAL)
+    {
+      return; // 서버가 응답을 다 보냈거나 연결 오류
+    }
+  }
+
+  while ((n = read(from_fd, buf, sizeof(buf))) > 0)
+  {
+    if (rio_writen(to_fd, buf, n) != n)
+    {
+      return;
+    }
   }
-  Close(clientfd);
 }
 
 int parse_uri(char *uri, char *hostname, char *port, char *path)
@@ -0,0 +1,264 @@
+#!/bin/bash
+#
+# cache-check.sh - proxy.caching의 캐시 응답을 확인하는 스크립트
+#     tiny와 cache-origin.py를 원 서버로 띄우고 그 앞에 proxy.caching을 둔 뒤 curl로 확인
+#       Range : 206 / 416 / multipart/byteranges (tiny를 내린 뒤 캐시만으로)
+#       If-Range : validator가 맞으면 206, 다르면 200 전체
+#       재검증 : 만료되면 304로 갱신, stale-while-revalidate, stale-if-error
+#       gzip 변형 : Accept-Encoding: gzip이면 압축본, 아니면 Vary가 붙은 원본
+#
+#     usage: ./cache-check.sh [proxy.caching 옵션...]   (예: ./cache-check.sh --mode=epoll)
+#
+
+TIMEOUT=5
+MAX_PORT_TRIES=10
+HOME_DIR=`pwd`
+WORK_DIR=`mktemp -d`
+ORIGIN_LOG="${WORK_DIR}/origin.log"
+
+numRun=0
+numSucceeded=0
+
+#####
+# Helper functions
+#
+
+#
+# wait_for_port_use - driver.sh와 같음 : 포트를 실제로 쓰기 시작할 때까지 기다림
+# usage: wait_for_port_use <port>
+#
+function wait_for_port_use() {
+    timeout_count="0"
+    portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+        | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+        | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+    echo "${portsinuse}" | grep -wq "${1}"
+    while [ "$?" != "0" ]
+    do
+        timeout_count=`expr ${timeout_count} + 1`
+        if [ "${timeout_count}" == "${MAX_PORT_TRIES}" ]; then
+            kill -ALRM $$
+        fi
+
+        sleep 1
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+        echo "${portsinuse}" | grep -wq "${1}"
+    done
+}
+
+#
+# fetch - 프록시를 거쳐 받아서 헤더는 <name>.h, 본문은 <name>.b에 저장 (나머지 인자는 curl에 그대로)
+# usage: fetch <name> <url> [curl 옵션...]
+#
+function fetch {
+    name=$1
+    url=$2
+    shift 2
+    curl --max-time ${TIMEOUT} --silent --proxy "http://localhost:${proxy_port}" \
+        --dump-header ${WORK_DIR}/${name}.h --output ${WORK_DIR}/${name}.b "$@" ${url}
+}
+
+#
+# fetch_noproxy - 원 서버에서 바로 받아서 본문을 <name>.b에 저장
+# usage: fetch_noproxy <name> <url>
+#
+function fetch_noproxy {
+    curl --max-time ${TIMEOUT} --silent --output ${WORK_DIR}/$1.b $2
+}
+
+#
+# status / header - fetch로 받은 응답의 상태 코드 / 헤더 값
+# usage: status <name>, header <name> <header>
+#
+function status {
+    head -1 ${WORK_DIR}/$1.h | cut -d' ' -f2
+}
+
+function header {
+    grep -i "^$2:" ${WORK_DIR}/$1.h | head -1 | cut -d' ' -f2- | tr -d '\r'
+}
+
+#
+# same - <name>.b가 파일(또는 표준 입력)과 같은지
+# usage: same <name> <file|->
+#
+function same {
+    cmp -s ${WORK_DIR}/$1.b $2
+}
+
+#
+# check - 조건 명령을 실행해서 결과를 출력하고 센다
+# usage: check <설명> <명령...>
+#
+function check {
+    desc=$1
+    shift
+    numRun=`expr $numRun + 1`
+    if "$@"; then
+        numSucceeded=`expr ${numSucceeded} + 1`
+        echo "   ok   ${desc}"
+    else
+        echo "   FAIL ${desc}"
+    fi
+}
+
+#
+# cleanup - 띄운 서버를 모두 내리고 작업 디렉터리를 지움
+#
+function cleanup {
+    kill $tiny_pid $origin_pid $proxy_pid 2> /dev/null
+    wait $tiny_pid $origin_pid $proxy_pid 2> /dev/null
+    rm -rf ${WORK_DIR}
+}
+
+
+#######
+# Main
+#######
+
+if [ ! -x ./proxy.caching ]
+then
+    echo "Error: ./proxy.caching not found or not an executable file. Please run make and try again."
+    exit 1
+fi
+if [ ! -x ./tiny/tiny ]
+then
+    echo "Building the tiny executable."
+    (cd ./tiny; make)
+    echo ""
+fi
+
+trap 'echo "Timeout waiting for the server to grab the port reserved for it"; cleanup; exit 1' ALRM
+trap 'cleanup; exit 1' INT TERM
+
+tiny_port=$(./free-port.sh)
+echo "Starting tiny on port ${tiny_port}"
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+wait_for_port_use "${tiny_port}"
+
+origin_port=$(./free-port.sh)
+echo "Starting cache-origin.py on port ${origin_port}"
+./cache-origin.py ${origin_port} 2> ${ORIGIN_LOG} &
+origin_pid=$!
+wait_for_port_use "${origin_port}"
+
+proxy_port=$(./free-port.sh)
+echo "Starting proxy.caching on port ${proxy_port} $*"
+./proxy.caching ${proxy_port} "$@" &> /dev/null &
+proxy_pid=$!
+wait_for_port_use "${proxy_port}"
+
+TINY="http://localhost:${tiny_port}"
+ORIGIN="http://localhost:${origin_port}"
+
+#####
+# Range : tiny에서 한 번 받아 캐시에 넣은 뒤 tiny를 내리고 캐시에서 잘라 받음
+#
+echo ""
+echo "*** Range ***"
+FILE=./tiny/godzilla.jpg
+SIZE=`stat -c %s ${FILE}`
+
+fetch full ${TINY}/godzilla.jpg
+check "miss : 200 full body" same full ${FILE}
+
+kill $tiny_pid 2> /dev/null
+wait $tiny_pid 2> /dev/null
+
+fetch single ${TINY}/godzilla.jpg --range 100-199
+check "hit bytes=100-199 : 206" [ "$(status single)" == "206" ]
+check "hit bytes=100-199 : Content-Range" [ "$(header single Content-Range)" == "bytes 100-199/${SIZE}" ]
+check "hit bytes=100-199 : body" same single <(tail -c +101 ${FILE} | head -c 100)
+
+fetch suffix ${TINY}/godzilla.jpg --range -50
+check "hit bytes=-50 : last 50 bytes" same suffix <(tail -c 50 ${FILE})
+
+fetch multi ${TINY}/godzilla.jpg --range 0-4,10-14
+check "hit bytes=0-4,10-14 : multipart/byteranges" grep -qi "^Content-Type: multipart/byteranges" ${WORK_DIR}/multi.h
+check "hit bytes=0-4,10-14 : two parts" [ "$(grep -ac "^Content-Range: bytes" ${WORK_DIR}/multi.b)" == "2" ]
+check "hit bytes=0-4,10-14 : Content-Length" [ "$(header multi Content-Length)" == "$(stat -c %s ${WORK_DIR}/multi.b)" ]
+
+fetch unsatisfiable ${TINY}/godzilla.jpg --range $((SIZE + 10))-
+check "hit past the end : 416" [ "$(status unsatisfiable)" == "416" ]
+check "hit past the end : Content-Range" [ "$(header unsatisfiable Content-Range)" == "bytes */${SIZE}" ]
+
+#####
+# If-Range
+#
+echo ""
+echo "*** If-Range ***"
+fetch_noproxy text ${ORIGIN}/text/50000
+fetch text_miss ${ORIGIN}/text/50000
+check "miss : 200 full body" same text_miss ${WORK_DIR}/text.b
+
+fetch if_range ${ORIGIN}/text/50000 --range 0-9 --header 'If-Range: "v1"'
+check "matching If-Range : 206" [ "$(status if_range)" == "206" ]
+check "matching If-Range : body" same if_range <(head -c 10 ${WORK_DIR}/text.b)
+
+fetch if_range_old ${ORIGIN}/text/50000 --range 0-9 --header 'If-Range: "v0"'
+check "stale If-Range : 200" [ "$(status if_range_old)" == "200" ]
+check "stale If-Range : full body" same if_range_old ${WORK_DIR}/text.b
+
+#####
+# gzip 변형 : /text/50000은 If-Range에서 이미 캐시에 있음
+#
+echo ""
+echo "*** gzip ***"
+fetch gzip ${ORIGIN}/text/50000 --header "Accept-Encoding: gzip"
+check "gzip client : Content-Encoding: gzip" [ "$(header gzip Content-Encoding)" == "gzip" ]
+check "gzip client : Vary: Accept-Encoding" [ "$(header gzip Vary)" == "Accept-Encoding" ]
+check "gzip client : weak ETag" [ "$(header gzip ETag)" == 'W/"v1"' ]
+check "gzip client : body inflates to the original" same text <(gzip -dc ${WORK_DIR}/gzip.b)
+
+fetch gzip_again ${ORIGIN}/text/50000 --header "Accept-Encoding: gzip"
+check "gzip client again : same variant" cmp -s ${WORK_DIR}/gzip_again.b ${WORK_DIR}/gzip.b
+
+fetch identity ${ORIGIN}/text/50000
+check "identity client : no Content-Encoding" [ -z "$(header identity Content-Encoding)" ]
+check "identity client : Vary: Accept-Encoding" [ "$(header identity Vary)" == "Accept-Encoding" ]
+check "identity client : body" same identity ${WORK_DIR}/text.b
+
+fetch gzip_range ${ORIGIN}/text/50000 --header "Accept-Encoding: gzip" --range 0-9
+check "gzip client with Range : identity 206" [ "$(status gzip_range)" == "206" -a -z "$(header gzip_range Content-Encoding)" ]
+
+#####
+# 재검증 : max-age=1인 응답을 만료시킨 뒤 다시 받음
+#
+echo ""
+echo "*** Revalidation ***"
+fetch_noproxy expected ${ORIGIN}/short/5000
+fetch short ${ORIGIN}/short/5000
+fetch swr ${ORIGIN}/swr/5000
+fetch sie ${ORIGIN}/sie/5000
+sleep 1.5
+
+fetch short_refreshed ${ORIGIN}/short/5000
+check "expired : 200 body after 304" same short_refreshed ${WORK_DIR}/expected.b
+check "expired : origin answered 304" grep -q "^304 /short/5000" ${ORIGIN_LOG}
+fetch short_hit ${ORIGIN}/short/5000
+check "after 304 : fresh again (no origin request)" [ "$(grep -c " /short/5000" ${ORIGIN_LOG})" == "3" ]
+
+start=`date +%s%N`
+fetch swr_stale ${ORIGIN}/swr/5000
+elapsed=$(( (`date +%s%N` - start) / 1000000 ))
+check "stale-while-revalidate : stale body" same swr_stale ${WORK_DIR}/expected.b
+check "stale-while-revalidate : no wait for the 2s revalidation (${elapsed} ms)" [ ${elapsed} -lt 1000 ]
+
+fetch sie_stale ${ORIGIN}/sie/5000
+check "stale-if-error : origin answered 503" grep -q "^503 /sie/5000" ${ORIGIN_LOG}
+check "stale-if-error : 200 stale body" [ "$(status sie_stale)" == "200" ]
+check "stale-if-error : body" same sie_stale ${WORK_DIR}/expected.b
+
+sleep 2.5
+check "stale-while-revalidate : revalidated in the background" grep -q "^304 /swr/5000" ${ORIGIN_LOG}
+
+echo ""
+cleanup
+echo "cacheCheck: ${numSucceeded}/${numRun}"
+[ ${numSucceeded} -eq ${numRun} ]
@@ -0,0 +1,61 @@
+#!/usr/bin/python3
+
+# cache-origin.py - cache-check.sh가 proxy.caching 뒤에 두는 원 서버
+#                   경로의 첫 부분으로 응답의 캐시 헤더를 고름 (n은 본문 바이트 수)
+#
+#   /text/<n>  : max-age=100, ETag "v1"인 text/html (Range, If-Range, gzip 변형 확인용)
+#   /short/<n> : max-age=1, ETag "v1" : If-None-Match "v1"이면 304
+#   /swr/<n>   : max-age=1, stale-while-revalidate=30 : 재검증 요청에는 2초 뒤에 304
+#   /sie/<n>   : max-age=1, stale-if-error=60 : 재검증 요청에는 503
+#
+#   받은 요청마다 "<상태> <경로>" 한 줄을 stderr에 남김
+#
+# usage: cache-origin.py <port>
+#
+import http.server
+import sys
+import time
+
+HEADERS = {
+  "text":  [("Cache-Control", "max-age=100"), ("ETag", '"v1"')],
+  "short": [("Cache-Control", "max-age=1"), ("ETag", '"v1"')],
+  "swr":   [("Cache-Control", "max-age=1, stale-while-revalidate=30"), ("ETag", '"v1"')],
+  "sie":   [("Cache-Control", "max-age=1, stale-if-error=60"), ("ETag", '"v1"')],
+}
+
+def body(n):
+  return (b"<p>cache-check body line</p>\n" * (n // 29 + 1))[:n]
+
+class Handler(http.server.BaseHTTPRequestHandler):
+  protocol_version = "HTTP/1.1"
+
+  def do_GET(self):
+    parts = self.path.split("/")
+    kind, n = parts[1], int(parts[-1])
+    revalidate = self.headers.get("If-None-Match") == '"v1"'
+
+    if revalidate and kind == "sie":
+      self.reply(503, [], b"")
+    elif revalidate and kind in ("short", "swr"):
+      if kind == "swr":
+        time.sleep(2)
+      self.reply(304, HEADERS[kind], None)
+    else:
+      self.reply(200, HEADERS[kind] + [("Content-Type", "text/html")], body(n))
+
+  def reply(self, status, headers, data):
+    sys.stderr.write("%d %s\n" % (status, self.path))
+    sys.stderr.flush()
+    self.send_response(status)
+    for name, value in headers:
+      self.send_header(name, value)
+    if data is not None:
+      self.send_header("Content-Length", str(len(data)))
+    self.end_headers()
+    if data:
+      self.wfile.write(data)
+
+  def log_message(self, *args):
+    pass
+
+http.server.ThreadingHTTPServer(("", int(sys.argv[1])), Handler).serve_forever()
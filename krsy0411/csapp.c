@@ -1043,6 +1043,64 @@ int open_listenfd(char *port)
 }
 /* $end open_listenfd */
 
+/*  
+ * open_listenfds - Open n listening sockets on the same port with
+ *     SO_REUSEPORT set, so the kernel spreads incoming connections
+ *     across them. Each descriptor is stored in listenfds[0..n-1].
+ *
+ *     On error, closes any descriptors already opened and returns: 
+ *       -2 for getaddrinfo error
+ *       -1 with errno set for other errors.
+ *     Returns n on success.
+ */
+int open_listenfds(char *port, int *listenfds, int n) 
+{
+    struct addrinfo hints, *listp, *p;
+    int listenfd, rc, i, optval=1;
+
+    /* Get a list of potential server addresses */
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;             /* Accept connections */
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG; /* ... on any IP address */
+    hints.ai_flags |= AI_NUMERICSERV;            /* ... using port number */
+    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
+        return -2;
+    }
+
+    for (i = 0; i < n; i++) {
+        /* Walk the list for one that we can bind to */
+        for (p = listp; p; p = p->ai_next) {
+            if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
+                continue;  /* Socket failed, try the next */
+
+            /* Every listener must set SO_REUSEPORT to share the port */
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+                       (const void *)&optval , sizeof(int));
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval , sizeof(int));
+
+            if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+                break; /* Success */
+            close(listenfd);
+        }
+
+        if (!p || listen(listenfd, LISTENQ) < 0) {
+            if (p)
+                close(listenfd);
+            while (--i >= 0)
+                close(listenfds[i]);
+            freeaddrinfo(listp);
+            return -1;
+        }
+        listenfds[i] = listenfd;
+    }
+
+    /* Clean up */
+    freeaddrinfo(listp);
+    return n;
+}
+
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
  ****************************************************/
@@ -1064,6 +1122,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfds(char *port, int *listenfds, int n) 
+{
+    int rc;
+
+    if ((rc = open_listenfds(port, listenfds, n)) < 0)
+	unix_error("Open_listenfds error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -1,363 +1,8381 @@
+#define _GNU_SOURCE // accept4, splice 같은 리눅스 전용 함수 사용
 #include <stdio.h>
+#include <netdb.h>
+// _GNU_SOURCE에서는 netdb.h의 gai_error(getaddrinfo_a용)와 csapp.h의 gai_error가 충돌하므로 csapp 쪽 선언 이름만 바꿔서 include
+#define gai_error csapp_gai_error
 #include "csapp.h"
+#undef gai_error
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <math.h>
+#include <sys/sendfile.h>
+#include <limits.h>
+#include <zlib.h>
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
-#define MAX_OBJ_NUM ((int)(MAX_CACHE_SIZE / MAX_OBJECT_SIZE))
 
+/* 프록시 동작 모드 */
+#define MODE_THREAD 0 // 미리 만들어 둔 워커 스레드 풀
+#define MODE_EPOLL 1  // 엣지 트리거 epoll 이벤트 루프
+
+/* 캐시 인덱스 종류 */
+#define CACHE_INDEX_LOCKED 0   // 찾기도 샤드의 읽기 락을 잡음
+#define CACHE_INDEX_LOCKFREE 1 // 찾기는 락 없이 (떼어낸 항목은 epoch 기반으로 회수)
+
+/* 기본 축출 정책 : cache_policies[]에서의 번호 */
+#define CACHE_POLICY_CLOCK 1 // "clock"
+
+/* --bench= 종류 */
+#define BENCH_INDEX 1  // 캐시 인덱스 찾기 처리량
+#define BENCH_POLICY 2 // 축출 정책별 히트율 (합성 트레이스)
+
+#define EPOLL_MAX_EVENTS 256
+#define RELAY_BUFSIZE 16384 // epoll 모드에서 연결 하나가 사용하는 중계 버퍼 크기
+#define SPLICE_CHUNK 65536 // splice 한 번에 옮길 최대 바이트 (기본 pipe 용량)
+#define MAX_SHARDS 256 // SO_REUSEPORT 리스닝 소켓(acceptor) 최대 개수
+#define POOL_ADJUST_INTERVAL_US 100000 // 워커 수를 조정하는 주기 (100ms)
+#define POOL_SHRINK_TICKS 50           // 이만큼 연속으로 한가하면 워커를 절반으로 줄임 (= 5초)
+#define UPSTREAM_BUCKETS 64    // 서버 연결 풀 해시 버킷 수
+#define UPSTREAM_HOST_MAX 256  // 연결 풀에 넣을 수 있는 호스트명 최대 길이
+#define DNS_SHARDS 16          // DNS 캐시 샤드 수 (샤드마다 락이 따로)
+#define DNS_BUCKETS 64         // 샤드 하나의 해시 버킷 수
+#define DNS_MAX_ADDRS 8        // 이름 하나에 기억하는 주소 수
+#define DNS_MAX_WAITERS MAX_SHARDS // 조회 중인 이름 하나를 기다릴 수 있는 이벤트 루프 수 : --loops 상한과 같아서 모든 루프가 등록됨
+#define DNS_RESOLVERS 2        // 논블로킹 조회와 미리 갱신을 처리하는 resolver 스레드 수
+#define DNS_HOT_HITS 4         // 마지막 조회 이후 이만큼 쓰인 이름은 만료 전에 미리 갱신
+#define DNS_REFRESH_INTERVAL_US 1000000 // 만료 항목 정리 + 미리 갱신 주기 (1초)
+
+#define FLIGHT_SHARDS 16   // 진행 중인 서버 요청(single-flight) 표의 샤드 수 (샤드마다 락이 따로)
+#define FLIGHT_BUCKETS 64  // 샤드 하나의 해시 버킷 수
+#define REFRESH_THREADS 2  // stale-while-revalidate로 만료된 항목을 백그라운드에서 다시 받아 오는 스레드 수
+#define CONNECT_TIMEOUT_MS 3000 // 서버 연결 전체 제한 시간 기본값
+#define CACHE_INIT_BUCKETS 1024 // 캐시 해시 테이블의 처음 버킷 수
+#define CACHE_MAX_SHARDS 64    // 캐시 샤드 최대 개수
+#define CACHE_BENCH_KEYS 4096     // --bench=index : 미리 채워 둘 키 수
+#define CACHE_BENCH_OPS 200000    // --bench=index : 스레드 하나가 수행할 찾기 횟수
+#define CACHE_BENCH_MAX_THREADS 64
+#define SKETCH_ROWS 4         // TinyLFU count-min sketch 행 수
+#define SKETCH_MAX 15         // 카운터 상한 (4비트 카운터와 같은 범위)
+#define SKETCH_AVG_OBJECT 1024 // 샤드 예산을 이 크기로 나눈 만큼(2의 거듭제곱으로 올림)을 sketch 폭으로 사용
+#define POLICY_BENCH_OBJECTS 20000  // --bench=policy : 인기 객체 수 (Zipf)
+#define POLICY_BENCH_REQUESTS 200000 // --bench=policy : 요청 수
+#define POLICY_BENCH_SCAN_EVERY 20000 // --bench=policy : 이만큼 요청할 때마다 한 번씩만 쓰이는 객체를 훑음
+#define POLICY_BENCH_SCAN_LEN 5000
+#define SLAB_MIN_CHUNK 128      // 가장 작은 크기 클래스 (캐시 항목 헤더 + 짧은 uri + 작은 본문)
+#define SLAB_MAX_CLASSES 64     // 크기 클래스는 1.25배씩 커지며 가장 큰 객체가 들어갈 때까지 만듦
+#define DISK_SEGMENT_SIZE (16 << 20) // 디스크 2차 캐시 세그먼트 파일 하나의 크기 (16MB)
+#define DISK_INIT_BUCKETS 4096      // 디스크 인덱스 해시 테이블의 처음 버킷 수
+#define DISK_MAGIC 0x4b435253U      // 세그먼트 레코드 헤더 확인용
+/* 세그먼트 레코드 하나의 크기 : 헤더 + uri(NUL 포함) + blob, 다음 레코드가 8바이트 경계에서 시작하도록 올림 */
+#define DISK_RECORD_LEN(uri_len, size) ((sizeof(disk_record_t) + (uri_len) + 1 + (size) + 7) & ~(size_t)7)
+#define LARGE_PAGE_SIZE (64 * 1024) // 큰 객체 저장소의 페이지 하나 크기 : 한도를 넘는 응답은 이 크기 페이지를 이어 붙여 담음
+#define LARGE_BUCKETS 1024          // 큰 객체 저장소 해시 버킷 수
+#define LARGE_MAX_SHARE 4           // 객체 하나는 큰 객체 예산의 1/4까지만
+#define RANGE_MAX 16                // 한 요청에서 잘라 보낼 범위 수 상한 (넘으면 Range를 무시하고 전체를 보냄)
+#define GZIP_KEY_SUFFIX " gzip"     // gzip 변형의 캐시 키 = 원본 키 + 이 접미사 (요청 uri에는 공백이 들어갈 수 없어 겹치지 않음)
+#define SNAPSHOT_MAGIC 0x50414e53U // 캐시 스냅샷 파일 확인용
+#define SNAPSHOT_VERSION 2
+#define CONNECT_DELAY_MS 250     // 다음 주소로 연결 시도를 시작하기까지의 간격 기본값 (RFC 8305 권장값)
+
+/* dns_lookup 반환값 */
+#define DNS_OK 0
+#define DNS_FAILED -1
+#define DNS_PENDING -2
+
+/* relay_response 반환값 */
+#define RELAY_OK 0            // 응답을 끝까지 전달
+#define RELAY_FAILED -1       // 응답 도중 끊김
+#define RELAY_NO_RESPONSE -2  // 응답이 한 바이트도 오지 않음 (재사용한 연결이 이미 닫혀 있던 경우 : 새 연결로 재시도 가능)
+#define RELAY_NOT_MODIFIED 1  // 재검증 요청에 304 : 클라이언트에는 아무것도 보내지 않았고 캐시된 항목을 그대로 쓰면 됨
+#define RELAY_STALE 2         // 재검증이 서버 오류로 실패 : 클라이언트에는 아무것도 보내지 않았고 stale-if-error 기간 안이라 만료된 항목을 쓰면 됨
+
+/* 만료 정보(Cache-Control max-age, Expires, Last-Modified)가 없어도 캐시해도 되는 상태 코드 (RFC 9111 4.2.2) */
+#define HTTP_HEURISTIC_STATUS(s) ((s) == 200 || (s) == 203 || (s) == 204 || (s) == 300 || (s) == 301 || (s) == 308 || \
+                                  (s) == 404 || (s) == 405 || (s) == 410 || (s) == 414 || (s) == 501)
+
+/* 크기 클래스 할당기 : 캐시 항목을 실제 크기에 가장 가까운 클래스의 청크에 담고, 반납된 청크는 클래스별 free list에서 재사용 */
+typedef struct slab_t
+{
+  int nclasses;
+  size_t chunk_size[SLAB_MAX_CLASSES];
+  void *free_list[SLAB_MAX_CLASSES]; // 반납된 청크 (청크의 첫 8바이트에 다음 청크 주소)
+  size_t free_bytes;                 // free list에 쌓여 있는 청크 크기 합
+  size_t max_free;                   // free list에 남겨 둘 최대 바이트 (넘치면 시스템에 반환)
+  pthread_mutex_t lock;
+} slab_t;
+
+/* 락 없는 캐시 인덱스용 epoch 기반 회수 : 찾는 스레드마다 기록 하나
+   떼어낸 항목은 전역 epoch가 두 번 넘어간 뒤(= 그때 읽던 스레드가 모두 빠져나간 뒤)에 참조를 반납 */
+typedef struct reclaim_thread_t
+{
+  unsigned long epoch;           // 찾는 중이면 들어올 때의 전역 epoch, 아니면 0
+  int in_use;                    // 이 기록을 쓰는 스레드가 있는지 (스레드가 끝나면 새 스레드가 재사용)
+  struct reclaim_thread_t *next; // 추가만 하는 리스트 : 락 없이 훑음
+} reclaim_thread_t;
+
+typedef struct reclaim_t
+{
+  unsigned long epoch;       // 전역 epoch (1부터)
+  reclaim_thread_t *threads;
+  pthread_mutex_t lock;      // 기록 추가/재사용
+  pthread_key_t key;         // 스레드가 끝날 때 기록을 놓아 줌
+} reclaim_t;
+
+/* 캐시 항목 : 해시 버킷 체인과 LRU 리스트에 동시에 걸려 있음 (링크 필드는 샤드 락으로 보호)
+   항목 헤더, uri, 본문이 청크 하나에 이어서 들어가고, 삽입한 뒤로 uri와 본문은 바뀌지 않음
+   참조 카운트가 0이 될 때 청크를 반납 : 캐시에 걸려 있는 동안 1, 응답을 보내는 중인 요청마다 1 */
 typedef struct cache_entry_t
 {
-  char uri[MAXLINE];
-  char data[MAX_OBJECT_SIZE];
+  unsigned long long hash; // uri의 64비트 지문 : 지문과 길이가 같을 때만 uri 전체를 비교
+  int uri_len;
+  char *uri;  // 청크 안 헤더 바로 뒤
+  char *data; // 청크 안 uri 바로 뒤
   int size;
-  unsigned long timestamp; // 캐시 사용 시간
+  int cls;    // 청크의 크기 클래스 : 캐시 사용량에는 청크 크기 전체가 잡힘
+  int refs;   // 참조 카운트 (atomic)
+  unsigned int charge; // 캐시 사용량에 잡히는 크기 (= 청크 크기)
+  int freq;   // 히트 기록 : CLOCK은 참조 비트, S3-FIFO는 0~3, GDSF는 히트 수 (읽기 락만 잡고도 올리므로 atomic)
+  int list;   // 정책 리스트 번호 (2Q A1in/Am, ARC T1/T2, S3-FIFO small/main)
+  int heap_index;  // GDSF 힙에서의 위치
+  int heap_freq;   // GDSF : priority를 계산할 때의 freq (다르면 축출할 때 다시 계산)
+  double priority; // GDSF 우선순위 H = L + freq / 크기
+  long expires;    // 이 시각(초)까지 fresh : 지나면 조건부 요청으로 재검증 (304를 받으면 이 값만 바꿈, atomic)
+  int refreshing;  // stale-while-revalidate 백그라운드 갱신이 큐에 있거나 진행 중 (atomic)
+  struct cache_entry_t *next; // 버킷 체인
+  struct cache_entry_t *lru_prev; // 정책 리스트 (head 쪽이 최근에 넣은 항목)
+  struct cache_entry_t *lru_next;
+  struct cache_entry_t *retired_next; // 캐시에서 뗀 뒤 참조 반납을 기다리는 리스트 (next는 아직 체인을 따라오는 쪽을 위해 그대로 둠)
+  struct cache_entry_t *demote_next;  // 축출된 뒤 디스크 2차 캐시로 내려 보낼 리스트
+  struct snapshot_map_t *snapshot;    // 스냅샷에서 읽어 들인 항목이면 uri와 본문이 들어 있는 매핑 (아니면 NULL)
 } cache_entry_t;
 
-typedef struct cache_t
+/* 디스크 2차 캐시의 세그먼트 파일 하나 : 파일 전체를 mmap해 두고 끝에 덧붙이기만 함
+   예산을 넘으면 가장 오래된 세그먼트를 통째로 지우고, 파일을 닫는 것은 마지막 참조를 반납할 때 */
+typedef struct disk_segment_t
+{
+  int id;
+  int fd;
+  char *map;   // 파일 전체 (DISK_SEGMENT_SIZE)
+  size_t len;  // 덧붙인 바이트 (디스크 락으로 보호)
+  int refs;    // 세그먼트 목록에 걸려 있는 동안 1, 응답을 보내는 중인 요청마다 1 (atomic)
+  struct disk_segment_t *next; // 오래된 것 -> 최근 것
+} disk_segment_t;
+
+/* 세그먼트 레코드 헤더 : 뒤에 uri(NUL 포함)와 캐시 blob(상태 라인 + 헤더 + 본문)이 이어짐 */
+typedef struct disk_record_t
+{
+  unsigned int magic;
+  unsigned int uri_len;
+  unsigned int size;
+  unsigned int reserved;
+  unsigned long long hash;
+  long long expires;
+} disk_record_t;
+
+/* 디스크 인덱스 항목 : uri -> 세그먼트 안 레코드 위치 (본문은 메모리에 두지 않음) */
+typedef struct disk_entry_t
+{
+  unsigned long long hash;
+  int uri_len;
+  char *uri;
+  disk_segment_t *seg;
+  size_t off; // 세그먼트 안 레코드 시작
+  int size;   // blob 크기
+  int hits;   // 이 위치에 쓴 뒤로 디스크에서 응답한 횟수 : GC가 다시 쓸지 판단
+  long expires;
+  struct disk_entry_t *next;
+} disk_entry_t;
+
+/* 메모리 캐시에서 축출된 항목을 받는 디스크 2차 캐시 : 추가만 하는 세그먼트 로그 + 메모리 인덱스 (락 하나로 보호) */
+typedef struct disk_cache_t
+{
+  int enabled;
+  char dir[MAXLINE];
+  size_t budget;          // 세그먼트 파일 크기 합 상한
+  disk_entry_t **buckets;
+  unsigned long nbuckets; // 항상 2의 거듭제곱
+  int count;
+  size_t bytes;           // 인덱스가 가리키는 blob 크기 합
+  disk_segment_t *oldest;
+  disk_segment_t *active; // 지금 덧붙이는 세그먼트 (= 목록 끝)
+  int nsegments;
+  int next_id;
+  pthread_mutex_t lock;
+  unsigned long hits;        // 디스크에서 응답한 횟수
+  unsigned long misses;      // 메모리에도 디스크에도 없던 횟수
+  unsigned long writes;      // 세그먼트에 쓴 레코드 수 (GC가 다시 쓴 것 제외)
+  unsigned long skipped;     // 같은 레코드가 이미 있어 쓰지 않은 축출 수
+  unsigned long gc_segments; // 지운 세그먼트 수
+  unsigned long gc_rewrites; // GC가 활성 세그먼트로 다시 쓴 레코드 수
+  unsigned long gc_dropped;  // GC가 버린 레코드 수
+} disk_cache_t;
+
+/* 큰 객체 저장소의 페이지 : 응답을 받으면서 앞에서부터 채우고, 다 채운 객체는 바뀌지 않으므로 읽을 때는 락이 필요 없음 */
+typedef struct large_page_t
+{
+  struct large_page_t *next;
+  int len;
+  char data[LARGE_PAGE_SIZE];
+} large_page_t;
+
+/* MAX_OBJECT_SIZE를 넘는 응답 하나 : 첫 페이지에 상태 라인과 헤더 전체가 들어 있어야 저장 */
+typedef struct large_object_t
+{
+  unsigned long long hash;
+  int uri_len;
+  char *uri;     // 저장할 때 정해짐 (채우는 중에는 NULL)
+  size_t size;   // blob 크기
+  int npages;
+  long expires;
+  int refs;      // 참조 카운트 (atomic) : 저장소가 하나, 보내는 중인 요청마다 하나
+  large_page_t *pages;
+  large_page_t *tail;
+  struct large_object_t *next; // 버킷 체인
+  struct large_object_t *lru_prev; // LRU (head 쪽이 최근에 쓴 객체)
+  struct large_object_t *lru_next;
+} large_object_t;
+
+/* 한도를 넘는 큰 응답을 받는 저장소 : 메모리 캐시와 예산을 따로 잡고 LRU로 축출 (락 하나로 보호) */
+typedef struct large_cache_t
 {
-  cache_entry_t entries[MAX_OBJ_NUM];
+  int enabled;
+  size_t budget; // 페이지 크기 합 상한
+  size_t bytes;  // 저장한 객체들의 페이지 크기 합
   int count;
-  unsigned long time; // 캐시가 사용된 총 시간(= 캐시가 사용된 횟수)
+  large_object_t *buckets[LARGE_BUCKETS];
+  large_object_t *lru_head;
+  large_object_t *lru_tail;
   pthread_mutex_t lock;
+  unsigned long hits;      // 큰 객체 저장소에서 응답한 횟수
+  unsigned long misses;    // 메모리 캐시에도 큰 객체 저장소에도 없던 횟수
+  unsigned long fills;     // 채워서 저장한 객체 수
+  unsigned long dropped;   // 너무 크거나 저장하면 안 되는 응답이라 버린 수
+  unsigned long evictions;
+} large_cache_t;
+
+/* 캐시 blob : 메모리 / 디스크 항목은 data부터 이어져 있고, 큰 객체는 페이지 체인 */
+typedef struct blob_t
+{
+  char *data;  // 처음부터 이어져 있는 부분 (상태 라인과 헤더가 들어 있음)
+  size_t len;  // data부터 이어져 있는 바이트 수
+  size_t size; // blob 전체 크기
+  large_page_t *pages; // 큰 객체면 첫 페이지 (아니면 NULL)
+} blob_t;
+
+/* Range 요청의 바이트 범위 하나 (본문 기준, end 포함) */
+typedef struct range_t
+{
+  long start;
+  long end;
+} range_t;
+
+/* 범위 응답의 조각 하나 : 새로 만든 텍스트(상태 라인, 헤더, multipart 경계) 또는 blob의 한 구간 */
+typedef struct range_piece_t
+{
+  char *text;  // NULL이면 blob의 off부터 len바이트
+  size_t off;
+  size_t len;
+} range_piece_t;
+
+/* 캐시 히트를 206 / 416으로 보낼 순서 : 헤더, (부분 헤더, 구간)..., 닫는 경계 */
+typedef struct range_plan_t
+{
+  char *text; // 조각 텍스트들을 담은 버퍼 (Malloc)
+  range_piece_t pieces[2 * RANGE_MAX + 2];
+  int npieces;
+  size_t total; // 응답 전체 바이트 수
+} range_plan_t;
+
+/* 캐시 히트의 gzip 변형 : 캐시에서 찾았으면 entry 참조를, 방금 압축했으면 buf를 들고 있음 */
+typedef struct gzip_variant_t
+{
+  cache_entry_t *entry;
+  char *buf;
+  char *data;
+  int size;
+} gzip_variant_t;
+
+/* gzip 압축 CPU 예산과 카운터 (모두 atomic) */
+typedef struct gzip_stats_t
+{
+  long window;             // 지금 예산을 세는 1초 구간 (time())
+  long spent_ns;           // 그 구간에 압축에 쓴 CPU 시간
+  long total_ns;           // 지금까지 압축에 쓴 CPU 시간
+  unsigned long compressed;  // 압축한 응답 수
+  unsigned long hits;        // 캐시된 gzip 변형으로 응답한 수
+  unsigned long over_budget; // 예산을 넘어 압축하지 않고 원본을 보낸 수
+  unsigned long bytes_in;    // 압축 전 blob 크기 합
+  unsigned long bytes_out;   // 압축한 blob 크기 합
+} gzip_stats_t;
+
+/* 락 없는 인덱스 : cache_grow가 바꿔 끼운 예전 버킷 배열 (항목 limbo와 같은 epoch 칸에 두었다가 해제) */
+typedef struct retired_buckets_t
+{
+  cache_entry_t **buckets;
+  struct retired_buckets_t *next;
+} retired_buckets_t;
+
+/* 축출된 항목의 지문만 기억하는 ghost 리스트 (2Q A1out, ARC B1/B2, S3-FIFO ghost)
+   FIFO 링 + 지문으로 찾는 열린 주소 해시 (링 칸 번호 + 1, 0이면 빈 칸) */
+typedef struct ghost_t
+{
+  unsigned long long *ring; // 지문 (0이면 이미 꺼낸 칸)
+  unsigned int *ring_size;
+  int cap;
+  int head;  // 다음에 쓸 칸
+  int count; // head 앞쪽으로 쓰인 칸 수 (가장 오래된 칸 = head - count)
+  int *table;
+  int mask;
+  size_t bytes;     // 기억하고 있는 항목 크기 합
+  size_t max_bytes; // 넘으면 오래된 것부터 잊음
+} ghost_t;
+
+/* TinyLFU 빈도 추정기 : 도어키퍼(Bloom filter)를 지난 키만 count-min sketch에 세고,
+   더한 횟수가 sample에 닿으면 모든 카운터를 반으로 나누고 도어키퍼를 비움 (오래된 인기를 잊음)
+   읽기 락만 잡은 히트에서도 세므로 카운터는 atomic으로 다루고, 경합으로 한두 번 덜 세는 것은 허용 */
+typedef struct sketch_t
+{
+  unsigned char *counters;    // SKETCH_ROWS행 x width
+  unsigned long long *door;   // 도어키퍼 비트
+  unsigned int mask;          // width - 1
+  unsigned int door_mask;     // 도어키퍼 비트 수 - 1
+  unsigned long additions;    // 지난 aging 이후 센 횟수 (atomic)
+  unsigned long sample;       // 이만큼 세면 aging (= 10 x width)
+} sketch_t;
+
+/* 캐시 샤드 : uri 지문으로 고르며 샤드마다 해시 테이블, 정책 리스트, 예산, 락이 따로
+   찾기는 읽기 락, 삽입/축출은 쓰기 락 (샤드끼리 같은 캐시 라인을 쓰지 않도록 64바이트 정렬) */
+typedef struct cache_shard_t
+{
+  pthread_rwlock_t lock;
+  cache_entry_t **buckets;
+  unsigned long nbuckets; // 항상 2의 거듭제곱 (항목 수가 버킷 수를 넘으면 두 배로 늘림)
+  int count;
+  size_t used;            // 캐시 항목이 차지한 청크 크기 합
+  size_t budget;          // used가 이 값을 넘지 않도록 축출 정책이 고른 항목을 내보냄
+  cache_entry_t lists[2]; // 정책 리스트 sentinel : lru_next가 head(가장 최근), lru_prev가 tail
+  size_t list_bytes[2];
+  ghost_t ghosts[2];
+  int ghost_hit;          // 이번 삽입의 키가 어느 ghost에 있었는지 (0 없음, 1 ghosts[0], 2 ghosts[1])
+  size_t arc_target;      // ARC : T1 목표 바이트 (p)
+  cache_entry_t **heap;   // GDSF : priority 최소 힙
+  int heap_len;
+  int heap_cap;
+  double inflation;       // GDSF : 마지막으로 축출한 항목의 priority (L)
+  sketch_t sketch;        // TinyLFU : 이 샤드 키들의 최근 요청 빈도
+  unsigned long admitted; // TinyLFU를 통과한 삽입 수 (atomic)
+  unsigned long rejected; // 축출될 항목보다 덜 쓰일 것 같아 거절한 삽입 수 (atomic)
+  unsigned long hits;      // 캐시에서 응답한 횟수 (atomic : 읽기 락만 잡고 올림)
+  unsigned long misses;    // 캐시에 없던 횟수 (atomic)
+  unsigned long hit_bytes;  // 캐시에서 응답한 본문 바이트 (atomic)
+  unsigned long miss_bytes; // 서버에서 받아 와 캐시에 넣은 바이트
+  unsigned long evictions; // 공간이 모자라 내보낸 항목 수
+  unsigned long inserts;   // 삽입 횟수
+  unsigned long insert_lock_ns;     // 삽입(축출 포함)이 락을 잡고 있던 시간 합 (ns)
+  unsigned long insert_lock_max_ns; // 삽입 한 번이 락을 잡고 있던 최대 시간 (ns)
+  cache_entry_t *limbo[3];          // 락 없는 인덱스 : 떼어냈지만 아직 읽는 쪽이 있을 수 있는 항목 (epoch % 3별)
+  retired_buckets_t *limbo_buckets[3]; // 락 없는 인덱스 : 아직 읽는 쪽이 있을 수 있는 예전 버킷 배열 (limbo와 같은 칸, 같은 epoch)
+  unsigned long limbo_epoch[3];     // limbo[i], limbo_buckets[i]에 넣을 때의 전역 epoch
+} __attribute__((aligned(64))) cache_shard_t;
+
+/* 축출 정책 : 시작할 때 하나 골라 모든 샤드가 사용
+   hit 외에는 모두 샤드 쓰기 락을 잡은 상태로 호출 */
+typedef struct cache_policy_t
+{
+  char *name;
+  int write_on_hit; // hit이 정책 리스트를 바꾸면 1 : 찾기가 읽기 락 대신 쓰기 락을 잡음 (락 없는 인덱스도 쓰지 않음)
+  void (*init)(cache_shard_t *shard);
+  void (*hit)(cache_shard_t *shard, cache_entry_t *e);        // write_on_hit이 아니면 읽기 락/epoch 안 : freq만 atomic으로 바꿈
+  void (*prepare)(cache_shard_t *shard, unsigned long long hash, size_t charge); // 삽입 전 (축출보다 먼저) : ghost 확인
+  void (*admit)(cache_shard_t *shard, cache_entry_t *e);      // 새 항목을 정책 구조에 넣음
+  cache_entry_t *(*victim)(cache_shard_t *shard);             // 축출할 항목을 골라 정책 구조에서 떼어냄 (비어 있으면 NULL)
+  void (*remove)(cache_shard_t *shard, cache_entry_t *e);     // 교체로 빠지는 항목을 정책 구조에서 떼어냄
+  cache_entry_t *(*peek)(cache_shard_t *shard, cache_entry_t *after); // 다음에 축출될 항목 (after가 있으면 그다음 항목, 구조는 바꾸지 않음, 읽기 락으로 충분) : TinyLFU가 비교
+} cache_policy_t;
+
+typedef struct cache_t
+{
+  cache_policy_t *policy;
+  cache_shard_t shards[CACHE_MAX_SHARDS];
+  int nshards;
+  int lockfree;  // CACHE_INDEX_LOCKFREE : 찾기가 락 없이 버킷 체인을 따라감
+  int admission; // TinyLFU 삽입 필터 사용
+  size_t budget; // 모든 샤드를 합친 예산 (샤드마다 budget / nshards)
+  slab_t slab;   // 모든 샤드가 함께 쓰는 청크 할당기 (자체 락)
+  disk_cache_t *l2; // 축출한 항목을 내려 보낼 디스크 2차 캐시 (없으면 NULL)
+  unsigned long revalidations; // 만료된 항목을 조건부 요청으로 확인한 횟수 (atomic)
+  unsigned long not_modified;  // 그중 304를 받아 본문을 다시 받지 않은 횟수 (atomic)
+  unsigned long uncacheable;   // no-store/private 등으로 저장하지 않은 응답 수 (atomic)
+  unsigned long stale_revalidate; // stale-while-revalidate로 만료된 항목을 바로 보낸 횟수 (atomic)
+  unsigned long stale_error;      // stale-if-error로 서버 오류 대신 만료된 항목을 보낸 횟수 (atomic)
+  unsigned long refreshes;        // 백그라운드 갱신을 끝낸 횟수 (atomic)
+  unsigned long range_hits;       // 캐시된 응답을 잘라 206 / 416으로 보낸 횟수 (atomic)
+  unsigned long range_misses;     // 캐시에 없어 범위를 서버에서 바로 받은 횟수 (atomic)
+  unsigned long range_fills;      // 범위 미스 뒤 백그라운드에서 전체 객체를 받아 온 횟수 (atomic)
 } cache_t;
 
+/* 응답 헤더에서 읽은 캐시 관련 정보 (시각은 모두 초, 없으면 -1) */
+typedef struct freshness_t
+{
+  int status;
+  long date;
+  long expires;       // 형식이 틀린 Expires는 0 (= 이미 만료)
+  long last_modified;
+  long age;
+  long max_age;
+  long s_maxage;      // 공유 캐시용 : max-age보다 우선
+  int no_store;
+  int no_cache;       // 저장은 하되 쓸 때마다 재검증
+  int private;        // 공유 캐시(프록시)는 저장하면 안 됨
+  int validator;      // ETag 또는 Last-Modified가 있어 재검증할 수 있는지
+  int vary_star;      // Vary: * : 어떤 요청에도 그대로 쓸 수 없음
+  long stale_while;   // stale-while-revalidate : 만료 후 이 시간 동안은 바로 보내고 백그라운드에서 재검증
+  long stale_if_error; // stale-if-error : 만료 후 이 시간 동안은 재검증이 실패하면 만료된 응답을 보냄
+  int must_revalidate; // must-revalidate / proxy-revalidate : 만료된 응답은 재검증 없이 쓸 수 없음
+} freshness_t;
+
+/* 백그라운드 갱신 작업 큐 : stale-while-revalidate 재검증은 캐시 항목 참조 하나를,
+   범위 미스 뒤 전체 객체 채우기는 리더로 잡아 둔 요청 합치기 항목을 들고 있음 */
+typedef struct refresh_job_t
+{
+  cache_entry_t *e;
+  struct flight_t *flight; // 전체 객체 채우기면 리더로 잡아 둔 flight (재검증이면 NULL)
+  struct refresh_job_t *next;
+} refresh_job_t;
+
+typedef struct refresh_queue_t
+{
+  refresh_job_t *jobs; // LIFO (순서는 중요하지 않음)
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} refresh_queue_t;
+
+/* 캐시 스냅샷 파일 : 헤더 + 항목마다 색인 하나 + 데이터 영역(항목마다 uri(NUL 포함)와 blob)
+   색인만 앞에 모아 두어서 읽어 들일 때는 색인 페이지만 건드리고, 본문 페이지는 처음 히트할 때 읽힘 */
+typedef struct snapshot_header_t
+{
+  unsigned int magic;
+  unsigned int version;
+  unsigned long long count;
+} snapshot_header_t;
+
+typedef struct snapshot_index_t
+{
+  unsigned long long hash;
+  unsigned long long off; // 파일 안 uri 위치 (blob은 uri_len + 1 뒤)
+  long long expires;
+  unsigned int uri_len;
+  unsigned int size;
+} snapshot_index_t;
+
+/* 읽어 들인 스냅샷 파일의 매핑 : 매핑을 가리키는 항목마다 참조 하나, 마지막 항목이 해제되면 munmap */
+typedef struct snapshot_map_t
+{
+  char *map;
+  size_t len;
+  int refs; // 참조 카운트 (atomic)
+} snapshot_map_t;
+
+typedef struct proxy_config_t
+{
+  int mode;  // MODE_THREAD or MODE_EPOLL
+  int loops; // epoll 모드에서 돌릴 이벤트 루프(스레드) 개수
+  int workers;     // 처음 띄울 워커 스레드 수
+  int min_workers; // 워커 스레드 수 하한
+  int max_workers; // 워커 스레드 수 상한
+  int queue_size;  // 연결 대기 큐 크기 (가득 차면 503 응답)
+  int shards;      // SO_REUSEPORT 리스닝 소켓 개수 : 소켓마다 코어에 고정된 acceptor가 따로 accept
+  int upstream_max_idle;     // (host, port)별로 유지할 유휴 서버 연결 수 (0이면 매 요청마다 새 연결 + Connection: close)
+  int upstream_idle_timeout; // 유휴 서버 연결을 버리기까지의 시간 (초)
+  int client_idle_timeout;   // 클라이언트 연결에서 다음 요청을 기다리는 시간 (초, 0이면 요청 하나 처리 후 종료) : thread 모드만, epoll 모드는 응답 하나 보내고 항상 닫음
+  int dns_ttl;               // 조회에 성공한 이름을 캐시에 두는 시간 (초)
+  int dns_negative_ttl;      // 조회에 실패한 이름을 캐시에 두는 시간 (초)
+  int connect_timeout;       // 서버 연결 전체 제한 시간 (ms) : 모든 주소 시도를 합쳐서
+  int connect_delay;         // 앞 시도가 끝나지 않았을 때 다음 주소 시도를 시작하기까지의 간격 (ms)
+  int cache_size;            // 캐시가 쓸 수 있는 최대 바이트 (항목 헤더와 uri 포함)
+  int cache_shards;          // 캐시 샤드 수 (샤드 하나의 예산이 가장 큰 객체보다 작아지지 않을 만큼만 사용)
+  int cache_index;           // CACHE_INDEX_LOCKED or CACHE_INDEX_LOCKFREE (LOCKFREE는 write_on_hit이 아닌 정책에서만)
+  int cache_policy;          // cache_policies[] 번호
+  int cache_admission;       // 1이면 TinyLFU로 삽입을 거름 (0이면 캐시할 수 있는 응답은 모두 삽입)
+  int bench;                 // BENCH_INDEX / BENCH_POLICY면 프록시 대신 벤치마크를 돌리고 종료
+  char *disk_dir;            // 디스크 2차 캐시 세그먼트를 둘 디렉터리 (NULL이면 사용 안 함)
+  int disk_size;             // 디스크 2차 캐시 크기 (MB)
+  char *cache_snapshot;      // 캐시 스냅샷 파일 (NULL이면 사용 안 함) : 시작할 때 읽고, SIGTERM/SIGUSR2에 씀
+  int cache_default_ttl;     // 만료 정보가 없는 응답을 fresh로 보는 최대 시간 (초) : Last-Modified가 있으면 그 나이의 10%까지
+  int stale_while_revalidate; // 응답에 stale-while-revalidate가 없을 때 쓰는 기간 (초, 0이면 만료되면 바로 재검증)
+  int stale_if_error;        // 응답에 stale-if-error가 없을 때 쓰는 기간 (초, 0이면 서버 오류를 그대로 전달)
+  int large_cache_size;      // MAX_OBJECT_SIZE를 넘는 응답을 담는 큰 객체 저장소 크기 (MB, 0이면 사용 안 함)
+  int cache_key_sort;        // 1이면 캐시 키를 만들 때 쿼리 파라미터를 정렬 (파라미터 순서를 무시하는 서버에서만)
+  int gzip_level;            // Accept-Encoding: gzip 클라이언트에 압축해서 보낼 때의 zlib 압축 수준 (1~9, 0이면 압축 안 함)
+  int gzip_min_size;         // 이보다 작은 본문은 압축하지 않음 (바이트)
+  int gzip_cpu_ms;           // 1초마다 압축에 쓸 수 있는 CPU 시간 (ms, 모든 스레드 합) : 넘으면 원본을 그대로 보냄
+} proxy_config_t;
+
+/* 서버 연결 결과 카운터 : 어떤 주소 계열이 이겼는지 */
+typedef struct connect_stats_t
+{
+  unsigned long ipv6;     // IPv6 주소로 연결된 횟수
+  unsigned long ipv4;     // IPv4 주소로 연결된 횟수
+  unsigned long timeouts; // 제한 시간 안에 아무 주소로도 연결하지 못한 횟수
+  unsigned long failures; // 모든 주소가 거부/실패한 횟수
+  unsigned long total_ms; // 연결에 성공하기까지 걸린 시간의 합 (ms)
+} connect_stats_t;
+
+/* 다시 쓰려고 열어 둔 서버 연결 하나 */
+typedef struct upstream_conn_t
+{
+  int fd;
+  char hostname[UPSTREAM_HOST_MAX];
+  char port[8];
+  long idle_since; // 풀에 들어온 시각 (ms)
+  struct upstream_conn_t *next;
+} upstream_conn_t;
+
+/* (hostname, port)를 키로 유휴 HTTP/1.1 서버 연결을 모아 두는 풀 */
+typedef struct upstream_pool_t
+{
+  upstream_conn_t *buckets[UPSTREAM_BUCKETS];
+  unsigned long reused; // 풀에서 꺼내 재사용한 횟수
+  unsigned long opened; // 새로 연결한 횟수
+  pthread_mutex_t lock;
+} upstream_pool_t;
+
+/* 조회 결과 주소 하나 : addrinfo 목록은 스레드 사이에 공유하기 어려우므로 값으로 복사해 둠 */
+typedef struct dns_addr_t
+{
+  int family;
+  int socktype;
+  int protocol;
+  socklen_t addrlen;
+  struct sockaddr_storage addr;
+} dns_addr_t;
+
+typedef struct dns_addrs_t
+{
+  int n;
+  dns_addr_t addr[DNS_MAX_ADDRS];
+} dns_addrs_t;
+
+typedef enum dns_status_t
+{
+  DNS_ENTRY_PENDING, // 조회 중
+  DNS_ENTRY_OK,      // 주소 있음
+  DNS_ENTRY_FAILED   // 조회 실패 (negative 캐시)
+} dns_status_t;
+
+typedef struct dns_shard_t dns_shard_t;
+
+/* (hostname, port) 하나의 조회 결과 : 필드는 shard->lock으로 보호 (hostname, port, shard는 만든 뒤 바뀌지 않음) */
+typedef struct dns_entry_t
+{
+  char hostname[UPSTREAM_HOST_MAX];
+  char port[8];
+  dns_shard_t *shard;
+  dns_status_t status;
+  int refreshing;     // 만료 전에 미리 다시 조회하는 중 (그동안은 기존 주소로 응답)
+  int err;            // 실패한 경우 getaddrinfo 에러 코드
+  dns_addrs_t addrs;
+  long expires;       // 만료 시각 (ms)
+  unsigned long hits; // 마지막 조회 이후 사용 횟수 : 미리 갱신할 hot 이름 판단
+  int waiters[DNS_MAX_WAITERS]; // 조회가 끝나면 깨울 이벤트 루프의 eventfd
+  int nwaiters;
+  int users;                    // 결과를 기다리는 블로킹 조회 수 (0이 될 때까지 지우지 않음)
+  struct dns_entry_t *next;     // 버킷 체인
+  struct dns_entry_t *next_job; // resolver 작업 큐
+} dns_entry_t;
+
+struct dns_shard_t
+{
+  dns_entry_t *buckets[DNS_BUCKETS];
+  pthread_mutex_t lock;
+  pthread_cond_t done; // 조회가 끝날 때마다 broadcast : 같은 이름을 기다리는 블로킹 조회를 깨움
+};
+
+/* 이름 조회 캐시 : 샤드별 해시 맵 + resolver 스레드가 처리하는 작업 큐 */
+typedef struct dns_cache_t
+{
+  dns_shard_t shards[DNS_SHARDS];
+  dns_entry_t *jobs;      // 조회할 항목 (LIFO, 순서는 중요하지 않음)
+  pthread_mutex_t job_lock;
+  pthread_cond_t job_cond;
+  unsigned long hits;      // 캐시에서 바로 답한 횟수
+  unsigned long misses;    // 새로 조회한 횟수
+  unsigned long failures;  // 조회 실패 횟수
+  unsigned long refreshes; // 만료 전에 미리 갱신한 횟수
+} dns_cache_t;
+
+/* 서버 응답 헤더에서 알아낸 본문 길이 정보 */
+typedef struct response_info_t
+{
+  int status;          // 상태 코드
+  long content_length; // Content-Length (없으면 -1)
+  int chunked;         // Transfer-Encoding: chunked
+  int keep_alive;      // 응답 후에도 서버가 연결을 유지하는지
+} response_info_t;
+
+/* 본문이 없는 응답 (1xx, 204, 304) */
+#define RESPONSE_NO_BODY(info) (((info)->status >= 100 && (info)->status < 200) || (info)->status == 204 || (info)->status == 304)
+/* 연결을 닫지 않아도 본문 끝을 알 수 있는 응답 */
+#define RESPONSE_FRAMED(info) (RESPONSE_NO_BODY(info) || (info)->chunked || (info)->content_length >= 0)
+
+typedef enum flight_state_t
+{
+  FLIGHT_ACTIVE, // 리더가 받아 오는 중
+  FLIGHT_DONE,   // 응답 전체를 받음
+  FLIGHT_FAILED  // 실패했거나 캐시할 수 없는 응답 : 따라붙은 요청은 직접 받아 와야 함
+} flight_state_t;
+
+typedef struct flight_shard_t flight_shard_t;
+
+/* 같은 URI에 대한 진행 중인 서버 요청 하나 : 리더가 data에 모으는 응답을 따라붙은 요청들이 도착하는 대로 읽어 감
+   data가 차서 큰 객체 저장소 페이지로 옮겨 모으면 그 객체(large)에서 이어서 읽음
+   data와 페이지는 앞에서부터 덧붙이기만 하므로 size 이전 바이트는 락 없이 읽어도 됨 (나머지 필드는 shard->lock으로 보호) */
+typedef struct flight_t
+{
+  char uri[MAXLINE];
+  flight_shard_t *shard; // 들어 있는 샤드 (만든 뒤 바뀌지 않음)
+  char *data;     // MAX_OBJECT_SIZE 버퍼
+  long size;      // 공개된 바이트 수
+  int head_len;   // 상태 라인 + 헤더 길이 (마지막 빈 줄 제외, 아직 모르면 -1)
+  int framed;     // 연결을 닫지 않아도 본문 끝을 알 수 있는 응답인지
+  int sized;      // 끝까지 모을 수 있다고 이미 아는 응답인지 : 아니면 따라붙은 요청은 DONE이 될 때까지 보내기 시작하지 않음
+  large_object_t *large; // 페이지로 옮겨 모으는 중인 객체 (참조 하나를 잡고 있음, 아니면 NULL)
+  flight_state_t state;
+  int refs;       // 리더 + 따라붙은 요청 수 : 0이 되면 해제
+  pthread_cond_t progress; // 바이트가 더 도착하거나 상태가 바뀔 때마다 broadcast
+  struct flight_t *next;
+} flight_t;
+
+struct flight_shard_t
+{
+  flight_t *buckets[FLIGHT_BUCKETS];
+  pthread_mutex_t lock;
+};
+
+/* 진행 중인 서버 요청 표 : URI 해시로 나눈 샤드별 해시 맵 */
+typedef struct flight_table_t
+{
+  flight_shard_t shards[FLIGHT_SHARDS];
+  unsigned long leaders;   // 서버에 실제로 보낸 요청 수 (atomic)
+  unsigned long followers; // 진행 중인 요청에 따라붙은 수 (atomic)
+  unsigned long fallbacks; // 리더가 실패해 직접 받으러 간 수 (atomic)
+} flight_table_t;
+
+/* 서버 응답을 캐시용으로 모으는 상태 : single-flight 리더면 모으는 대로 따라붙은 요청들에게 공개 */
+typedef struct capture_t
+{
+  char *buf;      // 모으는 버퍼 (MAX_OBJECT_SIZE)
+  int size;       // 모은 바이트 수
+  int on;         // 아직 모으는 중인지 (한도를 넘으면 0)
+  int head_len;   // 상태 라인 + 헤더 길이 (마지막 빈 줄 제외, 헤더를 다 받기 전에는 -1)
+  int framed;     // 연결을 닫지 않아도 본문 끝을 알 수 있는 응답인지
+  int sized;      // 본문 길이를 알고 buf나 큰 객체 저장소에 다 담을 수 있는 응답인지 (끝까지 모으기를 포기하지 않음)
+  int client_ok;  // 클라이언트에 계속 쓸 수 있는지
+  flight_t *flight;
+  cache_entry_t *revalidate; // 재검증 중인 만료된 캐시 항목 (아니면 NULL) : 304면 클라이언트에 쓰지 않고 RELAY_NOT_MODIFIED
+  large_object_t *large;     // buf 한도를 넘어 큰 객체 저장소 페이지로 옮겨 모으는 중 (아니면 NULL, 이때 on은 0)
+  int range;      // 클라이언트의 Range / If-Range를 서버에 그대로 전달 (범위 미스 : 206은 저장하지 않음)
+} capture_t;
+
+/* 서버에서 계속 읽어야 하는지 : 받을 클라이언트가 있거나, 따라붙은 요청(또는 백그라운드 채우기)을 위해 모으는 중 */
+#define CAPTURE_NEEDED(cap) ((cap)->client_ok || (((cap)->on || (cap)->large != NULL) && (cap)->flight != NULL))
+
+/* accept 루프 하나(= 리스닝 소켓 하나)의 상태와 부하 분산 확인용 카운터 */
+typedef struct shard_t
+{
+  int id;
+  int listen_fd;
+  unsigned long accepted; // accept한 연결 수
+  unsigned long rejected; // 큐가 가득 차 503으로 돌려보낸 연결 수
+} shard_t;
+
+/* 연결 fd를 담는 유한 원형 버퍼 (CS:APP sbuf 패키지) */
+typedef struct sbuf_t
+{
+  int *buf;    // 버퍼 배열
+  int n;       // 최대 슬롯 수
+  int front;   // buf[(front+1)%n]이 첫 번째 아이템
+  int rear;    // buf[rear%n]이 마지막 아이템
+  sem_t mutex; // buf 접근 보호
+  sem_t slots; // 빈 슬롯 수
+  sem_t items; // 채워진 아이템 수
+} sbuf_t;
+
+typedef struct worker_pool_t
+{
+  sbuf_t queue;
+  int nthreads;          // 현재 워커 수
+  int busy;              // 요청 처리 중인 워커 수
+  int idle_ticks;        // 큐가 연속으로 비어 있던 조정 주기 수
+  pthread_mutex_t lock;  // nthreads, busy 보호
+} worker_pool_t;
+
+/* epoll 모드의 연결별 상태 : 요청 읽기 -> 파싱 -> 연결 -> 중계 -> 종료 */
+typedef enum conn_state_t
+{
+  CONN_READ_REQUEST,
+  CONN_PARSE,
+  CONN_RESOLVE,
+  CONN_CONNECT,
+  CONN_SEND_REQUEST,
+  CONN_RELAY,
+  CONN_CLOSE
+} conn_state_t;
+
+typedef struct conn_t conn_t;
+
+typedef struct event_loop_t
+{
+  int epoll_fd;
+  int listen_fd;
+  shard_t *shard;
+  conn_t *closed; // 이번 epoll_wait 묶음에서 닫힌 연결 : 같은 묶음에 이벤트가 남아 있을 수 있어 나중에 해제
+  int dns_fd;        // 이름 조회가 끝나면 resolver 스레드가 깨우는 eventfd
+  conn_t *resolving; // 이름 조회를 기다리는 연결
+  conn_t *connecting; // 서버에 연결 중인 연결 : epoll_wait 제한 시간을 이 목록의 가장 가까운 타이머로 정함
+} event_loop_t;
+
+struct conn_t
+{
+  conn_state_t state;
+  int client_fd;
+  int server_fd; // 아직 서버와 연결하지 않았으면 -1
+  conn_t *next_closed;
+
+  char request[MAXLINE]; // 클라이언트가 보낸 요청 라인 + 헤더
+  size_t request_len;
+  char uri[MAXLINE];
+  char key[MAXLINE]; // uri를 정규화한 캐시 키
+
+  char http_header[MAXLINE]; // 서버로 보낼 재구성한 헤더
+  size_t header_len;
+  size_t header_off;
+
+  char hostname[UPSTREAM_HOST_MAX];
+  char port[8];
+  int resolving;           // loop->resolving 목록에 들어 있는지
+  conn_t *next_resolving;
+  dns_addrs_t addrs;       // 연결 후보 주소 목록 (RFC 8305 순서로 정렬)
+  int addr_next;           // 다음에 시도할 주소
+  int attempt_fds[DNS_MAX_ADDRS]; // 주소별 진행 중인 연결 시도 (i < addr_next, 끝났으면 -1)
+  int connecting;          // loop->connecting 목록에 들어 있는지
+  conn_t *next_connecting;
+  long next_attempt_at;    // 다음 주소 시도를 시작할 시각 (ms)
+  long connect_deadline;   // 연결 전체 제한 시각 (ms, 0이면 아직 시작 전)
+
+  char buf[RELAY_BUFSIZE]; // 서버 -> 클라이언트 중계 버퍼
+  char *out;               // 클라이언트에 쓸 데이터 (buf 또는 캐시 항목의 본문)
+  cache_entry_t *hit;      // 캐시 히트로 응답 중인 항목 (참조를 잡고 있음)
+  disk_segment_t *disk_seg; // 디스크 2차 캐시 히트로 응답 중인 세그먼트 (참조를 잡고 있음)
+  int revalidating;        // hit이 만료된 항목이고 서버 응답 헤더를 기다리는 중 (304면 hit으로 응답)
+  large_object_t *large;   // 큰 객체 저장소 히트로 응답 중인 객체 (참조를 잡고 있음)
+  large_page_t *large_page; // 그중 지금 쓰고 있는 페이지
+  large_object_t *fill;    // cache_buf 한도를 넘은 응답을 페이지로 옮겨 모으는 중 (아니면 NULL)
+  char *range_buf;         // 캐시 히트를 잘라 만든 206 / 416 응답 (아니면 NULL)
+  gzip_variant_t gzip;     // 캐시 히트를 gzip 변형으로 응답 중 (entry, buf 모두 NULL이면 아님)
+  size_t out_len;
+  size_t out_off;
+  int server_eof; // 서버가 응답을 다 보냈는지
+  int unread_input; // 요청을 다 읽지 않고 에러 응답을 보냄 : 닫기 전에 이미 받은 입력을 비움
+
+  char *cache_buf; // 캐시에 저장할 응답 (MAX_OBJECT_SIZE를 넘으면 NULL로 포기)
+  int cache_size;
+  int cache_head;  // cache_buf의 상태 라인 + 헤더 + 빈 줄 길이 (hop-by-hop 헤더를 뺀 뒤, 헤더를 다 받기 전에는 0)
+  response_info_t cache_info; // 모으는 응답의 상태 코드와 본문 길이 정보
+
+  int pipe_fds[2];   // 캐시를 포기한 뒤 splice 중계에 쓰는 pipe (안 쓰면 -1)
+  size_t pipe_bytes; // pipe에 들어 있는, 아직 클라이언트로 못 보낸 바이트
+};
+
 void doit(int fd);
+int serve_request(int fd, rio_t *rio);
+int client_wait(rio_t *rio, int timeout_sec);
+int read_request_headers(rio_t *rio, char *headers, size_t size);
+int client_keep_alive(char *version, char *headers);
+int request_has_body(char *method, char *headers);
+int send_cached(int fd, char *data, int size, int file_fd, off_t file_off, int keep_client);
 int parse_uri(char* uri, char* hostname, char* path, int* port);
-void makeHttpHeader(char* http_header, char* hostname, char* path, int port, rio_t* client_rio);
-void* thread(void* connection_fd_ptr);
+void cache_key(char *uri, char *key);
+void uri_normalize_escapes(char *s);
+void uri_remove_dots(char *path);
+void uri_sort_query(char *query);
+int query_param_cmp(const void *a, const void *b);
+void makeHttpHeaderFromBuf(char* http_header, char* hostname, char* path, int port, char* headers, int keep_alive, int forward_range);
+void collectHeaderLine(char* buf, char* host_header, char* other_header, int forward_range);
+int fetch_origin(int fd, char *uri, char *headers, int *keep_client, capture_t *cap);
+int response_header(char *buf, response_info_t *info);
+int relay_response(int fd, rio_t *server_rio, int *keep_client, capture_t *cap, int *reusable);
+void capture_init(capture_t *cap, char *buf, flight_t *flight);
+void capture_append(capture_t *cap, char *buf, size_t n);
+void capture_abort(capture_t *cap);
+void capture_spill(capture_t *cap);
+void capture_store(capture_t *cap, char *key);
+int relay_write(int fd, char *buf, size_t n, capture_t *cap);
+int relay_head(int fd, char *head, size_t head_len, int keep_client, capture_t *cap);
+int writev_all(int fd, struct iovec *iov, int cnt);
+int sendfile_all(int out_fd, int in_fd, off_t off, size_t n);
+int relay_body(int fd, rio_t *server_rio, long n, capture_t *cap);
+int relay_chunked(int fd, rio_t *server_rio, capture_t *cap);
+ssize_t rio_read_some(rio_t *rp, char *buf, size_t n);
+ssize_t relay_splice(int from_fd, int to_fd, long limit);
+ssize_t relay_copy(int from_fd, int to_fd, long limit);
+void splice_pipe_close(void);
+void assembleHttpHeader(char* http_header, char* request_header, char* hostname, char* host_header, char* other_header, int keep_alive);
+void parse_options(int argc, char **argv);
+void open_shards(char *port, int n);
+void pin_to_core(int id);
+void* stats_thread(void* vargp);
+int int_option(char *arg, char *name, int *value, int min);
+void clienterror(int fd, char *errnum, char *shortmsg, char *longmsg);
+int error_response(char *buf, size_t cap, char *errnum, char *shortmsg, char *longmsg);
+// 워커 풀 함수
+void sbuf_init(sbuf_t *sp, int n);
+int sbuf_try_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+int sbuf_count(sbuf_t *sp);
+void pool_init(worker_pool_t *pool);
+void pool_spawn(worker_pool_t *pool, int count);
+void* worker(void* pool_ptr);
+void* pool_adjuster(void* pool_ptr);
+void* acceptor(void* shard_ptr);
+// 서버 연결 풀 함수
+void upstream_init(upstream_pool_t *up);
+int upstream_acquire(upstream_pool_t *up, char *hostname, char *port, int *reused);
+void upstream_release(upstream_pool_t *up, int fd, char *hostname, char *port, int reusable);
+int upstream_alive(int fd);
+unsigned int upstream_hash(char *hostname, char *port);
+long now_ms(void);
+long now_ns(void);
+// 이름 조회 캐시 함수
+void dns_init(dns_cache_t *dc);
+int dns_resolve(dns_cache_t *dc, char *hostname, char *port, dns_addrs_t *out);
+int dns_lookup(dns_cache_t *dc, char *hostname, char *port, dns_addrs_t *out, int *err, int notify_fd);
+int dns_connect(dns_cache_t *dc, char *hostname, char *port);
+int dns_get(dns_cache_t *dc, char *hostname, char *port, dns_addrs_t *out, int *err, int notify_fd, dns_entry_t **entry_out, int *start);
+void dns_complete(dns_cache_t *dc, dns_entry_t *entry, int rc, struct addrinfo *list);
+void dns_queue(dns_cache_t *dc, dns_entry_t *entry);
+int dns_query(dns_entry_t *entry, struct addrinfo **list);
+void* dns_resolver(void* dc_ptr);
+void* dns_refresher(void* dc_ptr);
+// 요청 합치기 (single-flight) 함수
+void flight_init(flight_table_t *ft);
+flight_t **flight_bucket(flight_table_t *ft, char *uri, flight_shard_t **shard);
+flight_t *flight_join(flight_table_t *ft, char *uri, int *leader);
+int flight_follow(int fd, flight_t *f, int keep_client);
+void flight_publish(flight_table_t *ft, flight_t *f, capture_t *cap);
+void flight_finish(flight_table_t *ft, flight_t *f, int ok);
+void flight_release(flight_table_t *ft, flight_t *f);
+// 서버 연결 함수 (Happy Eyeballs)
+void addrs_interleave(dns_addrs_t *addrs);
+int happy_connect(dns_addrs_t *addrs, char *hostname, char *port);
+int connect_start(dns_addr_t *a);
+int connect_result(int fd);
+void connect_count(dns_addr_t *a, long elapsed);
+// epoll 모드 함수
+void run_epoll(char *port);
+void* event_loop(void* loop_ptr);
+void conn_accept(event_loop_t *loop);
+void conn_drive(event_loop_t *loop, conn_t *conn);
+int conn_read_request(conn_t *conn);
+void conn_error(conn_t *conn, char *errnum, char *shortmsg, char *longmsg);
+int conn_parse(event_loop_t *loop, conn_t *conn);
+int conn_resolve(event_loop_t *loop, conn_t *conn);
+void conn_resolved(event_loop_t *loop);
+int conn_connect(event_loop_t *loop, conn_t *conn);
+void conn_connect_done(event_loop_t *loop, conn_t *conn);
+int loop_timeout(event_loop_t *loop);
+void conn_timers(event_loop_t *loop);
+int conn_send_request(conn_t *conn);
+int conn_relay(conn_t *conn);
+void conn_cache_head(conn_t *conn);
+int conn_cache_complete(conn_t *conn, size_t size, char *tail, size_t tail_len);
+int conn_serve_stale(conn_t *conn);
+void conn_serve_hit(conn_t *conn, char *data, int size, long expires, large_object_t *o, char *headers);
+int conn_relay_splice(conn_t *conn);
+void conn_close(event_loop_t *loop, conn_t *conn);
+int set_nonblocking(int fd);
 // 캐시 함수
 void cache_init(cache_t *cache);
-int cache_find(cache_t *cache, char *uri, char *data, int *size);
-void cache_insert(cache_t *cache, char *uri, char *data, int size);
-void cache_evict(cache_t *cache);
+cache_entry_t *cache_find(cache_t *cache, char *uri);
+cache_entry_t *cache_get(cache_t *cache, char *uri, int count);
+void cache_release(cache_t *cache, cache_entry_t *e);
+void cache_insert(cache_t *cache, char *uri, char *data, int size, long expires);
+void cache_link(cache_t *cache, cache_shard_t *shard, cache_entry_t *e);
+int cache_save(cache_t *cache, char *path);
+int cache_load(cache_t *cache, char *path);
+void snapshot_release(snapshot_map_t *m);
+cache_entry_t *cache_evict(cache_t *cache, cache_shard_t *shard);
+unsigned long long cache_hash(char *uri, int *len);
+cache_shard_t *cache_shard(cache_t *cache, unsigned long long hash);
+cache_entry_t **cache_slot(cache_shard_t *shard, char *uri, unsigned long long hash, int len);
+cache_entry_t **cache_grow(cache_t *cache, cache_shard_t *shard);
+void cache_list_push(cache_shard_t *shard, int list, cache_entry_t *e);
+void cache_list_unlink(cache_shard_t *shard, cache_entry_t *e);
+cache_entry_t *cache_list_tail(cache_shard_t *shard, int list);
+cache_entry_t *cache_lookup(cache_shard_t *shard, char *uri, unsigned long long hash, int len);
+cache_entry_t *cache_retire(cache_shard_t *shard, cache_entry_t *victims, cache_entry_t **old_buckets);
+void cache_bench(void);
+void policy_bench(void);
+void* cache_bench_thread(void* arg);
+// 축출 정책 함수
+void ghost_init(ghost_t *g, int cap, size_t max_bytes);
+void ghost_add(ghost_t *g, unsigned long long hash, size_t size);
+int ghost_take(ghost_t *g, unsigned long long hash);
+int ghost_find(ghost_t *g, unsigned long long hash);
+void ghost_delete(ghost_t *g, int pos);
+void policy_list_remove(cache_shard_t *shard, cache_entry_t *e);
+cache_entry_t *policy_list_next(cache_shard_t *shard, cache_entry_t *e);
+void policy_lru_hit(cache_shard_t *shard, cache_entry_t *e);
+void policy_lru_admit(cache_shard_t *shard, cache_entry_t *e);
+cache_entry_t *policy_lru_victim(cache_shard_t *shard);
+cache_entry_t *policy_lru_peek(cache_shard_t *shard, cache_entry_t *after);
+void policy_clock_hit(cache_shard_t *shard, cache_entry_t *e);
+cache_entry_t *policy_clock_victim(cache_shard_t *shard);
+void policy_ghost_init(cache_shard_t *shard);
+void policy_ghost_prepare(cache_shard_t *shard, unsigned long long hash, size_t charge);
+void policy_ghost_admit(cache_shard_t *shard, cache_entry_t *e);
+void policy_2q_hit(cache_shard_t *shard, cache_entry_t *e);
+cache_entry_t *policy_2q_victim(cache_shard_t *shard);
+cache_entry_t *policy_2q_peek(cache_shard_t *shard, cache_entry_t *after);
+void policy_arc_prepare(cache_shard_t *shard, unsigned long long hash, size_t charge);
+void policy_arc_hit(cache_shard_t *shard, cache_entry_t *e);
+cache_entry_t *policy_arc_victim(cache_shard_t *shard);
+cache_entry_t *policy_arc_peek(cache_shard_t *shard, cache_entry_t *after);
+void policy_s3fifo_hit(cache_shard_t *shard, cache_entry_t *e);
+cache_entry_t *policy_s3fifo_victim(cache_shard_t *shard);
+cache_entry_t *policy_s3fifo_peek(cache_shard_t *shard, cache_entry_t *after);
+void policy_gdsf_hit(cache_shard_t *shard, cache_entry_t *e);
+void policy_gdsf_admit(cache_shard_t *shard, cache_entry_t *e);
+cache_entry_t *policy_gdsf_victim(cache_shard_t *shard);
+cache_entry_t *policy_gdsf_peek(cache_shard_t *shard, cache_entry_t *after);
+void policy_gdsf_remove(cache_shard_t *shard, cache_entry_t *e);
+void heap_swap(cache_shard_t *shard, int i, int j);
+void sketch_init(sketch_t *sk, size_t width);
+void sketch_add(sketch_t *sk, unsigned long long hash);
+int sketch_estimate(sketch_t *sk, unsigned long long hash);
+void sketch_age(sketch_t *sk);
+int cache_admit(cache_t *cache, cache_shard_t *shard, char *uri, unsigned long long hash, int len, size_t charge);
+void heap_up(cache_shard_t *shard, int i);
+void heap_down(cache_shard_t *shard, int i);
+void reclaim_init(reclaim_t *r);
+reclaim_thread_t *reclaim_enter(reclaim_t *r);
+void reclaim_exit(reclaim_thread_t *t);
+unsigned long reclaim_advance(reclaim_t *r);
+void reclaim_thread_done(void *t);
+void slab_init(slab_t *slab, size_t max_chunk, size_t max_free);
+void *slab_alloc(slab_t *slab, size_t size, int *cls);
+int slab_class(slab_t *slab, size_t size);
+void slab_free(slab_t *slab, void *chunk, int cls);
+// 디스크 2차 캐시 함수
+void disk_init(disk_cache_t *dc);
+disk_segment_t *disk_find(disk_cache_t *dc, char *uri, char **data, int *size, off_t *file_off, long *expires);
+void disk_release(disk_segment_t *seg);
+void disk_put(disk_cache_t *dc, char *uri, unsigned long long hash, int uri_len, char *data, int size, long expires);
+int disk_same(disk_entry_t *e, char *data, int size);
+void disk_append(disk_cache_t *dc, char *uri, unsigned long long hash, int uri_len, char *data, int size, long expires);
+disk_entry_t **disk_slot(disk_cache_t *dc, char *uri, unsigned long long hash, int len);
+void disk_grow(disk_cache_t *dc);
+disk_segment_t *disk_segment_open(disk_cache_t *dc);
+void disk_gc(disk_cache_t *dc);
+// 큰 객체 저장소 함수
+void large_init(large_cache_t *lc);
+large_object_t *large_find(large_cache_t *lc, char *uri);
+void large_release(large_object_t *o);
+int large_fits(large_cache_t *lc, size_t size);
+large_object_t *large_start(large_cache_t *lc);
+int large_append(large_cache_t *lc, large_object_t *o, char *buf, size_t n);
+void large_commit(large_cache_t *lc, large_object_t *o, char *uri);
+void large_unlink(large_cache_t *lc, large_object_t *o);
+int send_large(int fd, large_object_t *o, int keep_client);
+void blob_init(blob_t *b, char *data, int size, large_object_t *o);
+int blob_write(int fd, blob_t *b, size_t off, size_t len);
+// HTTP 캐시 신선도 함수
+void freshness_init(freshness_t *f);
+void freshness_parse(char *head, int len, freshness_t *f);
+long freshness_expires(freshness_t *f, long now);
+long cache_expires(char *data, int size);
+int cache_fresh(cache_entry_t *e);
+void cache_refresh(cache_entry_t *e, char *head, int len);
+int http_header_value(char *data, int size, char *name, char *value, size_t cap);
+int http_date(char *s, long *t);
+void http_conditional(char *http_header, cache_entry_t *e);
+int request_no_cache(char *headers);
+long cache_stale_until(cache_entry_t *e, int on_error);
+// stale-while-revalidate 백그라운드 갱신 함수
+void refresh_init(refresh_queue_t *rq);
+void refresh_queue(refresh_queue_t *rq, cache_entry_t *e);
+void refresh_fill(refresh_queue_t *rq, char *uri);
+void* refresh_thread(void* rq_ptr);
+void refresh_entry(cache_entry_t *e);
+int refresh_fetch(flight_t *flight, cache_entry_t *revalidate);
+// Range 요청 함수
+int request_header_value(char *headers, char *name, char *value, size_t cap);
+int request_range(char *headers);
+int range_parse(char *value, long size, range_t *r);
+void blob_copy(blob_t *b, size_t off, size_t len, char *dst);
+void range_add(range_plan_t *p, char *text, size_t off, size_t len);
+int range_plan(range_plan_t *p, blob_t *b, char *headers, int keep_client);
+int range_send(int fd, range_plan_t *p, blob_t *b);
+char *range_flatten(range_plan_t *p, blob_t *b);
+int send_hit(int fd, char *key, char *data, int size, long expires, large_object_t *o, int file_fd, off_t file_off, char *headers, int keep_client);
+// gzip 압축 함수
+int request_accepts_gzip(char *headers);
+int gzip_variant_key(char *uri, int uri_len);
+int gzip_compressible(char *data, int size);
+char *gzip_identity_vary(char *data, int size);
+int gzip_budget_ok(void);
+char *gzip_blob(char *data, int size, int body_off, int *out_size);
+int gzip_variant(gzip_variant_t *v, char *key, char *data, int size, long expires, char *headers);
+void gzip_variant_release(gzip_variant_t *v);
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
     "Firefox/10.0.3\r\n";
 cache_t cache;
+disk_cache_t disk;
+large_cache_t large;
+gzip_stats_t gz;
+reclaim_t reclaim;
+cache_policy_t cache_policies[] = {
+  // name, write_on_hit, init, hit, prepare, admit, victim, remove, peek
+  { "lru", 1, NULL, policy_lru_hit, NULL, policy_lru_admit, policy_lru_victim, policy_list_remove, policy_lru_peek },
+  { "clock", 0, NULL, policy_clock_hit, NULL, policy_lru_admit, policy_clock_victim, policy_list_remove, policy_lru_peek },
+  { "2q", 1, policy_ghost_init, policy_2q_hit, policy_ghost_prepare, policy_ghost_admit, policy_2q_victim, policy_list_remove, policy_2q_peek },
+  { "arc", 1, policy_ghost_init, policy_arc_hit, policy_arc_prepare, policy_ghost_admit, policy_arc_victim, policy_list_remove, policy_arc_peek },
+  { "s3fifo", 0, policy_ghost_init, policy_s3fifo_hit, policy_ghost_prepare, policy_ghost_admit, policy_s3fifo_victim, policy_list_remove, policy_s3fifo_peek },
+  { "gdsf", 0, NULL, policy_gdsf_hit, NULL, policy_gdsf_admit, policy_gdsf_victim, policy_gdsf_remove, policy_gdsf_peek },
+  { NULL },
+};
+static __thread reclaim_thread_t *reclaim_self = NULL; // 이 스레드의 epoch 기록
+proxy_config_t config = {
+  .mode = MODE_THREAD,
+  .loops = 1,
+  .workers = 8,
+  .min_workers = 4,
+  .max_workers = 256,
+  .queue_size = 256,
+  .shards = 1,
+  .upstream_max_idle = 8,
+  .upstream_idle_timeout = 30,
+  .client_idle_timeout = 5,
+  .dns_ttl = 60,
+  .dns_negative_ttl = 5,
+  .connect_timeout = CONNECT_TIMEOUT_MS,
+  .connect_delay = CONNECT_DELAY_MS,
+  .cache_size = MAX_CACHE_SIZE,
+  .cache_shards = 16,
+  .cache_index = CACHE_INDEX_LOCKED,
+  .cache_policy = CACHE_POLICY_CLOCK,
+  .cache_admission = 1,
+  .bench = 0,
+  .disk_dir = NULL,
+  .disk_size = 1024,
+  .cache_snapshot = NULL,
+  .cache_default_ttl = 300,
+  .stale_while_revalidate = 0,
+  .stale_if_error = 60,
+  .large_cache_size = 256,
+  .cache_key_sort = 0,
+  .gzip_level = 6,
+  .gzip_min_size = 1024,
+  .gzip_cpu_ms = 100,
+};
+worker_pool_t pool;
+upstream_pool_t upstream;
+dns_cache_t dns;
+connect_stats_t connect_stats;
+flight_table_t flights;
+refresh_queue_t refresher;
+shard_t shards[MAX_SHARDS];
+int nshards;
+static __thread int splice_pipe[2] = { -1, -1 }; // 스레드마다 하나씩 재사용하는 splice용 pipe
+
+int main(int argc, char **argv)
+{
+  pthread_t tid;
+
+  // 인자 개수가 알맞게 안 들어왔으면, 에러를 출력하고 종료
+  if(argc < 2)
+  {
+    fprintf(stderr, "usage: %s <port> [--mode=thread|epoll] [--loops=N] [--workers=N] [--min-workers=N] [--max-workers=N] [--queue=N] [--shards=N] [--upstream-max-idle=N] [--upstream-idle-timeout=SEC] [--client-idle-timeout=SEC (thread mode only)] [--dns-ttl=SEC] [--dns-negative-ttl=SEC] [--connect-timeout=MS] [--connect-delay=MS] [--cache-size=BYTES] [--cache-shards=N] [--cache-index=locked|lockfree (lockfree needs --cache-policy=clock|s3fifo|gdsf)] [--cache-policy=lru|clock|2q|arc|s3fifo|gdsf] [--cache-admission=tinylfu|none] [--bench=index|policy] [--disk-cache=DIR] [--disk-cache-size=MB] [--cache-snapshot=PATH] [--cache-default-ttl=SEC] [--stale-while-revalidate=SEC] [--stale-if-error=SEC] [--cache-key-query=keep|sort] [--large-cache-size=MB] [--gzip-level=N] [--gzip-min-size=BYTES] [--gzip-cpu=MS]\n", argv[0]);
+    exit(1);
+  }
+  parse_options(argc, argv);
+  reclaim_init(&reclaim);
+  if(config.bench == BENCH_INDEX)
+  {
+    cache_bench();
+    return 0;
+  }
+  if(config.bench == BENCH_POLICY)
+  {
+    policy_bench();
+    return 0;
+  }
+
+  // 클라이언트가 먼저 끊어도 SIGPIPE로 프로세스가 죽지 않도록 무시
+  Signal(SIGPIPE, SIG_IGN);
+  // kill -USR1 <pid> : shard별 연결 수 출력
+  // --cache-snapshot이면 kill -USR2 <pid> : 캐시 스냅샷 쓰기, SIGTERM : 스냅샷을 쓰고 종료
+  // 이후 만드는 모든 스레드가 이 시그널들을 막은 상태를 물려받고, stats_thread만 sigwait으로 받음
+  // (sem_wait, epoll_wait 같은 호출이 시그널로 EINTR을 받아 Wrapper가 프로세스를 종료시키지 않도록)
+  sigset_t mask;
+  Sigemptyset(&mask);
+  Sigaddset(&mask, SIGUSR1);
+  if(config.cache_snapshot != NULL)
+  {
+    Sigaddset(&mask, SIGUSR2);
+    Sigaddset(&mask, SIGTERM);
+  }
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  // 캐시 초기화 : 스냅샷이 있으면 이전 실행의 캐시를 그대로 이어 받음
+  cache_init(&cache);
+  if(config.cache_snapshot != NULL)
+  {
+    long start = now_ns();
+    int loaded = cache_load(&cache, config.cache_snapshot);
+    if(loaded >= 0)
+    {
+      printf("cache snapshot: loaded %d objects from %s in %ld us\n", loaded, config.cache_snapshot, (now_ns() - start) / 1000);
+    }
+  }
+  Pthread_create(&tid, NULL, stats_thread, NULL);
+  disk_init(&disk);
+  large_init(&large);
+  if(disk.enabled)
+  {
+    cache.l2 = &disk;
+  }
+  upstream_init(&upstream);
+  dns_init(&dns);
+  flight_init(&flights);
+  refresh_init(&refresher);
+
+  if(config.mode == MODE_EPOLL)
+  {
+    run_epoll(argv[1]);
+    return 0;
+  }
+
+  // 워커 풀 생성 : 연결마다 스레드를 만드는 대신 미리 만든 워커들이 큐에서 fd를 꺼내 처리
+  pool_init(&pool);
+
+  // shard마다 acceptor 하나 : 0번은 메인 스레드가 직접 돌림
+  open_shards(argv[1], config.shards);
+  for(int i = 1; i < nshards; i++)
+  {
+    Pthread_create(&tid, NULL, acceptor, &shards[i]);
+  }
+  acceptor(&shards[0]);
+
+  // printf("%s", user_agent_hdr);
+  return 0;
+}
+
+/* 포트 뒤에 오는 --옵션들을 파싱해 config에 반영 */
+void parse_options(int argc, char **argv)
+{
+  int idle_given = 0; // --client-idle-timeout을 직접 줬는지 (기본값은 epoll 모드에서 조용히 끔)
+
+  for(int i = 2; i < argc; i++)
+  {
+    idle_given |= !strncmp(argv[i], "--client-idle-timeout=", strlen("--client-idle-timeout="));
+    if(!strcmp(argv[i], "--mode=epoll"))
+    {
+      config.mode = MODE_EPOLL;
+    }
+    else if(!strcmp(argv[i], "--mode=thread"))
+    {
+      config.mode = MODE_THREAD;
+    }
+    else if(!strcmp(argv[i], "--cache-index=locked"))
+    {
+      config.cache_index = CACHE_INDEX_LOCKED;
+    }
+    else if(!strcmp(argv[i], "--cache-index=lockfree"))
+    {
+      config.cache_index = CACHE_INDEX_LOCKFREE;
+    }
+    else if(!strcmp(argv[i], "--cache-admission=tinylfu"))
+    {
+      config.cache_admission = 1;
+    }
+    else if(!strcmp(argv[i], "--cache-admission=none"))
+    {
+      config.cache_admission = 0;
+    }
+    else if(!strcmp(argv[i], "--cache-key-query=sort"))
+    {
+      config.cache_key_sort = 1;
+    }
+    else if(!strcmp(argv[i], "--cache-key-query=keep"))
+    {
+      config.cache_key_sort = 0;
+    }
+    else if(!strcmp(argv[i], "--bench=index"))
+    {
+      config.bench = BENCH_INDEX;
+    }
+    else if(!strcmp(argv[i], "--bench=policy"))
+    {
+      config.bench = BENCH_POLICY;
+    }
+    else if(!strncmp(argv[i], "--disk-cache=", 13))
+    {
+      config.disk_dir = argv[i] + 13;
+    }
+    else if(!strncmp(argv[i], "--cache-snapshot=", 17))
+    {
+      config.cache_snapshot = argv[i] + 17;
+    }
+    else if(!strncmp(argv[i], "--cache-policy=", 15))
+    {
+      int p = 0;
+      while(cache_policies[p].name != NULL && strcmp(cache_policies[p].name, argv[i] + 15))
+      {
+        p++;
+      }
+      if(cache_policies[p].name == NULL)
+      {
+        fprintf(stderr, "Unknown cache policy: %s\n", argv[i] + 15);
+        exit(1);
+      }
+      config.cache_policy = p;
+    }
+    else if(int_option(argv[i], "--loops=", &config.loops, 1) ||
+            int_option(argv[i], "--workers=", &config.workers, 1) ||
+            int_option(argv[i], "--min-workers=", &config.min_workers, 1) ||
+            int_option(argv[i], "--max-workers=", &config.max_workers, 1) ||
+            int_option(argv[i], "--queue=", &config.queue_size, 1) ||
+            int_option(argv[i], "--shards=", &config.shards, 1) ||
+            int_option(argv[i], "--upstream-max-idle=", &config.upstream_max_idle, 0) ||
+            int_option(argv[i], "--upstream-idle-timeout=", &config.upstream_idle_timeout, 1) ||
+            int_option(argv[i], "--client-idle-timeout=", &config.client_idle_timeout, 0) ||
+            int_option(argv[i], "--dns-ttl=", &config.dns_ttl, 1) ||
+            int_option(argv[i], "--dns-negative-ttl=", &config.dns_negative_ttl, 1) ||
+            int_option(argv[i], "--connect-timeout=", &config.connect_timeout, 1) ||
+            int_option(argv[i], "--connect-delay=", &config.connect_delay, 10) ||
+            int_option(argv[i], "--cache-size=", &config.cache_size, MAX_OBJECT_SIZE) ||
+            int_option(argv[i], "--cache-shards=", &config.cache_shards, 1) ||
+            int_option(argv[i], "--disk-cache-size=", &config.disk_size, 2 * (DISK_SEGMENT_SIZE >> 20)) ||
+            int_option(argv[i], "--cache-default-ttl=", &config.cache_default_ttl, 0) ||
+            int_option(argv[i], "--stale-while-revalidate=", &config.stale_while_revalidate, 0) ||
+            int_option(argv[i], "--stale-if-error=", &config.stale_if_error, 0) ||
+            int_option(argv[i], "--large-cache-size=", &config.large_cache_size, 0) ||
+            int_option(argv[i], "--gzip-level=", &config.gzip_level, 0) ||
+            int_option(argv[i], "--gzip-min-size=", &config.gzip_min_size, 0) ||
+            int_option(argv[i], "--gzip-cpu=", &config.gzip_cpu_ms, 0))
+    {
+      continue;
+    }
+    else
+    {
+      fprintf(stderr, "unknown option: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+
+  if(config.shards > MAX_SHARDS)
+  {
+    config.shards = MAX_SHARDS;
+  }
+  if(config.loops > MAX_SHARDS)
+  {
+    config.loops = MAX_SHARDS;
+  }
+  if(config.cache_shards > CACHE_MAX_SHARDS)
+  {
+    config.cache_shards = CACHE_MAX_SHARDS;
+  }
+  if(config.gzip_level > 9)
+  {
+    config.gzip_level = 9;
+  }
+  // epoll 모드의 conn_t는 요청 하나를 처리하면 닫히는 상태 기계라 클라이언트 keep-alive/파이프라이닝이 없음
+  if(config.mode == MODE_EPOLL && config.client_idle_timeout > 0 && idle_given)
+  {
+    fprintf(stderr, "Warning: --client-idle-timeout is ignored in epoll mode (client connections are closed after each response)\n");
+  }
+  if(config.mode == MODE_EPOLL)
+  {
+    config.client_idle_timeout = 0;
+  }
+  // 히트마다 정책 리스트를 고치는 정책(LRU, 2Q, ARC)은 찾을 때도 쓰기 락을 잡으므로 락 없는 인덱스를 쓸 수 없음
+  if(config.cache_index == CACHE_INDEX_LOCKFREE && cache_policies[config.cache_policy].write_on_hit)
+  {
+    fprintf(stderr, "Warning: --cache-index=lockfree has no effect with --cache-policy=%s (hits take the shard write lock), using the locked index\n",
+            cache_policies[config.cache_policy].name);
+    config.cache_index = CACHE_INDEX_LOCKED;
+  }
+
+  // 워커 수 범위 보정 : min <= workers <= max
+  if(config.max_workers < config.min_workers)
+  {
+    config.max_workers = config.min_workers;
+  }
+  if(config.workers < config.min_workers)
+  {
+    config.workers = config.min_workers;
+  }
+  if(config.workers > config.max_workers)
+  {
+    config.workers = config.max_workers;
+  }
+}
+
+/* 리스닝 소켓 n개 열기 : 2개 이상이면 SO_REUSEPORT로 같은 포트를 공유해 커널이 연결을 나눠 줌 */
+void open_shards(char *port, int n)
+{
+  int listen_fds[MAX_SHARDS];
+
+  if(n == 1)
+  {
+    listen_fds[0] = Open_listenfd(port);
+  }
+  else
+  {
+    Open_listenfds(port, listen_fds, n);
+  }
+
+  for(int i = 0; i < n; i++)
+  {
+    shards[i].id = i;
+    shards[i].listen_fd = listen_fds[i];
+    shards[i].accepted = 0;
+    shards[i].rejected = 0;
+  }
+  nshards = n;
+}
+
+/* 현재 스레드를 (id % 코어 수)번 코어에 고정 */
+void pin_to_core(int id)
+{
+  cpu_set_t set;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if(ncpus < 1)
+  {
+    return;
+  }
+  CPU_ZERO(&set);
+  CPU_SET(id % ncpus, &set);
+  if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) != 0)
+  {
+    fprintf(stderr, "Warning: unable to pin shard %d to a core\n", id);
+  }
+}
+
+/* SIGUSR1을 받을 때마다 shard별 카운터를 출력해 부하가 고르게 나뉘는지 확인 */
+void* stats_thread(void* vargp)
+{
+  sigset_t mask;
+  int sig;
+
+  Pthread_detach(pthread_self());
+  Sigemptyset(&mask);
+  Sigaddset(&mask, SIGUSR1);
+  if(config.cache_snapshot != NULL)
+  {
+    Sigaddset(&mask, SIGUSR2);
+    Sigaddset(&mask, SIGTERM);
+  }
+  while(1)
+  {
+    if(sigwait(&mask, &sig) != 0)
+    {
+      continue;
+    }
+    if(sig == SIGUSR2 || sig == SIGTERM)
+    {
+      long start = now_ns();
+      int saved = cache_save(&cache, config.cache_snapshot);
+      if(saved < 0)
+      {
+        fprintf(stderr, "Error: cannot write cache snapshot %s: %s\n", config.cache_snapshot, strerror(errno));
+      }
+      else
+      {
+        printf("cache snapshot: saved %d objects to %s in %ld us\n", saved, config.cache_snapshot, (now_ns() - start) / 1000);
+      }
+      fflush(stdout);
+      if(sig == SIGTERM)
+      {
+        exit(0);
+      }
+      continue;
+    }
+
+    for(int i = 0; i < nshards; i++)
+    {
+      printf("shard %d: accepted %lu, rejected %lu\n", i,
+             __atomic_load_n(&shards[i].accepted, __ATOMIC_RELAXED),
+             __atomic_load_n(&shards[i].rejected, __ATOMIC_RELAXED));
+    }
+    printf("upstream: reused %lu, opened %lu\n",
+           __atomic_load_n(&upstream.reused, __ATOMIC_RELAXED),
+           __atomic_load_n(&upstream.opened, __ATOMIC_RELAXED));
+    printf("dns: hits %lu, misses %lu, failures %lu, refreshes %lu\n",
+           __atomic_load_n(&dns.hits, __ATOMIC_RELAXED),
+           __atomic_load_n(&dns.misses, __ATOMIC_RELAXED),
+           __atomic_load_n(&dns.failures, __ATOMIC_RELAXED),
+           __atomic_load_n(&dns.refreshes, __ATOMIC_RELAXED));
+    printf("flights: leaders %lu, followers %lu, fallbacks %lu\n",
+           __atomic_load_n(&flights.leaders, __ATOMIC_RELAXED),
+           __atomic_load_n(&flights.followers, __ATOMIC_RELAXED),
+           __atomic_load_n(&flights.fallbacks, __ATOMIC_RELAXED));
+    // 캐시 카운터는 샤드별로 모아서 출력
+    int objects = 0;
+    size_t used = 0;
+    unsigned long hits = 0, misses = 0, evictions = 0, inserts = 0, lock_ns = 0, lock_max_ns = 0;
+    unsigned long hit_bytes = 0, miss_bytes = 0, admitted = 0, rejected = 0;
+    for(int i = 0; i < cache.nshards; i++)
+    {
+      cache_shard_t *shard = &cache.shards[i];
+      objects += __atomic_load_n(&shard->count, __ATOMIC_RELAXED);
+      used += __atomic_load_n(&shard->used, __ATOMIC_RELAXED);
+      hits += __atomic_load_n(&shard->hits, __ATOMIC_RELAXED);
+      misses += __atomic_load_n(&shard->misses, __ATOMIC_RELAXED);
+      hit_bytes += __atomic_load_n(&shard->hit_bytes, __ATOMIC_RELAXED);
+      miss_bytes += __atomic_load_n(&shard->miss_bytes, __ATOMIC_RELAXED);
+      admitted += __atomic_load_n(&shard->admitted, __ATOMIC_RELAXED);
+      rejected += __atomic_load_n(&shard->rejected, __ATOMIC_RELAXED);
+      evictions += __atomic_load_n(&shard->evictions, __ATOMIC_RELAXED);
+      inserts += __atomic_load_n(&shard->inserts, __ATOMIC_RELAXED);
+      lock_ns += __atomic_load_n(&shard->insert_lock_ns, __ATOMIC_RELAXED);
+      if(shard->insert_lock_max_ns > lock_max_ns)
+      {
+        lock_max_ns = __atomic_load_n(&shard->insert_lock_max_ns, __ATOMIC_RELAXED);
+      }
+    }
+    printf("cache: shards %d, objects %d, bytes %zu/%zu, hits %lu, misses %lu, evictions %lu\n",
+           cache.nshards, objects, used, cache.budget, hits, misses, evictions);
+    // 바이트 히트율의 분모는 캐시에서 보낸 바이트 + 서버에서 받아 캐시에 넣은 바이트 (캐시할 수 없는 큰 응답은 빠짐)
+    printf("cache policy %s: hit ratio %.1f%%, byte hit ratio %.1f%%\n", cache.policy->name,
+           hits + misses ? hits * 100.0 / (hits + misses) : 0.0,
+           hit_bytes + miss_bytes ? hit_bytes * 100.0 / (hit_bytes + miss_bytes) : 0.0);
+    if(cache.admission)
+    {
+      printf("cache admission: admitted %lu, rejected %lu\n", admitted, rejected);
+    }
+    printf("cache freshness: revalidations %lu, not modified %lu, uncacheable %lu, stale-while-revalidate %lu (refreshed %lu), stale-if-error %lu\n",
+           __atomic_load_n(&cache.revalidations, __ATOMIC_RELAXED),
+           __atomic_load_n(&cache.not_modified, __ATOMIC_RELAXED),
+           __atomic_load_n(&cache.uncacheable, __ATOMIC_RELAXED),
+           __atomic_load_n(&cache.stale_revalidate, __ATOMIC_RELAXED),
+           __atomic_load_n(&cache.refreshes, __ATOMIC_RELAXED),
+           __atomic_load_n(&cache.stale_error, __ATOMIC_RELAXED));
+    printf("cache ranges: hits %lu, misses %lu, background fills %lu\n",
+           __atomic_load_n(&cache.range_hits, __ATOMIC_RELAXED),
+           __atomic_load_n(&cache.range_misses, __ATOMIC_RELAXED),
+           __atomic_load_n(&cache.range_fills, __ATOMIC_RELAXED));
+    printf("cache lock: inserts %lu, avg %lu ns, max %lu ns\n", inserts,
+           inserts ? lock_ns / inserts : 0, lock_max_ns);
+    if(disk.enabled)
+    {
+      printf("disk cache: objects %d, bytes %zu, segments %d (max %zu bytes), hits %lu, misses %lu, writes %lu, skipped %lu\n",
+             __atomic_load_n(&disk.count, __ATOMIC_RELAXED),
+             __atomic_load_n(&disk.bytes, __ATOMIC_RELAXED),
+             __atomic_load_n(&disk.nsegments, __ATOMIC_RELAXED), disk.budget,
+             __atomic_load_n(&disk.hits, __ATOMIC_RELAXED),
+             __atomic_load_n(&disk.misses, __ATOMIC_RELAXED),
+             __atomic_load_n(&disk.writes, __ATOMIC_RELAXED),
+             __atomic_load_n(&disk.skipped, __ATOMIC_RELAXED));
+      printf("disk gc: segments %lu, rewritten %lu, dropped %lu\n",
+             __atomic_load_n(&disk.gc_segments, __ATOMIC_RELAXED),
+             __atomic_load_n(&disk.gc_rewrites, __ATOMIC_RELAXED),
+             __atomic_load_n(&disk.gc_dropped, __ATOMIC_RELAXED));
+    }
+    if(large.enabled)
+    {
+      printf("large cache: objects %d, bytes %zu/%zu, hits %lu, misses %lu, fills %lu, dropped %lu, evictions %lu\n",
+             __atomic_load_n(&large.count, __ATOMIC_RELAXED),
+             __atomic_load_n(&large.bytes, __ATOMIC_RELAXED), large.budget,
+             __atomic_load_n(&large.hits, __ATOMIC_RELAXED),
+             __atomic_load_n(&large.misses, __ATOMIC_RELAXED),
+             __atomic_load_n(&large.fills, __ATOMIC_RELAXED),
+             __atomic_load_n(&large.dropped, __ATOMIC_RELAXED),
+             __atomic_load_n(&large.evictions, __ATOMIC_RELAXED));
+    }
+    if(config.gzip_level > 0)
+    {
+      printf("gzip: compressed %lu (%lu -> %lu bytes), variant hits %lu, over budget %lu, cpu %ld ms\n",
+             __atomic_load_n(&gz.compressed, __ATOMIC_RELAXED),
+             __atomic_load_n(&gz.bytes_in, __ATOMIC_RELAXED),
+             __atomic_load_n(&gz.bytes_out, __ATOMIC_RELAXED),
+             __atomic_load_n(&gz.hits, __ATOMIC_RELAXED),
+             __atomic_load_n(&gz.over_budget, __ATOMIC_RELAXED),
+             __atomic_load_n(&gz.total_ns, __ATOMIC_RELAXED) / 1000000);
+    }
+    unsigned long connected = __atomic_load_n(&connect_stats.ipv6, __ATOMIC_RELAXED) + __atomic_load_n(&connect_stats.ipv4, __ATOMIC_RELAXED);
+    printf("connect: ipv6 %lu, ipv4 %lu, timeouts %lu, failures %lu, avg %.1f ms\n",
+           __atomic_load_n(&connect_stats.ipv6, __ATOMIC_RELAXED),
+           __atomic_load_n(&connect_stats.ipv4, __ATOMIC_RELAXED),
+           __atomic_load_n(&connect_stats.timeouts, __ATOMIC_RELAXED),
+           __atomic_load_n(&connect_stats.failures, __ATOMIC_RELAXED),
+           connected ? (double)__atomic_load_n(&connect_stats.total_ms, __ATOMIC_RELAXED) / connected : 0.0);
+    fflush(stdout);
+  }
+  return NULL;
+}
+
+/* arg가 "name값" 형태면 값을 정수로 읽어 value에 대입(min보다 작으면 min)하고 1 반환 */
+int int_option(char *arg, char *name, int *value, int min)
+{
+  if(strncmp(arg, name, strlen(name)))
+  {
+    return 0;
+  }
+
+  *value = atoi(arg + strlen(name));
+  if(*value < min)
+  {
+    *value = min;
+  }
+  return 1;
+}
+
+/* 클라이언트에 에러 응답 전송 : 클라이언트가 이미 끊었을 수 있으므로 쓰기 실패는 무시 */
+void clienterror(int fd, char *errnum, char *shortmsg, char *longmsg)
+{
+  char buf[MAXBUF];
+
+  rio_writen(fd, buf, error_response(buf, sizeof(buf), errnum, shortmsg, longmsg));
+}
+
+/* 에러 응답(상태 라인 + 헤더 + 본문)을 buf에 만듦 : 반환값은 길이 (thread 모드는 바로 쓰고, epoll 모드는 conn 출력 버퍼에 담아 씀) */
+int error_response(char *buf, size_t cap, char *errnum, char *shortmsg, char *longmsg)
+{
+  char body[MAXLINE];
+  int len;
+
+  snprintf(body, sizeof(body), "<html><title>Proxy Error</title><body bgcolor=\"ffffff\">\r\n"
+                               "%s: %s\r\n<p>%s</p>\r\n<hr><em>The Caching Proxy</em>\r\n</body></html>\r\n",
+           errnum, shortmsg, longmsg);
+  len = snprintf(buf, cap, "HTTP/1.0 %s %s\r\nContent-type: text/html\r\nContent-length: %d\r\nConnection: close\r\n\r\n%s",
+                 errnum, shortmsg, (int)strlen(body), body);
+  return len < (int)cap ? len : (int)cap - 1;
+}
+
+/* fd(= connect_fd) : 클라이언트와 연결된 소켓의 파일 디스크립터
+   한 연결에서 요청을 순서대로 처리 : 클라이언트가 keep-alive를 원하고 응답 경계가 분명하면 다음 요청을 기다림
+   파이프라이닝으로 미리 보낸 요청은 rio 버퍼에 남아 있다가 다음 차례에 처리됨 */
+void doit(int fd)
+{
+  rio_t rio; // 클라이언트와의 통신을 위한 I/O 구조체
+  int on = 1;
+
+  // 연결을 유지하면 종료가 마지막 조각을 밀어내 주지 않으므로, 응답 끝의 작은 세그먼트가 Nagle에 묶이지 않게 함
+  if(config.client_idle_timeout > 0)
+  {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+
+  Rio_readinitb(&rio, fd);
+  while(client_wait(&rio, config.client_idle_timeout) && serve_request(fd, &rio))
+  {
+  }
+}
+
+/* 클라이언트 요청 하나를 처리 : 반환값이 1이면 같은 연결로 다음 요청을 받아도 됨 */
+int serve_request(int fd, rio_t *rio)
+{
+  char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], key[MAXLINE], version[MAXLINE], headers[MAXBUF];
+  int rc, keep_client, leader, whole;
+  flight_t *flight;
+  capture_t cap;
+
+  // 캐시에 저장할 응답을 모으는 버퍼
+  char cache_data_buffer[MAX_OBJECT_SIZE];
+  cache_entry_t *hit;
+  large_object_t *large_obj;
+  disk_segment_t *seg;
+  char *disk_data;
+  int disk_size;
+  off_t disk_off;
+  long expires;
+
+  // 요청 없이 끊긴 연결 : 워커가 다음 연결을 처리하도록 그냥 반환
+  if(rio_readlineb(rio, buf, MAXLINE) <= 0)
+  {
+    return 0;
+  }
+  printf("Request headers:\n");
+  printf("%s", buf);
+  if(sscanf(buf, "%s %s %s", method, uri, version) != 3)
+  {
+    clienterror(fd, "400", "Bad Request", "Proxy could not parse the request line");
+    return 0;
+  }
+  if((rc = read_request_headers(rio, headers, sizeof(headers))) < 0)
+  {
+    return 0;
+  }
+  if(rc > 0)
+  {
+    clienterror(fd, "400", "Bad Request", "Request headers are too long");
+    return 0;
+  }
+  // 요청 본문은 읽지 않으므로 본문이 있을 수 있는 요청 뒤에는 연결을 닫음 (남은 본문을 다음 요청으로 읽으면 요청 경계가 어긋남)
+  keep_client = config.client_idle_timeout > 0 && client_keep_alive(version, headers) && !request_has_body(method, headers);
+  cache_key(uri, key); // 캐시, 디스크 2차 캐시, 요청 합치기는 모두 정규화한 키로 (서버에는 받은 uri 그대로 요청)
+
+  /* 캐시에서 먼저 찾기 : fresh면 바로 응답하고, 만료됐으면(또는 클라이언트가 no-cache면) 참조를 잡아 둔 채 재검증 */
+  if((hit = cache_find(&cache, key)) != NULL)
+  {
+    if(cache_fresh(hit) && !request_no_cache(headers))
+    {
+      // 캐시 히트 : 락을 놓은 상태로 캐시 항목에서 바로 전송하고 참조 반납 (Range면 잘라서)
+      rc = send_hit(fd, key, hit->data, hit->size, __atomic_load_n(&hit->expires, __ATOMIC_RELAXED), NULL, -1, 0, headers, keep_client);
+      cache_release(&cache, hit);
+      return rc;
+    }
+    if(!request_no_cache(headers) && time(NULL) < cache_stale_until(hit, 0))
+    {
+      // stale-while-revalidate 기간 : 만료된 항목을 바로 보내고 재검증은 백그라운드 스레드에 맡김
+      __atomic_fetch_add(&cache.stale_revalidate, 1, __ATOMIC_RELAXED);
+      refresh_queue(&refresher, hit);
+      rc = send_hit(fd, key, hit->data, hit->size, __atomic_load_n(&hit->expires, __ATOMIC_RELAXED), NULL, -1, 0, headers, keep_client);
+      cache_release(&cache, hit);
+      return rc;
+    }
+  }
+  /* 한도를 넘는 큰 객체는 큰 객체 저장소의 페이지 체인에서 차례로 보냄 (만료됐으면 재검증하지 않고 미스로 처리) */
+  else if((large_obj = large_find(&large, key)) != NULL)
+  {
+    if(large_obj->expires > time(NULL) && !request_no_cache(headers))
+    {
+      rc = send_hit(fd, NULL, NULL, 0, 0, large_obj, -1, 0, headers, keep_client);
+      large_release(large_obj);
+      return rc;
+    }
+    large_release(large_obj);
+  }
+  /* 메모리에 없으면 디스크 2차 캐시 : 헤더는 mmap에서 읽고 본문은 세그먼트 파일에서 sendfile로 바로 보냄
+     (만료된 디스크 항목은 재검증하지 않고 미스로 처리) */
+  else if((seg = disk_find(&disk, key, &disk_data, &disk_size, &disk_off, &expires)) != NULL)
+  {
+    if(expires > time(NULL) && !request_no_cache(headers))
+    {
+      rc = send_hit(fd, key, disk_data, disk_size, expires, NULL, seg->fd, disk_off, headers, keep_client);
+      // 다시 쓰인 객체는 메모리로 올림 (TinyLFU가 거를 수 있음)
+      cache_insert(&cache, key, disk_data, disk_size, expires);
+      disk_release(seg);
+      return rc;
+    }
+    disk_release(seg);
+  }
+
+  /* 캐시에 없는 Range 요청 : 범위는 서버에서 바로 받아 전달하고 (206은 저장하지 않음),
+     전체 객체는 백그라운드에서 받아 두어 다음 범위 요청부터는 캐시에서 잘라 보냄 */
+  if(hit == NULL && request_range(headers))
+  {
+    __atomic_fetch_add(&cache.range_misses, 1, __ATOMIC_RELAXED);
+    refresh_fill(&refresher, key);
+    capture_init(&cap, cache_data_buffer, NULL);
+    cap.range = 1;
+    rc = fetch_origin(fd, uri, headers, &keep_client, &cap);
+    if(rc == RELAY_OK)
+    {
+      capture_store(&cap, key); // 서버가 Range를 무시하고 전체를 보냈으면 그대로 저장
+    }
+    return rc == RELAY_OK && cap.client_ok && keep_client;
+  }
+
+  /* 같은 URI를 이미 서버에서 받아 오는 중이면 따라붙어서 도착하는 대로 받음 */
+  flight = flight_join(&flights, key, &leader);
+  if(!leader)
+  {
+    rc = flight_follow(fd, flight, keep_client);
+    flight_release(&flights, flight);
+    if(rc >= 0)
+    {
+      if(hit != NULL)
+      {
+        cache_release(&cache, hit);
+      }
+      return rc;
+    }
+    flight = NULL; // 리더가 캐시할 수 없는 응답을 받았거나 실패 : 아직 보낸 것이 없으니 직접 가져옴
+    if(hit != NULL && cache_fresh(hit) && !request_no_cache(headers))
+    {
+      // 리더가 304로 같은 항목을 갱신함
+      rc = send_hit(fd, key, hit->data, hit->size, __atomic_load_n(&hit->expires, __ATOMIC_RELAXED), NULL, -1, 0, headers, keep_client);
+      cache_release(&cache, hit);
+      return rc;
+    }
+  }
+
+  /* 캐시 미스 -> 서버에 요청 전달해서 응답 받아오기 (리더면 따라붙은 요청과 공유하는 버퍼에 모음)
+     만료된 항목이 있으면 ETag / Last-Modified로 조건부 요청 */
+  capture_init(&cap, flight ? flight->data : cache_data_buffer, flight);
+  cap.revalidate = hit;
+  if(hit != NULL)
+  {
+    __atomic_fetch_add(&cache.revalidations, 1, __ATOMIC_RELAXED);
+  }
+  rc = fetch_origin(fd, uri, headers, &keep_client, &cap);
+
+  if(rc == RELAY_NOT_MODIFIED || rc == RELAY_STALE)
+  {
+    // 304 : 본문은 다시 받지 않고 (relay_response가 만료 시각을 갱신) 캐시된 응답을 보냄
+    // 서버 오류 : stale-if-error 기간 안이라 502 대신 만료된 응답을 보냄
+    __atomic_fetch_add(rc == RELAY_STALE ? &cache.stale_error : &cache.not_modified, 1, __ATOMIC_RELAXED);
+    if(flight != NULL)
+    {
+      flight_finish(&flights, flight, 0);
+    }
+    rc = send_hit(fd, key, hit->data, hit->size, __atomic_load_n(&hit->expires, __ATOMIC_RELAXED), NULL, -1, 0, headers, keep_client);
+    cache_release(&cache, hit);
+    return rc;
+  }
+  if(hit != NULL)
+  {
+    cache_release(&cache, hit);
+  }
+
+  /* 응답 전체를 담았고 저장해도 되는 응답이면 캐시에 저장 : 따라붙은 요청을 놓아 주기 전에 넣어서 새 요청은 캐시에서 찾게 함 */
+  whole = rc == RELAY_OK && (cap.on || cap.large != NULL); // capture_store가 cap.large를 넘겨주기 전에 확인
+  if(rc == RELAY_OK)
+  {
+    capture_store(&cap, key);
+  }
+  if(flight != NULL)
+  {
+    flight_finish(&flights, flight, whole);
+  }
+  return rc == RELAY_OK && cap.client_ok && keep_client;
+}
+
+/* 서버에 요청을 보내고 응답을 클라이언트로 전달하면서 cap에 모음 : 반환값은 relay_response와 같음
+   cap->revalidate가 있으면 조건부 요청으로 보내고, 304면 RELAY_NOT_MODIFIED (클라이언트에는 아직 아무것도 보내지 않음)
+   연결하지 못했거나 응답이 없을 때 stale-if-error 기간 안이면 502를 보내지 않고 RELAY_STALE */
+int fetch_origin(int fd, char *uri, char *headers, int *keep_client, capture_t *cap)
+{
+  char hostname[MAXLINE], path[MAXLINE], http_header[MAXLINE];
+  int port; // 서버의 포트 번호
+  char port_ch[10]; // port를 문자열로 저장한 변수
+  rio_t server_rio; // 서버와의 통신을 위한 I/O 구조체
+  int server_fd; // 프록시가 웹 서버와 연결할 때 사용하는 소켓의 파일 디스크립터
+  int reused, reusable, rc;
+
+  parse_uri(uri, hostname, path, &port);
+  makeHttpHeaderFromBuf(http_header, hostname, path, port, headers, config.upstream_max_idle > 0, cap->range);
+  if(cap->revalidate != NULL)
+  {
+    http_conditional(http_header, cap->revalidate);
+  }
+  sprintf(port_ch, "%d", port); // port를 문자열로 변환해 저장
+
+  /* 서버와 연결(또는 풀에서 유휴 연결을 꺼냄) 후, 재구성한 HTTP 헤더를 서버에 전송
+     재사용한 연결이 그사이 서버 쪽에서 닫혔으면 새 연결로 한 번 더 시도 */
+  do
+  {
+    server_fd = upstream_acquire(&upstream, hostname, port_ch, &reused);
+    if(server_fd < 0)
+    {
+      fprintf(stderr, "Error: Unable to connect to server\n");
+      if(cap->revalidate != NULL && time(NULL) < cache_stale_until(cap->revalidate, 1))
+      {
+        return RELAY_STALE;
+      }
+      clienterror(fd, "502", "Bad Gateway", "Proxy could not connect to the origin server");
+      return RELAY_FAILED;
+    }
+
+    Rio_readinitb(&server_rio, server_fd);
+    if(rio_writen(server_fd, http_header, strlen(http_header)) != strlen(http_header)) // 재구성한 요청 헤더를 서버로 전송
+    {
+      rc = RELAY_NO_RESPONSE;
+    }
+    else
+    {
+      /* 서버 응답을 클라이언트에 전송 */
+      rc = relay_response(fd, &server_rio, keep_client, cap, &reusable);
+    }
+
+    if(rc != RELAY_OK && rc != RELAY_NOT_MODIFIED)
+    {
+      Close(server_fd);
+    }
+  } while(rc == RELAY_NO_RESPONSE && reused);
+
+  if(rc == RELAY_STALE)
+  {
+    return RELAY_STALE;
+  }
+  if(rc == RELAY_NO_RESPONSE && cap->revalidate != NULL && time(NULL) < cache_stale_until(cap->revalidate, 1))
+  {
+    return RELAY_STALE;
+  }
+  if(rc == RELAY_NO_RESPONSE)
+  {
+    clienterror(fd, "502", "Bad Gateway", "Origin server closed the connection without a response");
+    return RELAY_FAILED;
+  }
+  if(rc == RELAY_FAILED)
+  {
+    return RELAY_FAILED;
+  }
+
+  /* 본문 경계가 분명하고 서버가 연결을 유지하면 풀에 반납, 아니면 종료 */
+  upstream_release(&upstream, server_fd, hostname, port_ch, reusable && server_rio.rio_cnt == 0);
+  return rc;
+}
+
+/* 다음 요청이 올 때까지 최대 timeout_sec초 대기 : 이미 버퍼에 받아 둔 요청(파이프라이닝)이 있으면 바로 진행
+   첫 요청도 같은 시간 안에 와야 하므로 아무것도 보내지 않는 연결이 워커를 오래 잡아 두지 못함 */
+int client_wait(rio_t *rio, int timeout_sec)
+{
+  struct pollfd pfd = { rio->rio_fd, POLLIN, 0 };
+  int rc;
+
+  if(rio->rio_cnt > 0 || timeout_sec <= 0)
+  {
+    return 1;
+  }
+  while((rc = poll(&pfd, 1, timeout_sec * 1000)) < 0 && errno == EINTR)
+  {
+  }
+  return rc > 0;
+}
+
+/* 요청 헤더를 빈 줄까지 읽어 headers에 모음 (넘치는 줄은 버림)
+   반환값 : 모두 담았으면 0, 넘쳐서 버린 줄이 있으면 1, 헤더 끝 전에 끊기면 -1 */
+int read_request_headers(rio_t *rio, char *headers, size_t size)
+{
+  char buf[MAXLINE];
+  size_t len = 0;
+  ssize_t n;
+  int truncated = 0;
+
+  headers[0] = '\0';
+  while((n = rio_readlineb(rio, buf, MAXLINE)) > 0)
+  {
+    if(!strcmp(buf, "\r\n"))
+    {
+      return truncated;
+    }
+    if(len + n < size && n < MAXLINE - 1)
+    {
+      memcpy(headers + len, buf, n + 1);
+      len += n;
+    }
+    else
+    {
+      truncated = 1;
+    }
+  }
+  return -1;
+}
+
+/* 클라이언트가 연결 유지를 원하는지 : HTTP/1.1은 Connection: close가 없으면, HTTP/1.0은 keep-alive를 명시했을 때만 */
+int client_keep_alive(char *version, char *headers)
+{
+  int keep_alive = !strcasecmp(version, "HTTP/1.1");
+  char *line = headers;
+
+  while(*line)
+  {
+    if(!strncasecmp(line, "Connection:", strlen("Connection:")) || !strncasecmp(line, "Proxy-Connection:", strlen("Proxy-Connection:")))
+    {
+      char *end = strstr(line, "\r\n");
+      char value[MAXLINE];
+      size_t len = end ? (size_t)(end - line) : strlen(line);
+
+      snprintf(value, sizeof(value), "%.*s", (int)len, line);
+      if(strcasestr(value, "close"))
+      {
+        return 0;
+      }
+      if(strcasestr(value, "keep-alive"))
+      {
+        keep_alive = 1;
+      }
+    }
+
+    char *next = strstr(line, "\r\n");
+    if(next == NULL)
+    {
+      break;
+    }
+    line = next + 2;
+  }
+  return keep_alive;
+}
+
+/* 요청에 본문이 있을 수 있는지 : GET / HEAD가 아니거나, Transfer-Encoding 또는 0이 아닌 Content-Length가 있으면 1 */
+int request_has_body(char *method, char *headers)
+{
+  char *line = headers;
+
+  if(strcasecmp(method, "GET") && strcasecmp(method, "HEAD"))
+  {
+    return 1;
+  }
+  while(*line)
+  {
+    if(!strncasecmp(line, "Transfer-Encoding:", strlen("Transfer-Encoding:")) ||
+       (!strncasecmp(line, "Content-Length:", strlen("Content-Length:")) && atol(line + strlen("Content-Length:")) != 0))
+    {
+      return 1;
+    }
+
+    char *next = strstr(line, "\r\n");
+    if(next == NULL)
+    {
+      break;
+    }
+    line = next + 2;
+  }
+  return 0;
+}
+
+/* 캐시된 응답을 전송 : 캐시에는 hop-by-hop 헤더를 빼고 저장하므로 헤더 끝에 이번 연결의 Connection 헤더를 끼워 넣음
+   gzip 변형이 있을 수 있는 응답을 압축하지 않은 채로 보낼 때는 Vary: Accept-Encoding도 함께 끼워 넣음
+   본문 경계를 알 수 없는 응답(Content-Length도 chunked도 없음)이면 연결을 닫아서 끝을 알림
+   file_fd가 0 이상이면 data는 그 파일의 file_off 위치를 mmap한 것 : 본문은 sendfile로 파일에서 바로 보냄
+   반환값 : 같은 연결로 다음 요청을 받아도 되면 1 */
+int send_cached(int fd, char *data, int size, int file_fd, off_t file_off, int keep_client)
+{
+  response_info_t info = { 0, -1, 0, 0 };
+  char line[MAXLINE];
+  char *p, *end, *header_end;
+
+  header_end = memmem(data, size, "\r\n\r\n", 4);
+  if(header_end == NULL)
+  {
+    rio_writen(fd, data, size);
+    return 0;
+  }
+  header_end += 2; // 마지막 헤더 줄의 CRLF까지
+
+  // 상태 라인 + 헤더로 본문 경계 확인
+  sscanf(data, "%*s %d", &info.status);
+  for(p = strstr(data, "\r\n") + 2; p < header_end; p = end + 2)
+  {
+    end = strstr(p, "\r\n");
+    snprintf(line, sizeof(line), "%.*s", (int)(end - p + 2), p);
+    response_header(line, &info);
+  }
+  if(!RESPONSE_FRAMED(&info))
+  {
+    keep_client = 0;
+  }
+
+  char *connection = keep_client ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+  char *vary = gzip_identity_vary(data, size);
+  struct iovec iov[4] = {
+    { data, header_end - data },
+    { connection, strlen(connection) },
+    { vary, strlen(vary) },
+    { header_end, size - (header_end - data) },
+  };
+  if(writev_all(fd, iov, file_fd < 0 ? 4 : 3) < 0)
+  {
+    return 0;
+  }
+  if(file_fd >= 0 && sendfile_all(fd, file_fd, file_off + (header_end - data), size - (header_end - data)) < 0)
+  {
+    return 0;
+  }
+  return keep_client;
+}
+
+/* 서버 응답을 클라이언트로 전달
+   상태 라인과 헤더로 본문 경계(Content-Length / chunked / 연결 종료)를 알아내고 정확히 그만큼만 전달
+   캐시에 담을 수 있는 크기면 복사하면서 cap에 모으고, MAX_OBJECT_SIZE를 넘는 순간부터는 splice로 커널 안에서만 옮김
+   *keep_client : 입력은 클라이언트가 연결 유지를 원하는지, 출력은 실제로 유지하기로 했는지 (본문 경계가 분명할 때만)
+   cap->on : 응답 전체를 담았는지, *reusable : 같은 서버 연결로 다음 요청을 보내도 되는지 */
+int relay_response(int fd, rio_t *server_rio, int *keep_client, capture_t *cap, int *reusable)
+{
+  char buf[MAXLINE], version[16];
+  char head[MAXBUF]; // 상태 라인 + 헤더를 모아서 한 번에 보냄
+  size_t head_len = 0;
+  ssize_t n;
+  int rc;
+  response_info_t info = { 0, -1, 0, 0 };
+
+  cap->size = 0;
+  cap->on = 1;
+  cap->head_len = -1;
+  cap->sized = 0;
+  cap->large = NULL;
+  *reusable = 0;
+
+  // 상태 라인 : HTTP/1.1은 기본이 keep-alive, HTTP/1.0은 기본이 close
+  if((n = rio_readlineb(server_rio, buf, MAXLINE)) <= 0)
+  {
+    return RELAY_NO_RESPONSE;
+  }
+  if(sscanf(buf, "%15s %d", version, &info.status) != 2)
+  {
+    capture_abort(cap);
+    return RELAY_FAILED;
+  }
+  info.keep_alive = !strcmp(version, "HTTP/1.1");
+  memcpy(head, buf, n);
+  head_len = n;
+
+  // 헤더 : 줄 단위로 모으면서 본문 길이와 연결 유지 여부 확인
+  while((n = rio_readlineb(server_rio, buf, MAXLINE)) > 0)
+  {
+    if(!strcmp(buf, "\r\n"))
+    {
+      // 재검증 요청에 304 : 클라이언트에는 보내지 않고 캐시된 항목의 만료 시각만 갱신 (304는 본문이 없으므로 연결은 그대로 재사용)
+      if(cap->revalidate != NULL && info.status == 304)
+      {
+        cache_refresh(cap->revalidate, head, head_len);
+        capture_abort(cap);
+        *reusable = info.keep_alive;
+        return RELAY_NOT_MODIFIED;
+      }
+      // 재검증 요청에 5xx : stale-if-error 기간 안이면 이 응답은 버리고 만료된 항목으로 응답
+      if(cap->revalidate != NULL && info.status >= 500 && time(NULL) < cache_stale_until(cap->revalidate, 1))
+      {
+        capture_abort(cap);
+        return RELAY_STALE;
+      }
+      // 본문 끝을 연결 종료로만 알 수 있으면 클라이언트 연결도 닫아야 함
+      cap->framed = RESPONSE_FRAMED(&info);
+      if(!cap->framed)
+      {
+        *keep_client = 0;
+      }
+      // 본문 크기를 미리 알고 큰 객체 저장소에도 담을 수 없거나, 부분 응답(206)이면 처음부터 모으지 않음 (따라붙은 요청은 직접 받으러 감)
+      if(info.status == 206 ||
+         (!RESPONSE_NO_BODY(&info) && !info.chunked && info.content_length >= 0 &&
+          cap->size + head_len + 2 + info.content_length > MAX_OBJECT_SIZE &&
+          !large_fits(&large, cap->size + head_len + 2 + info.content_length)))
+      {
+        capture_abort(cap);
+      }
+      // 여기까지 왔으면 길이를 아는 본문은 buf나 큰 객체 저장소에 끝까지 담김 : 따라붙은 요청이 바로 보내기 시작해도 잘리지 않음
+      cap->sized = RESPONSE_NO_BODY(&info) || (!info.chunked && info.content_length >= 0);
+      if(relay_head(fd, head, head_len, *keep_client, cap) < 0)
+      {
+        capture_abort(cap);
+        return RELAY_FAILED;
+      }
+      break;
+    }
+
+    if(response_header(buf, &info))
+    {
+      continue; // hop-by-hop 헤더는 클라이언트로 전달하지 않음
+    }
+
+    // 헤더가 아주 길면 모아 둔 만큼 먼저 보냄
+    if(head_len + n > sizeof(head))
+    {
+      if(relay_write(fd, head, head_len, cap) < 0)
+      {
+        capture_abort(cap);
+        return RELAY_FAILED;
+      }
+      head_len = 0;
+    }
+    memcpy(head + head_len, buf, n);
+    head_len += n;
+  }
+  if(n <= 0)
+  {
+    capture_abort(cap);
+    return RELAY_FAILED;
+  }
+
+  // 본문
+  if(RESPONSE_NO_BODY(&info))
+  {
+    rc = 0; // 본문 없음
+  }
+  else if(info.chunked)
+  {
+    rc = relay_chunked(fd, server_rio, cap);
+  }
+  else if(info.content_length >= 0)
+  {
+    rc = relay_body(fd, server_rio, info.content_length, cap);
+  }
+  else
+  {
+    // 본문 경계를 모르면 서버가 연결을 닫을 때까지 : 이 연결은 재사용 불가
+    info.keep_alive = 0;
+    rc = relay_body(fd, server_rio, -1, cap);
+  }
+  if(rc < 0)
+  {
+    capture_abort(cap);
+    return RELAY_FAILED;
+  }
+
+  *reusable = info.keep_alive;
+  return RELAY_OK;
+}
+
+/* 응답 헤더 한 줄에서 본문 길이와 연결 유지 여부를 info에 반영 : hop-by-hop 헤더(전달하면 안 되는 줄)면 1 반환 */
+int response_header(char *buf, response_info_t *info)
+{
+  if(!strncasecmp(buf, "Content-Length:", strlen("Content-Length:")))
+  {
+    info->content_length = atol(buf + strlen("Content-Length:"));
+  }
+  else if(!strncasecmp(buf, "Transfer-Encoding:", strlen("Transfer-Encoding:")) && strcasestr(buf, "chunked"))
+  {
+    info->chunked = 1;
+  }
+  else if(!strncasecmp(buf, "Connection:", strlen("Connection:")))
+  {
+    if(strcasestr(buf, "close"))
+    {
+      info->keep_alive = 0;
+    }
+    else if(strcasestr(buf, "keep-alive"))
+    {
+      info->keep_alive = 1;
+    }
+    return 1;
+  }
+  else if(!strncasecmp(buf, "Keep-Alive:", strlen("Keep-Alive:")) || !strncasecmp(buf, "Proxy-Connection:", strlen("Proxy-Connection:")))
+  {
+    return 1;
+  }
+  return 0;
+}
+
+void capture_init(capture_t *cap, char *buf, flight_t *flight)
+{
+  cap->buf = buf;
+  cap->size = 0;
+  cap->on = 1;
+  cap->head_len = -1;
+  cap->framed = 0;
+  cap->sized = 0;
+  cap->client_ok = 1;
+  cap->flight = flight;
+  cap->revalidate = NULL;
+  cap->large = NULL;
+  cap->range = 0;
+}
+
+/* 모으는 중이면 cap에 덧붙이고 따라붙은 요청들에게 공개
+   한도를 넘으면 큰 객체 저장소 페이지로 옮겨 계속 모으고, 그것도 안 되면 capture 포기 */
+void capture_append(capture_t *cap, char *buf, size_t n)
+{
+  if(!cap->on && cap->large == NULL)
+  {
+    return;
+  }
+  if(cap->on && cap->size + n > MAX_OBJECT_SIZE)
+  {
+    capture_spill(cap);
+  }
+  if(cap->large != NULL)
+  {
+    if(large_append(&large, cap->large, buf, n) < 0)
+    {
+      capture_abort(cap);
+    }
+    else if(cap->flight != NULL)
+    {
+      flight_publish(&flights, cap->flight, cap);
+    }
+    return;
+  }
+  if(!cap->on)
+  {
+    return;
+  }
+  memcpy(cap->buf + cap->size, buf, n);
+  cap->size += n;
+  if(cap->flight != NULL)
+  {
+    flight_publish(&flights, cap->flight, cap);
+  }
+}
+
+/* 이 응답은 캐시하지 않음 : 따라붙은 요청들도 더는 기다리지 않게 알림 */
+void capture_abort(capture_t *cap)
+{
+  if(!cap->on && cap->large == NULL)
+  {
+    return;
+  }
+  cap->on = 0;
+  if(cap->large != NULL)
+  {
+    __atomic_fetch_add(&large.dropped, 1, __ATOMIC_RELAXED);
+    large_release(cap->large);
+    cap->large = NULL;
+  }
+  if(cap->flight != NULL)
+  {
+    flight_publish(&flights, cap->flight, cap);
+  }
+}
+
+/* buf 한도를 넘음 : 헤더를 다 받은 뒤면 지금까지 모은 것을 큰 객체 저장소 페이지로 옮기고 이어서 모음
+   따라붙은 요청들에게는 그 객체를 넘겨 페이지에서 이어서 읽게 함 (페이지로 옮길 수 없으면 capture 포기) */
+void capture_spill(capture_t *cap)
+{
+  large_object_t *o = cap->head_len >= 0 ? large_start(&large) : NULL;
+
+  if(o != NULL && large_append(&large, o, cap->buf, cap->size) < 0)
+  {
+    large_release(o);
+    o = NULL;
+  }
+  if(o == NULL)
+  {
+    capture_abort(cap);
+    return;
+  }
+  cap->on = 0;
+  cap->large = o;
+  if(cap->flight != NULL)
+  {
+    flight_publish(&flights, cap->flight, cap);
+  }
+}
+
+/* 다 받은 응답을 key로 저장 : buf에 다 담았으면 메모리 캐시, 페이지로 옮겨 모았으면 큰 객체 저장소 (저장하면 안 되는 응답은 버림) */
+void capture_store(capture_t *cap, char *key)
+{
+  long expires;
+
+  if(cap->on)
+  {
+    if((expires = cache_expires(cap->buf, cap->size)) >= 0)
+    {
+      cache_insert(&cache, key, cap->buf, cap->size, expires);
+    }
+    else
+    {
+      __atomic_fetch_add(&cache.uncacheable, 1, __ATOMIC_RELAXED);
+    }
+  }
+  else if(cap->large != NULL)
+  {
+    large_commit(&large, cap->large, key);
+    cap->large = NULL;
+  }
+}
+
+/* 클라이언트로 쓰고, capture 중이면 cap에도 모음
+   리더의 클라이언트가 끊겨도 따라붙은 요청이 받을 수 있도록 모으는 동안은 서버에서 계속 읽음 */
+int relay_write(int fd, char *buf, size_t n, capture_t *cap)
+{
+  if(cap->client_ok && rio_writen(fd, buf, n) != n)
+  {
+    cap->client_ok = 0;
+  }
+  capture_append(cap, buf, n);
+  return CAPTURE_NEEDED(cap) ? 0 : -1;
+}
+
+/* 모아 둔 응답 헤더 뒤에 hop-by-hop 헤더 대신 이번 클라이언트 연결에 맞는 Connection 헤더와 빈 줄을 붙여 한 번에 전송
+   캐시에는 Connection 헤더를 빼고 담음 (히트 때 연결마다 다시 붙임) */
+int relay_head(int fd, char *head, size_t head_len, int keep_client, capture_t *cap)
+{
+  char *connection = keep_client ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+  struct iovec iov[3] = {
+    { head, head_len },
+    { connection, strlen(connection) },
+    { "\r\n", 2 },
+  };
+
+  if(cap->client_ok && writev_all(fd, iov, 3) < 0)
+  {
+    cap->client_ok = 0;
+  }
+  if(cap->on && cap->size + head_len + 2 <= MAX_OBJECT_SIZE)
+  {
+    // 헤더 끝 위치를 먼저 정해 두고 빈 줄까지 넣으면서 공개
+    memcpy(cap->buf + cap->size, head, head_len);
+    cap->size += head_len;
+    cap->head_len = cap->size;
+    capture_append(cap, "\r\n", 2);
+  }
+  else
+  {
+    capture_abort(cap);
+  }
+  return CAPTURE_NEEDED(cap) ? 0 : -1;
+}
+
+/* in_fd의 off부터 n바이트를 out_fd로 sendfile (페이지 캐시에서 소켓으로 커널 안에서만 옮김) : 성공 0, 실패 -1 */
+int sendfile_all(int out_fd, int in_fd, off_t off, size_t n)
+{
+  while(n > 0)
+  {
+    ssize_t sent = sendfile(out_fd, in_fd, &off, n);
+    if(sent < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if(sent <= 0)
+    {
+      return -1;
+    }
+    n -= sent;
+  }
+  return 0;
+}
+
+/* iovec 배열을 전부 쓸 때까지 writev 반복 : 성공 0, 실패 -1 */
+int writev_all(int fd, struct iovec *iov, int cnt)
+{
+  while(cnt > 0)
+  {
+    ssize_t n = writev(fd, iov, cnt);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+
+    // 다 쓴 항목은 건너뛰고, 일부만 쓴 항목은 앞부분을 잘라냄
+    while(cnt > 0 && (size_t)n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if(cnt > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/* 본문 n바이트(n < 0이면 EOF까지)를 전달 : capture 중에는 복사하며 모으고, capture를 포기하면 나머지는 splice
+   반환값 : 성공 0, 실패 -1 */
+int relay_body(int fd, rio_t *server_rio, long n, capture_t *cap)
+{
+  char buf[MAXBUF];
+  long left = n;
+
+  while((cap->on || cap->large != NULL) && (n < 0 || left > 0))
+  {
+    size_t want = (n < 0 || left > (long)sizeof(buf)) ? sizeof(buf) : (size_t)left;
+    ssize_t r = rio_read_some(server_rio, buf, want);
+    if(r < 0)
+    {
+      return -1;
+    }
+    if(r == 0)
+    {
+      return (n < 0) ? 0 : -1; // 길이를 아는 본문이 중간에 끊김
+    }
+    if(relay_write(fd, buf, r, cap) < 0)
+    {
+      return -1;
+    }
+    left -= r;
+  }
+  if(n >= 0 && left == 0)
+  {
+    return 0;
+  }
+  if(!cap->client_ok)
+  {
+    return -1; // 캐시하지도 않고 받을 클라이언트도 없음
+  }
+
+  // 캐시 우회 : rio 내부 버퍼에 남은 바이트를 먼저 보내고, 나머지는 splice
+  if(server_rio->rio_cnt > 0)
+  {
+    size_t m = (n < 0 || left > server_rio->rio_cnt) ? (size_t)server_rio->rio_cnt : (size_t)left;
+    if(rio_writen(fd, server_rio->rio_bufptr, m) != m)
+    {
+      return -1;
+    }
+    server_rio->rio_bufptr += m;
+    server_rio->rio_cnt -= m;
+    left -= m;
+  }
+  if(n >= 0 && left == 0)
+  {
+    return 0;
+  }
+
+  ssize_t moved = relay_splice(server_rio->rio_fd, fd, (n < 0) ? -1 : left);
+  if(moved < 0 || (n >= 0 && moved != left))
+  {
+    return -1;
+  }
+  return 0;
+}
+
+/* chunked 본문 : 청크 크기 줄을 읽어 가며 그대로 전달하고, 마지막 0 청크와 트레일러까지 전달 */
+int relay_chunked(int fd, rio_t *server_rio, capture_t *cap)
+{
+  char buf[MAXLINE];
+  ssize_t n;
+
+  while(1)
+  {
+    if((n = rio_readlineb(server_rio, buf, MAXLINE)) <= 0 || relay_write(fd, buf, n, cap) < 0)
+    {
+      return -1;
+    }
+
+    long size = strtol(buf, NULL, 16);
+    if(size <= 0)
+    {
+      break;
+    }
+
+    // 청크 데이터 + 뒤따르는 CRLF
+    if(relay_body(fd, server_rio, size + 2, cap) < 0)
+    {
+      return -1;
+    }
+  }
+
+  // 트레일러 : 빈 줄이 나올 때까지
+  while((n = rio_readlineb(server_rio, buf, MAXLINE)) > 0)
+  {
+    if(relay_write(fd, buf, n, cap) < 0)
+    {
+      return -1;
+    }
+    if(!strcmp(buf, "\r\n"))
+    {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* rio 버퍼에 남은 데이터가 있으면 그것을, 없으면 소켓에서 한 번 읽은 만큼을 반환 (n바이트를 다 채울 때까지 기다리지 않음) */
+ssize_t rio_read_some(rio_t *rp, char *buf, size_t n)
+{
+  if(rp->rio_cnt > 0)
+  {
+    size_t m = (n < (size_t)rp->rio_cnt) ? n : (size_t)rp->rio_cnt;
+    memcpy(buf, rp->rio_bufptr, m);
+    rp->rio_bufptr += m;
+    rp->rio_cnt -= m;
+    return m;
+  }
+
+  while(1)
+  {
+    ssize_t r = read(rp->rio_fd, buf, n);
+    if(r < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    return r;
+  }
+}
+
+/* from_fd에서 limit바이트(limit < 0이면 EOF까지)를 pipe를 거쳐 to_fd로 옮김 : 데이터가 사용자 공간으로 복사되지 않음
+   반환값 : 옮긴 바이트 수 (EOF가 먼저 오면 limit보다 작을 수 있음), 실패하면 -1 */
+ssize_t relay_splice(int from_fd, int to_fd, long limit)
+{
+  ssize_t total = 0;
+
+  if(splice_pipe[0] < 0 && pipe(splice_pipe) < 0)
+  {
+    return relay_copy(from_fd, to_fd, limit);
+  }
+
+  while(limit < 0 || total < limit)
+  {
+    size_t want = (limit < 0 || limit - total > SPLICE_CHUNK) ? SPLICE_CHUNK : (size_t)(limit - total);
+    ssize_t n = splice(from_fd, NULL, splice_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      // splice를 지원하지 않는 fd : 아직 아무것도 안 옮겼으면 복사로 대신함
+      if(errno == EINVAL && total == 0)
+      {
+        return relay_copy(from_fd, to_fd, limit);
+      }
+      return -1;
+    }
+    if(n == 0)
+    {
+      return total;
+    }
+
+    // pipe에 들어간 만큼 전부 클라이언트로
+    ssize_t left = n;
+    while(left > 0)
+    {
+      ssize_t m = splice(splice_pipe[0], NULL, to_fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if(m <= 0)
+      {
+        if(m < 0 && errno == EINTR)
+        {
+          continue;
+        }
+        // 클라이언트가 끊김 : pipe에 남은 데이터를 버리기 위해 새로 만듦
+        splice_pipe_close();
+        return -1;
+      }
+      left -= m;
+    }
+    total += n;
+  }
+  return total;
+}
+
+/* splice를 쓸 수 없을 때의 일반 복사 중계 */
+ssize_t relay_copy(int from_fd, int to_fd, long limit)
+{
+  char buf[MAXBUF];
+  ssize_t n = 0, total = 0;
+
+  while(limit < 0 || total < limit)
+  {
+    size_t want = (limit < 0 || limit - total > (long)sizeof(buf)) ? sizeof(buf) : (size_t)(limit - total);
+    if((n = read(from_fd, buf, want)) <= 0)
+    {
+      if(n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      break;
+    }
+    if(rio_writen(to_fd, buf, n) != n)
+    {
+      return -1;
+    }
+    total += n;
+  }
+  return (n < 0) ? -1 : total;
+}
+
+/* 현재 스레드의 splice용 pipe 닫기 (워커가 종료할 때, 또는 pipe에 데이터가 남았을 때) */
+void splice_pipe_close(void)
+{
+  if(splice_pipe[0] >= 0)
+  {
+    close(splice_pipe[0]);
+    close(splice_pipe[1]);
+    splice_pipe[0] = splice_pipe[1] = -1;
+  }
+}
+
+/* URI를 파싱해 호스트명, 경로, 포트 번호를 추출하고 대입 */
+int parse_uri(char* uri, char* hostname, char* path, int* port)
+{
+  // default 설정 : 80 포트, 루트 경로 사용
+  *port = 80;
+  strcpy(path, "/");
+
+  char* hostname_idx = strstr(uri, "//");
+  if(hostname_idx != NULL)
+  {
+    hostname_idx = hostname_idx + 2;
+  }
+  else
+  {
+    hostname_idx = uri;
+  }
+
+  char* port_idx = strstr(hostname_idx, ":");
+  char* path_idx = strstr(hostname_idx, "/");
+
+  // 포트 번호가 있는 경우
+  if(port_idx != NULL && (path_idx == NULL || port_idx < path_idx))
+  {
+    // hostname 추출
+    *port_idx = '\0';
+    strcpy(hostname, hostname_idx);
+    *port_idx = ':';
+
+    // 포트 번호 추출
+    port_idx++;
+    char* port_end_idx = strstr(port_idx, "/");
+    // 포트 번호 뒤에 "/"가 있는 경우
+    if(port_end_idx != NULL)
+    {
+      *port_end_idx = '\0';
+      *port = atoi(port_idx);
+      *port_end_idx = '/';
+      strcpy(path, port_end_idx);
+    }
+    else
+    {
+      // 포트 번호는 있지만 경로가 없는 경우
+      *port = atoi(port_idx);
+      strcpy(path, "/");
+    }
+  }
+  // 포트 번호가 없는 경우
+  else
+  {
+    // 경로는 있는 경우
+    if(path_idx != NULL)
+    {
+      // hostname 추출
+      *path_idx = '\0';
+      strcpy(hostname, hostname_idx);
+      *path_idx = '/';
+      strcpy(path, path_idx);
+    }
+    else
+    {
+      // 경로도 없는 경우
+      strcpy(hostname, hostname_idx);
+      strcpy(path, "/");
+    }
+  }
+
+  return 0;
+}
+
+/* 캐시 키 : 같은 객체를 가리키는 URI가 모두 같은 키가 되도록 parse_uri 결과를 정규화 (RFC 3986 6.2.2)
+   scheme(없으면 http)과 호스트는 소문자, scheme의 기본 포트(http 80, https 443)는 생략, %XX 이스케이프 정리, 경로의 . / .. 세그먼트 제거, fragment는 버림
+   --cache-key-query=sort면 쿼리 파라미터도 정렬 : 키가 MAXLINE을 넘으면 받은 uri를 그대로 키로 씀 */
+void cache_key(char *uri, char *key)
+{
+  char buf[MAXLINE], hostname[MAXLINE], path[MAXLINE], scheme[16] = "http", *query, *p, *authority;
+  int port, len, explicit_port;
+  size_t n;
+
+  snprintf(buf, sizeof(buf), "%s", uri);
+  if((p = strchr(buf, '#')) != NULL)
+  {
+    *p = '\0';
+  }
+  // scheme은 첫 / 앞에 오는 "scheme://"만 : 다른 scheme의 같은 경로가 한 키로 섞이지 않게 그대로 둠
+  authority = buf;
+  if((p = strstr(buf, "://")) != NULL && memchr(buf, '/', p - buf) == NULL && (size_t)(p - buf) < sizeof(scheme))
+  {
+    for(n = 0; n < (size_t)(p - buf); n++)
+    {
+      scheme[n] = tolower((unsigned char)buf[n]);
+    }
+    scheme[n] = '\0';
+    authority = p + 3;
+  }
+  n = strcspn(authority, "/?");
+  explicit_port = memchr(authority, ':', n) != NULL;
+  parse_uri(buf, hostname, path, &port);
+  for(p = hostname; *p; p++)
+  {
+    *p = tolower((unsigned char)*p);
+  }
+
+  if((query = strchr(path, '?')) != NULL)
+  {
+    *query++ = '\0';
+    uri_normalize_escapes(query);
+    if(config.cache_key_sort)
+    {
+      uri_sort_query(query);
+    }
+  }
+  uri_normalize_escapes(path);
+  uri_remove_dots(path);
+
+  if(!explicit_port || port == (strcmp(scheme, "https") ? 80 : 443))
+  {
+    len = snprintf(key, MAXLINE, "%s://%s%s%s%s", scheme, hostname, path, query ? "?" : "", query ? query : "");
+  }
+  else
+  {
+    len = snprintf(key, MAXLINE, "%s://%s:%d%s%s%s", scheme, hostname, port, path, query ? "?" : "", query ? query : "");
+  }
+  if(len >= MAXLINE)
+  {
+    snprintf(key, MAXLINE, "%s", uri);
+  }
+}
+
+/* %XX 이스케이프를 대문자 16진수로 맞추고, unreserved 문자(영문자, 숫자, - . _ ~)를 나타내는 것은 원래 문자로 풂 (제자리에서) */
+void uri_normalize_escapes(char *s)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  char *out = s;
+
+  while(*s)
+  {
+    if(s[0] == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2]))
+    {
+      int c = (isdigit((unsigned char)s[1]) ? s[1] - '0' : toupper((unsigned char)s[1]) - 'A' + 10) * 16 +
+              (isdigit((unsigned char)s[2]) ? s[2] - '0' : toupper((unsigned char)s[2]) - 'A' + 10);
+      if(isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~')
+      {
+        *out++ = c;
+      }
+      else
+      {
+        *out++ = '%';
+        *out++ = hex[c >> 4];
+        *out++ = hex[c & 15];
+      }
+      s += 3;
+      continue;
+    }
+    *out++ = *s++;
+  }
+  *out = '\0';
+}
+
+/* 경로의 . 과 .. 세그먼트를 정리 (제자리에서) : 마지막 세그먼트가 . 이나 ..였으면 디렉터리이므로 /로 끝남 */
+void uri_remove_dots(char *path)
+{
+  char out[MAXLINE];
+  size_t o = 0, n;
+  char *seg, *end;
+  int dir = 0;
+
+  if(path[0] != '/')
+  {
+    return;
+  }
+  for(seg = path + 1; ; seg = end + 1)
+  {
+    end = strchr(seg, '/');
+    n = end ? (size_t)(end - seg) : strlen(seg);
+    dir = 0;
+    if(n == 1 && seg[0] == '.')
+    {
+      dir = 1;
+    }
+    else if(n == 2 && seg[0] == '.' && seg[1] == '.')
+    {
+      // 바로 앞 세그먼트를 지움 (루트 위로는 올라가지 않음)
+      while(o > 0 && out[--o] != '/')
+      {
+      }
+      dir = 1;
+    }
+    else
+    {
+      out[o++] = '/';
+      memcpy(out + o, seg, n);
+      o += n;
+    }
+    if(end == NULL)
+    {
+      break;
+    }
+  }
+  if(dir || o == 0)
+  {
+    out[o++] = '/';
+  }
+  memcpy(path, out, o);
+  path[o] = '\0';
+}
+
+/* 쿼리 파라미터(& 구분)를 사전순으로 정렬 (제자리에서) : 파라미터가 너무 많으면 그대로 둠 */
+void uri_sort_query(char *query)
+{
+  char buf[MAXLINE], *params[64], *save, *param;
+  int n = 0;
+  size_t len = 0;
+
+  snprintf(buf, sizeof(buf), "%s", query);
+  for(param = strtok_r(buf, "&", &save); param != NULL; param = strtok_r(NULL, "&", &save))
+  {
+    if(n == 64)
+    {
+      return;
+    }
+    params[n++] = param;
+  }
+  qsort(params, n, sizeof(char *), query_param_cmp);
+  for(int i = 0; i < n; i++)
+  {
+    len += sprintf(query + len, "%s%s", i ? "&" : "", params[i]);
+  }
+  query[len] = '\0';
+}
+
+int query_param_cmp(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* 프록시에서 웹 서버로 전달할 HTTP 헤더를 생성(재구성) : 이미 읽어 둔 헤더 문자열(요청 라인 다음부터)에서 헤더를 가져옴
+   keep_alive : 서버 연결을 풀에서 재사용하려면 HTTP/1.1 + Connection: keep-alive로 요청
+   forward_range : 클라이언트의 Range / If-Range도 전달 (아니면 빼고 캐시에 담을 전체 응답을 받음) */
+void makeHttpHeaderFromBuf(char* http_header, char* hostname, char* path, int port, char* headers, int keep_alive, int forward_range)
+{
+  char buf[MAXLINE], request_header[MAXLINE], other_header[MAXLINE] = "", host_header[MAXLINE] = "";
+  char* line = headers;
+  char* line_end;
+
+  // 요청 라인 생성
+  sprintf(request_header, "GET %s HTTP/1.%d\r\n", path, keep_alive ? 1 : 0);
+
+  // 한 줄씩 잘라 처리
+  while((line_end = strstr(line, "\r\n")) != NULL)
+  {
+    size_t len = line_end - line + 2;
+
+    // 빈 텍스트 라인 : 종료
+    if(len == 2 || len >= MAXLINE)
+    {
+      break;
+    }
+
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+    collectHeaderLine(buf, host_header, other_header, forward_range);
+    line = line_end + 2;
+  }
+
+  assembleHttpHeader(http_header, request_header, hostname, host_header, other_header, keep_alive);
+}
+
+/* 클라이언트 헤더 한 줄을 보고 Host 헤더 또는 그 외 전달할 헤더로 분류 */
+void collectHeaderLine(char* buf, char* host_header, char* other_header, int forward_range)
+{
+  // Host 헤더는 host_header에 복사
+  if(!(strncasecmp(buf, "Host", strlen("Host"))))
+  {
+    strcpy(host_header, buf);
+    return;
+  }
+
+  // User-Agent 헤더(범위를 서버에서 바로 받을 때는 Range, If-Range도)는 other_header에 복사
+  // (Connection, Proxy-Connection은 클라이언트-프록시 구간에만 해당하는 hop-by-hop 헤더라 프록시가 직접 정한 값만 보냄)
+  if(!(strncasecmp(buf, "User-Agent", strlen("User-Agent"))) ||
+     (forward_range && (!strncasecmp(buf, "Range:", strlen("Range:")) || !strncasecmp(buf, "If-Range:", strlen("If-Range:")))))
+  {
+    if(strlen(other_header) + strlen(buf) < MAXLINE)
+    {
+      strcat(other_header, buf);
+    }
+  }
+}
+
+/* 분류해 둔 헤더들로 서버에 보낼 최종 헤더 조립 */
+void assembleHttpHeader(char* http_header, char* request_header, char* hostname, char* host_header, char* other_header, int keep_alive)
+{
+  char *connection_header = keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+
+  // Host 헤더가 없는 경우 기본값 설정
+  if(!strlen(host_header))
+  {
+    snprintf(host_header, MAXLINE, "Host: %s\r\n", hostname);
+  }
+
+  // 마지막에 헤더 조립
+  // (Proxy-Connection은 표준 헤더가 아니고 Connection과 값이 어긋날 수 있어서 보내지 않음 : 서버 연결 유지 여부는 Connection 하나로만 알림)
+  snprintf(http_header, MAXLINE, "%s%s%s%s%s%s", request_header, host_header, connection_header, user_agent_hdr, other_header, "\r\n");
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* 서버 연결 풀 함수들 */
+
+void upstream_init(upstream_pool_t *up)
+{
+  memset(up->buckets, 0, sizeof(up->buckets));
+  up->reused = 0;
+  up->opened = 0;
+  pthread_mutex_init(&up->lock, NULL);
+}
+
+/* (hostname, port)의 유휴 연결 중 살아 있는 것을 꺼내고, 없으면 새로 연결 : *reused는 풀에서 꺼냈는지 */
+int upstream_acquire(upstream_pool_t *up, char *hostname, char *port, int *reused)
+{
+  unsigned int h = upstream_hash(hostname, port);
+  long now = now_ms();
+  int fd;
+
+  *reused = 0;
+  while(config.upstream_max_idle > 0)
+  {
+    upstream_conn_t *conn = NULL;
+    upstream_conn_t **pp;
+
+    // 가장 최근에 반납된 연결부터 (리스트 앞쪽)
+    pthread_mutex_lock(&up->lock);
+    for(pp = &up->buckets[h]; *pp != NULL; pp = &(*pp)->next)
+    {
+      if(!strcmp((*pp)->hostname, hostname) && !strcmp((*pp)->port, port))
+      {
+        conn = *pp;
+        *pp = conn->next;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&up->lock);
+
+    if(conn == NULL)
+    {
+      break;
+    }
+
+    fd = conn->fd;
+    int usable = (now - conn->idle_since < config.upstream_idle_timeout * 1000L) && upstream_alive(fd);
+    Free(conn);
+    if(usable)
+    {
+      __atomic_fetch_add(&up->reused, 1, __ATOMIC_RELAXED);
+      *reused = 1;
+      return fd;
+    }
+    close(fd); // 오래됐거나 서버가 이미 닫은 연결
+  }
+
+  fd = dns_connect(&dns, hostname, port);
+  if(fd >= 0)
+  {
+    __atomic_fetch_add(&up->opened, 1, __ATOMIC_RELAXED);
+  }
+  return fd;
+}
+
+/* 응답을 끝까지 읽은 연결을 풀에 반납 : 재사용할 수 없거나 풀이 가득 찼으면 닫음 */
+void upstream_release(upstream_pool_t *up, int fd, char *hostname, char *port, int reusable)
+{
+  unsigned int h = upstream_hash(hostname, port);
+  long now = now_ms();
+  upstream_conn_t *expired = NULL;
+  int idle = 0;
+
+  if(!reusable || config.upstream_max_idle <= 0 || strlen(hostname) >= UPSTREAM_HOST_MAX || strlen(port) >= sizeof(((upstream_conn_t *)0)->port))
+  {
+    close(fd);
+    return;
+  }
+
+  upstream_conn_t *conn = Malloc(sizeof(upstream_conn_t));
+  conn->fd = fd;
+  strcpy(conn->hostname, hostname);
+  strcpy(conn->port, port);
+  conn->idle_since = now;
+
+  pthread_mutex_lock(&up->lock);
+  // 같은 버킷을 훑으면서 시간이 지난 연결은 떼어 내고, 같은 키의 유휴 연결 수를 셈
+  for(upstream_conn_t **pp = &up->buckets[h]; *pp != NULL; )
+  {
+    upstream_conn_t *p = *pp;
+    if(now - p->idle_since >= config.upstream_idle_timeout * 1000L)
+    {
+      *pp = p->next;
+      p->next = expired;
+      expired = p;
+      continue;
+    }
+    if(!strcmp(p->hostname, hostname) && !strcmp(p->port, port))
+    {
+      idle++;
+    }
+    pp = &p->next;
+  }
+
+  if(idle < config.upstream_max_idle)
+  {
+    conn->next = up->buckets[h];
+    up->buckets[h] = conn;
+    conn = NULL;
+  }
+  pthread_mutex_unlock(&up->lock);
+
+  // 닫는 작업은 락 밖에서
+  if(conn != NULL)
+  {
+    close(conn->fd);
+    Free(conn);
+  }
+  while(expired != NULL)
+  {
+    upstream_conn_t *next = expired->next;
+    close(expired->fd);
+    Free(expired);
+    expired = next;
+  }
+}
+
+/* 유휴 연결이 아직 쓸 수 있는지 : 읽을 데이터가 없고(EAGAIN) 서버가 닫지도 않았어야 함 */
+int upstream_alive(int fd)
+{
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+unsigned int upstream_hash(char *hostname, char *port)
+{
+  unsigned int h = 5381;
+
+  for(char *p = hostname; *p; p++)
+  {
+    h = h * 33 + (unsigned char)*p;
+  }
+  for(char *p = port; *p; p++)
+  {
+    h = h * 33 + (unsigned char)*p;
+  }
+  return h % UPSTREAM_BUCKETS;
+}
+
+/* 단조 시계 기준 현재 시각 (ms) */
+long now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* 이름 조회 캐시 함수들
+   getaddrinfo는 레코드의 TTL을 알려 주지 않으므로 성공/실패 결과를 각각 --dns-ttl, --dns-negative-ttl 동안 보관
+   같은 이름을 동시에 찾으면 한 번만 조회하고, 자주 쓰는 이름은 만료 전에 resolver 스레드가 미리 다시 조회 */
+
+void dns_init(dns_cache_t *dc)
+{
+  pthread_t tid;
+
+  memset(dc, 0, sizeof(dns_cache_t));
+  for(int i = 0; i < DNS_SHARDS; i++)
+  {
+    pthread_mutex_init(&dc->shards[i].lock, NULL);
+    pthread_cond_init(&dc->shards[i].done, NULL);
+  }
+  pthread_mutex_init(&dc->job_lock, NULL);
+  pthread_cond_init(&dc->job_cond, NULL);
+
+  for(int i = 0; i < DNS_RESOLVERS; i++)
+  {
+    Pthread_create(&tid, NULL, dns_resolver, dc);
+  }
+  Pthread_create(&tid, NULL, dns_refresher, dc);
+}
+
+/* 블로킹 조회 (워커 스레드용) : 캐시에 없으면 호출한 스레드가 직접 조회하고, 다른 스레드가 조회 중이면 끝날 때까지 기다림
+   반환값 : 성공 0, 실패하면 getaddrinfo 에러 코드 */
+int dns_resolve(dns_cache_t *dc, char *hostname, char *port, dns_addrs_t *out)
+{
+  int start, rc, err;
+  dns_entry_t *entry;
+
+  rc = dns_get(dc, hostname, port, out, &err, -1, &entry, &start);
+  if(rc == DNS_OK)
+  {
+    return 0;
+  }
+  if(rc == DNS_FAILED)
+  {
+    return err;
+  }
+
+  if(start)
+  {
+    struct addrinfo *list = NULL;
+    rc = dns_query(entry, &list);
+    dns_complete(dc, entry, rc, list);
+  }
+
+  // dns_get이 users를 올려 두었으므로 기다리는 동안 refresher가 항목을 지우지 않음
+  pthread_mutex_lock(&entry->shard->lock);
+  while(entry->status == DNS_ENTRY_PENDING)
+  {
+    pthread_cond_wait(&entry->shard->done, &entry->shard->lock);
+  }
+  if(entry->status == DNS_ENTRY_OK)
+  {
+    *out = entry->addrs;
+    rc = 0;
+  }
+  else
+  {
+    rc = entry->err;
+  }
+  entry->users--;
+  pthread_mutex_unlock(&entry->shard->lock);
+  return rc;
+}
+
+/* 논블로킹 조회 (이벤트 루프용) : 캐시에 없으면 resolver 스레드에 맡기고 DNS_PENDING 반환
+   조회가 끝나면 notify_fd(eventfd)에 써서 알려 주므로, 그때 다시 호출하면 DNS_OK 또는 DNS_FAILED */
+int dns_lookup(dns_cache_t *dc, char *hostname, char *port, dns_addrs_t *out, int *err, int notify_fd)
+{
+  int start;
+  dns_entry_t *entry;
+  int rc = dns_get(dc, hostname, port, out, err, notify_fd, &entry, &start);
+
+  // 락을 놓은 뒤 큐에 넣어도 waiter는 이미 등록되어 있으므로 알림을 놓치지 않음
+  if(start)
+  {
+    dns_queue(dc, entry);
+  }
+  return rc;
+}
+
+/* open_clientfd와 같지만 주소는 DNS 캐시에서 가져오고, 주소들은 Happy Eyeballs로 경쟁시킴 : 이름 조회 실패 -2, 연결 실패 -1 */
+int dns_connect(dns_cache_t *dc, char *hostname, char *port)
+{
+  dns_addrs_t addrs;
+  int rc;
+
+  if((rc = dns_resolve(dc, hostname, port, &addrs)) != 0)
+  {
+    fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
+    return -2;
+  }
+  return happy_connect(&addrs, hostname, port);
+}
+
+/* (hostname, port) 항목을 찾거나 만들어 한 번의 락 안에서 결과를 읽음
+   DNS_OK면 *out, DNS_FAILED면 *err를 채움. DNS_PENDING이면 *entry_out에 조회 중인 항목을 돌려줌 :
+   notify_fd >= 0이면 조회가 끝날 때 깨울 eventfd로 등록하고, notify_fd < 0(블로킹 조회)이면 users를 올려 둠
+   새로 조회를 시작해야 하면(처음이거나 만료) *start = 1 : 호출한 쪽이 직접 조회하거나 resolver에 맡겨야 함 */
+int dns_get(dns_cache_t *dc, char *hostname, char *port, dns_addrs_t *out, int *err, int notify_fd, dns_entry_t **entry_out, int *start)
+{
+  unsigned int h = upstream_hash(hostname, port);
+  dns_shard_t *shard = &dc->shards[h % DNS_SHARDS];
+  dns_entry_t **bucket = &shard->buckets[h / DNS_SHARDS % DNS_BUCKETS];
+  dns_entry_t *entry;
+  long now = now_ms();
+  int rc;
+
+  *start = 0;
+  *entry_out = NULL;
+  if(strlen(hostname) >= UPSTREAM_HOST_MAX || strlen(port) >= sizeof(entry->port))
+  {
+    *err = EAI_NONAME; // 캐시에 넣을 수 없을 만큼 긴 이름
+    return DNS_FAILED;
+  }
+
+  pthread_mutex_lock(&shard->lock);
+  for(entry = *bucket; entry != NULL; entry = entry->next)
+  {
+    if(!strcmp(entry->hostname, hostname) && !strcmp(entry->port, port))
+    {
+      break;
+    }
+  }
+
+  if(entry == NULL)
+  {
+    entry = Calloc(1, sizeof(dns_entry_t));
+    strcpy(entry->hostname, hostname);
+    strcpy(entry->port, port);
+    entry->shard = shard;
+    entry->status = DNS_ENTRY_PENDING;
+    entry->next = *bucket;
+    *bucket = entry;
+    *start = 1;
+  }
+  else if(entry->status != DNS_ENTRY_PENDING && !entry->refreshing && now >= entry->expires)
+  {
+    entry->status = DNS_ENTRY_PENDING;
+    *start = 1;
+  }
+
+  if(entry->status == DNS_ENTRY_OK)
+  {
+    entry->hits++;
+    *out = entry->addrs;
+    rc = DNS_OK;
+  }
+  else if(entry->status == DNS_ENTRY_FAILED)
+  {
+    *err = entry->err;
+    rc = DNS_FAILED;
+  }
+  else
+  {
+    if(notify_fd < 0)
+    {
+      entry->users++;
+    }
+    else
+    {
+      // 같은 루프가 이미 기다리고 있으면 다시 등록하지 않음
+      int i;
+      for(i = 0; i < entry->nwaiters && entry->waiters[i] != notify_fd; i++)
+      {
+      }
+      if(i == entry->nwaiters && entry->nwaiters < DNS_MAX_WAITERS)
+      {
+        entry->waiters[entry->nwaiters++] = notify_fd;
+      }
+    }
+    *entry_out = entry;
+    rc = DNS_PENDING;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  if(*start)
+  {
+    __atomic_fetch_add(&dc->misses, 1, __ATOMIC_RELAXED);
+  }
+  else if(rc != DNS_PENDING)
+  {
+    __atomic_fetch_add(&dc->hits, 1, __ATOMIC_RELAXED);
+  }
+  return rc;
+}
+
+/* 조회 결과를 항목에 기록하고 기다리던 스레드/이벤트 루프를 깨움 : list는 여기서 해제 */
+void dns_complete(dns_cache_t *dc, dns_entry_t *entry, int rc, struct addrinfo *list)
+{
+  dns_shard_t *shard = entry->shard;
+  int waiters[DNS_MAX_WAITERS], nwaiters;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&shard->lock);
+  if(rc == 0)
+  {
+    entry->addrs.n = 0;
+    for(struct addrinfo *p = list; p != NULL && entry->addrs.n < DNS_MAX_ADDRS; p = p->ai_next)
+    {
+      dns_addr_t *a = &entry->addrs.addr[entry->addrs.n++];
+      a->family = p->ai_family;
+      a->socktype = p->ai_socktype;
+      a->protocol = p->ai_protocol;
+      a->addrlen = p->ai_addrlen;
+      memcpy(&a->addr, p->ai_addr, p->ai_addrlen);
+    }
+    entry->status = DNS_ENTRY_OK;
+    entry->expires = now_ms() + config.dns_ttl * 1000L;
+  }
+  else if(!entry->refreshing)
+  {
+    entry->status = DNS_ENTRY_FAILED;
+    entry->err = rc;
+    entry->expires = now_ms() + config.dns_negative_ttl * 1000L;
+  }
+  // 미리 갱신이 실패하면 기존 주소를 만료 때까지 그대로 사용
+  entry->refreshing = 0;
+  entry->hits = 0;
+
+  nwaiters = entry->nwaiters;
+  memcpy(waiters, entry->waiters, nwaiters * sizeof(int));
+  entry->nwaiters = 0;
+  pthread_cond_broadcast(&shard->done);
+  pthread_mutex_unlock(&shard->lock);
+
+  if(rc != 0)
+  {
+    __atomic_fetch_add(&dc->failures, 1, __ATOMIC_RELAXED);
+  }
+  if(list != NULL)
+  {
+    freeaddrinfo(list);
+  }
+  for(int i = 0; i < nwaiters; i++)
+  {
+    if(write(waiters[i], &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+      fprintf(stderr, "dns notify error: %s\n", strerror(errno));
+    }
+  }
+}
+
+/* resolver 스레드에 조회를 맡김 */
+void dns_queue(dns_cache_t *dc, dns_entry_t *entry)
+{
+  pthread_mutex_lock(&dc->job_lock);
+  entry->next_job = dc->jobs;
+  dc->jobs = entry;
+  pthread_cond_signal(&dc->job_cond);
+  pthread_mutex_unlock(&dc->job_lock);
+}
+
+/* 실제 getaddrinfo 호출 (open_clientfd와 같은 hints) */
+int dns_query(dns_entry_t *entry, struct addrinfo **list)
+{
+  struct addrinfo hints;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  return getaddrinfo(entry->hostname, entry->port, &hints, list);
+}
+
+/* 큐에 들어온 이름을 하나씩 조회 : 느린 조회가 이벤트 루프를 막지 않도록 별도 스레드에서 */
+void* dns_resolver(void* dc_ptr)
+{
+  dns_cache_t *dc = (dns_cache_t *)dc_ptr;
+
+  Pthread_detach(pthread_self());
+  while(1)
+  {
+    pthread_mutex_lock(&dc->job_lock);
+    while(dc->jobs == NULL)
+    {
+      pthread_cond_wait(&dc->job_cond, &dc->job_lock);
+    }
+    dns_entry_t *entry = dc->jobs;
+    dc->jobs = entry->next_job;
+    pthread_mutex_unlock(&dc->job_lock);
+
+    struct addrinfo *list = NULL;
+    int rc = dns_query(entry, &list);
+    dns_complete(dc, entry, rc, list);
+  }
+  return NULL;
+}
+
+/* 주기적으로 샤드를 훑으면서 만료된 항목은 지우고, hot 이름은 만료 전에 미리 갱신 */
+void* dns_refresher(void* dc_ptr)
+{
+  dns_cache_t *dc = (dns_cache_t *)dc_ptr;
+
+  Pthread_detach(pthread_self());
+  while(1)
+  {
+    usleep(DNS_REFRESH_INTERVAL_US);
+
+    // 다음 주기 전에 만료될 이름이면 지금 갱신 (TTL이 짧으면 TTL의 절반 지점부터)
+    long now = now_ms();
+    long ahead = 2 * DNS_REFRESH_INTERVAL_US / 1000;
+    if(ahead > config.dns_ttl * 500L)
+    {
+      ahead = config.dns_ttl * 500L;
+    }
+
+    for(int i = 0; i < DNS_SHARDS; i++)
+    {
+      dns_shard_t *shard = &dc->shards[i];
+      dns_entry_t *expired = NULL, *refresh = NULL;
+
+      pthread_mutex_lock(&shard->lock);
+      for(int b = 0; b < DNS_BUCKETS; b++)
+      {
+        for(dns_entry_t **pp = &shard->buckets[b]; *pp != NULL; )
+        {
+          dns_entry_t *entry = *pp;
+          if(entry->status == DNS_ENTRY_PENDING || entry->refreshing || entry->users > 0)
+          {
+            // 조회 중이거나 누가 결과를 기다리는 항목은 건드리지 않음
+          }
+          else if(now >= entry->expires)
+          {
+            *pp = entry->next;
+            entry->next = expired;
+            expired = entry;
+            continue;
+          }
+          else if(entry->status == DNS_ENTRY_OK && entry->hits >= DNS_HOT_HITS && entry->expires - now <= ahead)
+          {
+            entry->refreshing = 1;
+            entry->next_job = refresh;
+            refresh = entry;
+          }
+          pp = &entry->next;
+        }
+      }
+      pthread_mutex_unlock(&shard->lock);
+
+      while(expired != NULL)
+      {
+        dns_entry_t *next = expired->next;
+        Free(expired);
+        expired = next;
+      }
+      while(refresh != NULL)
+      {
+        dns_entry_t *next = refresh->next_job;
+        __atomic_fetch_add(&dc->refreshes, 1, __ATOMIC_RELAXED);
+        dns_queue(dc, refresh);
+        refresh = next;
+      }
+    }
+  }
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* 요청 합치기 (single-flight) 함수들
+   캐시 미스가 동시에 여러 개 나도 URI마다 서버 요청은 하나만 보냄 : 먼저 온 요청(리더)이 받아 오고,
+   뒤에 온 요청은 리더가 모으는 응답을 도착하는 대로 자기 클라이언트로 보냄 */
+
+void flight_init(flight_table_t *ft)
+{
+  memset(ft, 0, sizeof(flight_table_t));
+  for(int i = 0; i < FLIGHT_SHARDS; i++)
+  {
+    pthread_mutex_init(&ft->shards[i].lock, NULL);
+  }
+}
+
+/* uri가 들어갈 샤드와 그 안의 버킷 */
+flight_t **flight_bucket(flight_table_t *ft, char *uri, flight_shard_t **shard)
+{
+  unsigned int h = upstream_hash(uri, "");
+
+  *shard = &ft->shards[h % FLIGHT_SHARDS];
+  return &(*shard)->buckets[h / FLIGHT_SHARDS % FLIGHT_BUCKETS];
+}
+
+/* uri에 대해 진행 중인 요청이 있으면 따라붙고(*leader = 0), 없으면 새로 만들어 리더가 됨(*leader = 1) */
+flight_t *flight_join(flight_table_t *ft, char *uri, int *leader)
+{
+  flight_shard_t *shard;
+  flight_t **bucket = flight_bucket(ft, uri, &shard);
+  flight_t *f, *fresh = NULL;
+
+  pthread_mutex_lock(&shard->lock);
+  while(1)
+  {
+    for(f = *bucket; f != NULL; f = f->next)
+    {
+      if(!strcmp(f->uri, uri))
+      {
+        break;
+      }
+    }
+    if(f != NULL || fresh != NULL)
+    {
+      break;
+    }
+
+    // 없으면 락을 놓고 만든 뒤 다시 찾음 : MAX_OBJECT_SIZE 버퍼 할당 동안 같은 샤드의 다른 요청을 막지 않도록
+    pthread_mutex_unlock(&shard->lock);
+    fresh = Calloc(1, sizeof(flight_t));
+    strcpy(fresh->uri, uri);
+    fresh->shard = shard;
+    fresh->data = Malloc(MAX_OBJECT_SIZE);
+    fresh->head_len = -1;
+    fresh->state = FLIGHT_ACTIVE;
+    fresh->refs = 1;
+    pthread_cond_init(&fresh->progress, NULL);
+    pthread_mutex_lock(&shard->lock);
+  }
+
+  if(f != NULL)
+  {
+    f->refs++;
+    *leader = 0;
+  }
+  else
+  {
+    f = fresh;
+    fresh = NULL;
+    f->next = *bucket;
+    *bucket = f;
+    *leader = 1;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  __atomic_fetch_add(*leader ? &ft->leaders : &ft->followers, 1, __ATOMIC_RELAXED);
+  if(fresh != NULL)
+  {
+    // 락을 놓은 사이에 다른 요청이 먼저 리더가 됨
+    pthread_cond_destroy(&fresh->progress);
+    Free(fresh->data);
+    Free(fresh);
+  }
+  return f;
+}
+
+/* 따라붙은 요청 : 리더가 공개하는 바이트를 도착하는 대로 클라이언트로 보냄 (Connection 헤더는 이 연결에 맞게 붙임)
+   끝까지 모을 수 있다고 아는 응답(sized)이 아니면 리더가 다 받을 때까지 기다렸다가 보냄 :
+   길이를 모르는 응답이 중간에 한도를 넘어 모으기를 포기하면, 이미 보낸 앞부분 뒤에서 연결이 닫혀 끝난 응답처럼 보이므로
+   반환값 : 같은 연결로 다음 요청을 받아도 되면 1, 닫아야 하면 0,
+           리더가 실패했는데 아직 아무것도 보내지 않았으면 -1 (직접 받아 오면 됨) */
+int flight_follow(int fd, flight_t *f, int keep_client)
+{
+  flight_table_t *ft = &flights;
+  pthread_mutex_t *lock = &f->shard->lock;
+  long sent = 0; // 보낸 data 바이트 수 (헤더를 보냈으면 > 0)
+  blob_t b;
+
+  pthread_mutex_lock(lock);
+  while(1)
+  {
+    while(f->state == FLIGHT_ACTIVE && (f->head_len < 0 || f->size <= sent || (sent == 0 && !f->sized)))
+    {
+      pthread_cond_wait(&f->progress, lock);
+    }
+    if(f->state == FLIGHT_FAILED || f->head_len < 0)
+    {
+      pthread_mutex_unlock(lock);
+      if(sent == 0)
+      {
+        __atomic_fetch_add(&ft->fallbacks, 1, __ATOMIC_RELAXED);
+        return -1;
+      }
+      return 0; // 이미 일부를 보냈으므로 연결을 닫아 잘린 응답임을 알림
+    }
+    long size = f->size;
+    int head_len = f->head_len, done = (f->state == FLIGHT_DONE);
+    large_object_t *o = f->large;
+    if(!f->framed)
+    {
+      keep_client = 0;
+    }
+    pthread_mutex_unlock(lock);
+
+    // 페이지로 옮긴 뒤면 페이지 체인에서 (data에 남은 앞부분과 같은 바이트), 아니면 data에서
+    blob_init(&b, f->data, size, o);
+    if(sent == 0)
+    {
+      char *connection = keep_client ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+      struct iovec iov[2] = {
+        { f->data, head_len },
+        { connection, strlen(connection) },
+      };
+      if(writev_all(fd, iov, 2) < 0)
+      {
+        return 0;
+      }
+      sent = head_len;
+    }
+    if(blob_write(fd, &b, sent, size - sent) < 0)
+    {
+      return 0;
+    }
+    sent = size;
+    if(done)
+    {
+      return keep_client;
+    }
+
+    pthread_mutex_lock(lock);
+  }
+}
+
+/* 리더가 모은 만큼을 따라붙은 요청들에게 공개 : 페이지로 옮겨 모으는 중이면 그 객체의 참조를 잡아 두고 객체 크기를 공개
+   모으기를 포기했으면 FAILED로 바꿔 직접 받으러 가게 함 */
+void flight_publish(flight_table_t *ft, flight_t *f, capture_t *cap)
+{
+  pthread_mutex_lock(&f->shard->lock);
+  if(cap->on || cap->large != NULL)
+  {
+    if(cap->large != NULL && f->large == NULL)
+    {
+      __atomic_fetch_add(&cap->large->refs, 1, __ATOMIC_RELAXED);
+      f->large = cap->large;
+    }
+    f->size = cap->large != NULL ? (long)cap->large->size : cap->size;
+    f->head_len = cap->head_len;
+    f->framed = cap->framed;
+    f->sized = cap->sized;
+  }
+  else
+  {
+    f->state = FLIGHT_FAILED;
+  }
+  pthread_cond_broadcast(&f->progress);
+  pthread_mutex_unlock(&f->shard->lock);
+}
+
+/* 리더가 끝남 : 표에서 빼서 새 요청이 따라붙지 않게 하고, 따라붙은 요청들을 깨움 */
+void flight_finish(flight_table_t *ft, flight_t *f, int ok)
+{
+  flight_shard_t *shard;
+  flight_t **bucket = flight_bucket(ft, f->uri, &shard);
+
+  pthread_mutex_lock(&shard->lock);
+  for(flight_t **pp = bucket; *pp != NULL; pp = &(*pp)->next)
+  {
+    if(*pp == f)
+    {
+      *pp = f->next;
+      break;
+    }
+  }
+  if(f->state == FLIGHT_ACTIVE)
+  {
+    f->state = ok ? FLIGHT_DONE : FLIGHT_FAILED;
+  }
+  pthread_cond_broadcast(&f->progress);
+  pthread_mutex_unlock(&shard->lock);
+
+  flight_release(ft, f);
+}
+
+/* 참조를 놓음 : 마지막이면 해제 (리더는 flight_finish에서 표에서 뺀 뒤 놓으므로 0이면 표에 없음) */
+void flight_release(flight_table_t *ft, flight_t *f)
+{
+  pthread_mutex_lock(&f->shard->lock);
+  int refs = --f->refs;
+  pthread_mutex_unlock(&f->shard->lock);
+
+  if(refs == 0)
+  {
+    if(f->large != NULL)
+    {
+      large_release(f->large);
+    }
+    pthread_cond_destroy(&f->progress);
+    Free(f->data);
+    Free(f);
+  }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* 서버 연결 함수들 (Happy Eyeballs, RFC 8305)
+   주소 계열을 번갈아 가며 connect_delay 간격으로 논블로킹 connect를 시작하고, 먼저 연결된 소켓을 사용
+   응답하지 않는 주소 하나가 커널 SYN 타임아웃 동안 연결을 붙잡지 않고, 전체 시도는 connect_timeout 안에 끝남 */
+
+/* getaddrinfo가 정렬한 순서(RFC 6724)를 유지하면서, 첫 주소의 계열부터 IPv6/IPv4를 번갈아 배치 (RFC 8305 4절) */
+void addrs_interleave(dns_addrs_t *addrs)
+{
+  dns_addr_t first[DNS_MAX_ADDRS], other[DNS_MAX_ADDRS];
+  int nfirst = 0, nother = 0, n = 0;
+
+  if(addrs->n == 0)
+  {
+    return;
+  }
+  for(int i = 0; i < addrs->n; i++)
+  {
+    if(addrs->addr[i].family == addrs->addr[0].family)
+    {
+      first[nfirst++] = addrs->addr[i];
+    }
+    else
+    {
+      other[nother++] = addrs->addr[i];
+    }
+  }
+  for(int i = 0; i < nfirst || i < nother; i++)
+  {
+    if(i < nfirst)
+    {
+      addrs->addr[n++] = first[i];
+    }
+    if(i < nother)
+    {
+      addrs->addr[n++] = other[i];
+    }
+  }
+}
+
+/* 블로킹 모드용 : poll로 여러 연결 시도를 동시에 기다림. 연결된 소켓은 블로킹으로 되돌려 반환, 실패하면 -1 */
+int happy_connect(dns_addrs_t *addrs, char *hostname, char *port)
+{
+  struct pollfd pfds[DNS_MAX_ADDRS];
+  int owner[DNS_MAX_ADDRS]; // pfds[i]가 시도 중인 주소 번호
+  int nactive = 0, next = 0;
+  long start = now_ms(), deadline = start + config.connect_timeout, next_attempt_at = start;
+
+  addrs_interleave(addrs);
+  while(1)
+  {
+    long now = now_ms();
+
+    // 시작할 차례가 된 주소 시도 (앞 시도가 바로 실패하면 기다리지 않고 다음 주소로)
+    while(next < addrs->n && (nactive == 0 || now >= next_attempt_at))
+    {
+      int fd = connect_start(&addrs->addr[next]);
+      if(fd >= 0)
+      {
+        pfds[nactive].fd = fd;
+        pfds[nactive].events = POLLOUT;
+        owner[nactive++] = next;
+        next_attempt_at = now + config.connect_delay;
+      }
+      next++;
+      if(fd >= 0)
+      {
+        break;
+      }
+    }
+
+    if(nactive == 0)
+    {
+      __atomic_fetch_add(&connect_stats.failures, 1, __ATOMIC_RELAXED);
+      return -1; // 모든 주소가 실패
+    }
+    if(now >= deadline)
+    {
+      for(int i = 0; i < nactive; i++)
+      {
+        close(pfds[i].fd);
+      }
+      fprintf(stderr, "connect to %s:%s timed out after %d ms\n", hostname, port, config.connect_timeout);
+      __atomic_fetch_add(&connect_stats.timeouts, 1, __ATOMIC_RELAXED);
+      return -1;
+    }
+
+    long wait = deadline - now;
+    if(next < addrs->n && next_attempt_at - now < wait)
+    {
+      wait = next_attempt_at - now;
+    }
+    if(poll(pfds, nactive, wait) < 0 && errno != EINTR)
+    {
+      wait = 0;
+    }
+
+    for(int i = 0; i < nactive; )
+    {
+      int rc = (pfds[i].revents != 0) ? connect_result(pfds[i].fd) : 0;
+      if(rc > 0)
+      {
+        // 이긴 소켓만 남기고 나머지 시도는 취소
+        int fd = pfds[i].fd;
+        for(int j = 0; j < nactive; j++)
+        {
+          if(j != i)
+          {
+            close(pfds[j].fd);
+          }
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+        connect_count(&addrs->addr[owner[i]], now_ms() - start);
+        return fd;
+      }
+      if(rc < 0)
+      {
+        // 실패한 시도는 빼고 다음 주소를 바로 시작
+        close(pfds[i].fd);
+        pfds[i] = pfds[nactive - 1];
+        owner[i] = owner[nactive - 1];
+        nactive--;
+        next_attempt_at = now;
+        continue;
+      }
+      i++;
+    }
+  }
+}
+
+/* 논블로킹 connect 시작 : 소켓 생성이나 connect가 바로 실패하면 -1 */
+int connect_start(dns_addr_t *a)
+{
+  int fd = socket(a->family, a->socktype | SOCK_NONBLOCK, a->protocol);
+
+  if(fd < 0)
+  {
+    return -1;
+  }
+  if(connect(fd, (SA *)&a->addr, a->addrlen) < 0 && errno != EINPROGRESS)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* 진행 중인 connect의 결과 : 연결됨 1, 아직 진행 중 0, 실패 -1 */
+int connect_result(int fd)
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+  struct sockaddr_storage peer;
+  socklen_t peer_len = sizeof(peer);
+
+  if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+  {
+    return -1;
+  }
+  return getpeername(fd, (SA *)&peer, &peer_len) == 0;
+}
+
+/* 연결된 주소를 계열별로 세고 걸린 시간을 더해 둠 (연결마다 출력하지 않고 SIGUSR1 통계로만 봄) */
+void connect_count(dns_addr_t *a, long elapsed)
+{
+  __atomic_fetch_add(&connect_stats.total_ms, elapsed, __ATOMIC_RELAXED);
+  if(a->family == AF_INET6)
+  {
+    __atomic_fetch_add(&connect_stats.ipv6, 1, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    __atomic_fetch_add(&connect_stats.ipv4, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* 워커 풀 함수들 */
+
+/* 크기 n인 빈 FIFO 버퍼 생성 */
+void sbuf_init(sbuf_t *sp, int n)
+{
+  sp->buf = Calloc(n, sizeof(int));
+  sp->n = n;
+  sp->front = sp->rear = 0;
+  Sem_init(&sp->mutex, 0, 1);
+  Sem_init(&sp->slots, 0, n);
+  Sem_init(&sp->items, 0, 0);
+}
+
+/* 빈 슬롯이 있으면 삽입하고 1, 가득 찼으면 기다리지 않고 0 반환 */
+int sbuf_try_insert(sbuf_t *sp, int item)
+{
+  while(sem_trywait(&sp->slots) < 0)
+  {
+    if(errno != EINTR)
+    {
+      return 0;
+    }
+  }
+  P(&sp->mutex);
+  sp->buf[(++sp->rear) % (sp->n)] = item;
+  V(&sp->mutex);
+  V(&sp->items);
+  return 1;
+}
+
+/* 아이템이 생길 때까지 기다렸다가 앞에서 꺼냄 */
+int sbuf_remove(sbuf_t *sp)
+{
+  int item;
+
+  P(&sp->items);
+  P(&sp->mutex);
+  item = sp->buf[(++sp->front) % (sp->n)];
+  V(&sp->mutex);
+  V(&sp->slots);
+  return item;
+}
+
+/* 현재 대기 중인 아이템 수 */
+int sbuf_count(sbuf_t *sp)
+{
+  int count;
+
+  P(&sp->mutex);
+  count = sp->rear - sp->front;
+  V(&sp->mutex);
+  return count;
+}
+
+void pool_init(worker_pool_t *pool)
+{
+  pthread_t tid;
+
+  sbuf_init(&pool->queue, config.queue_size);
+  pool->nthreads = 0;
+  pool->busy = 0;
+  pool->idle_ticks = 0;
+  pthread_mutex_init(&pool->lock, NULL);
+
+  pool_spawn(pool, config.workers);
+  Pthread_create(&tid, NULL, pool_adjuster, pool);
+}
+
+/* 워커 count개 추가 */
+void pool_spawn(worker_pool_t *pool, int count)
+{
+  pthread_t tid;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->nthreads += count;
+  pthread_mutex_unlock(&pool->lock);
+
+  for(int i = 0; i < count; i++)
+  {
+    Pthread_create(&tid, NULL, worker, pool);
+  }
+}
+
+/* 워커 스레드 : 큐에서 fd를 꺼내 처리하고, -1(종료 신호)을 받으면 종료 */
+void* worker(void* pool_ptr)
+{
+  worker_pool_t *pool = (worker_pool_t *)pool_ptr;
+
+  Pthread_detach(pthread_self()); // 스레드 분리 -> 자신의 메모리 자원들이 종료 후 반환될 수 있도록
+  while(1)
+  {
+    int connection_fd = sbuf_remove(&pool->queue);
+    if(connection_fd < 0)
+    {
+      break;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->busy += 1;
+    pthread_mutex_unlock(&pool->lock);
+
+    doit(connection_fd);
+    Close(connection_fd);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->busy -= 1;
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->nthreads -= 1;
+  pthread_mutex_unlock(&pool->lock);
+  splice_pipe_close();
+  return NULL;
+}
+
+/* shard 하나의 accept 루프 : 받은 연결을 워커 풀 큐에 넣음 */
+void* acceptor(void* shard_ptr)
+{
+  shard_t *shard = (shard_t *)shard_ptr;
+  char hostname[MAXLINE], port[MAXLINE];
+  socklen_t client_len;
+  struct sockaddr_storage client_addr;
+
+  if(shard->id != 0)
+  {
+    Pthread_detach(pthread_self());
+  }
+  if(nshards > 1)
+  {
+    pin_to_core(shard->id);
+  }
+
+  while(1)
+  {
+    client_len = sizeof(client_addr);
+    int connection_fd = Accept(shard->listen_fd, (SA *)(&client_addr), &client_len);
+    Getnameinfo((SA *)(&client_addr), client_len, hostname, MAXLINE, port, MAXLINE, 0);
+
+    printf("Accepted connection from (%s, %s)\n", hostname, port);
+    __atomic_fetch_add(&shard->accepted, 1, __ATOMIC_RELAXED);
+
+    // 큐가 가득 찼으면 기다리지 않고 바로 503 응답
+    if(!sbuf_try_insert(&pool.queue, connection_fd))
+    {
+      __atomic_fetch_add(&shard->rejected, 1, __ATOMIC_RELAXED);
+      clienterror(connection_fd, "503", "Service Unavailable", "Proxy is too busy, try again later");
+      Close(connection_fd);
+    }
+  }
+  return NULL;
+}
+
+/* 큐 길이를 보고 워커 수 조정 : 밀려 있으면 두 배로 늘리고, 오래 한가하면 절반으로 줄임 (min ~ max 범위 안에서) */
+void* pool_adjuster(void* pool_ptr)
+{
+  worker_pool_t *pool = (worker_pool_t *)pool_ptr;
+
+  Pthread_detach(pthread_self());
+  while(1)
+  {
+    usleep(POOL_ADJUST_INTERVAL_US);
+
+    int queued = sbuf_count(&pool->queue);
+    pthread_mutex_lock(&pool->lock);
+    int nthreads = pool->nthreads;
+    int busy = pool->busy;
+    pthread_mutex_unlock(&pool->lock);
+
+    // 큐에 처리 못 한 연결이 쌓여 있음 -> 늘리기
+    if(queued > 0 && nthreads < config.max_workers)
+    {
+      int grow = nthreads;
+      if(nthreads + grow > config.max_workers)
+      {
+        grow = config.max_workers - nthreads;
+      }
+      pool_spawn(pool, grow);
+      pool->idle_ticks = 0;
+      continue;
+    }
+
+    // 큐가 비어 있고 절반 이상이 놀고 있음 -> 일정 시간 지속되면 줄이기
+    if(queued == 0 && busy < nthreads / 2 && nthreads > config.min_workers)
+    {
+      if(++pool->idle_ticks >= POOL_SHRINK_TICKS)
+      {
+        int shrink = nthreads / 2;
+        if(nthreads - shrink < config.min_workers)
+        {
+          shrink = nthreads - config.min_workers;
+        }
+        // 종료 신호는 일반 연결과 같은 큐를 거치므로, 대기 중인 연결보다 먼저 처리되지 않음
+        for(int i = 0; i < shrink; i++)
+        {
+          if(!sbuf_try_insert(&pool->queue, -1))
+          {
+            break;
+          }
+        }
+        pool->idle_ticks = 0;
+      }
+    }
+    else
+    {
+      pool->idle_ticks = 0;
+    }
+  }
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* epoll 이벤트 루프 함수들 */
+
+/* 리스닝 소켓을 열고 config.loops개의 이벤트 루프 스레드를 돌림
+   --shards를 주면 루프마다 SO_REUSEPORT 리스닝 소켓을 하나씩 갖고 코어에 고정됨 */
+void run_epoll(char *port)
+{
+  if(config.shards > 1)
+  {
+    config.loops = config.shards;
+  }
+  open_shards(port, config.shards);
+
+  event_loop_t *loops = Calloc(config.loops, sizeof(event_loop_t));
+  pthread_t *tids = Calloc(config.loops, sizeof(pthread_t));
+
+  for(int i = 0; i < nshards; i++)
+  {
+    set_nonblocking(shards[i].listen_fd);
+  }
+
+  // 리스닝 소켓을 공유하는 경우에도 카운터는 루프별로 따로 셈
+  for(int i = nshards; i < config.loops; i++)
+  {
+    shards[i].id = i;
+    shards[i].listen_fd = shards[0].listen_fd;
+  }
+  nshards = config.loops;
+
+  for(int i = 0; i < config.loops; i++)
+  {
+    struct epoll_event ev;
+
+    loops[i].shard = &shards[i];
+    loops[i].listen_fd = shards[i].listen_fd;
+    if((loops[i].epoll_fd = epoll_create1(0)) < 0)
+    {
+      unix_error("epoll_create1 error");
+    }
+
+    // 여러 루프가 같은 리스닝 소켓을 기다리면 EPOLLEXCLUSIVE로 한 루프만 깨우기
+    ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL; // data.ptr == NULL : 리스닝 소켓
+    if(epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].listen_fd, &ev) < 0)
+    {
+      unix_error("epoll_ctl error");
+    }
+
+    // 이름 조회 완료 알림 : data.ptr == loop 자신
+    if((loops[i].dns_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+    {
+      unix_error("eventfd error");
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &loops[i];
+    if(epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].dns_fd, &ev) < 0)
+    {
+      unix_error("epoll_ctl error");
+    }
+  }
+
+  // 0번 루프는 메인 스레드가 직접 돌림
+  for(int i = 1; i < config.loops; i++)
+  {
+    Pthread_create(&tids[i], NULL, event_loop, &loops[i]);
+  }
+  event_loop(&loops[0]);
+}
+
+void* event_loop(void* loop_ptr)
+{
+  event_loop_t *loop = (event_loop_t *)loop_ptr;
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+
+  if(config.shards > 1)
+  {
+    pin_to_core(loop->shard->id);
+  }
+
+  while(1)
+  {
+    int n = epoll_wait(loop->epoll_fd, events, EPOLL_MAX_EVENTS, loop_timeout(loop));
+    if(n < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      unix_error("epoll_wait error");
+    }
+
+    for(int i = 0; i < n; i++)
+    {
+      if(events[i].data.ptr == NULL)
+      {
+        conn_accept(loop);
+        continue;
+      }
+      if(events[i].data.ptr == loop)
+      {
+        conn_resolved(loop);
+        continue;
+      }
+
+      // 클라이언트/서버 소켓 어느 쪽 이벤트든 현재 상태에서 할 수 있는 만큼 진행
+      conn_drive(loop, (conn_t *)events[i].data.ptr);
+    }
+
+    // 다음 주소 시도 시각이나 연결 제한 시각이 지난 연결 진행
+    conn_timers(loop);
+
+    // 이번 묶음에서 닫힌 연결 해제
+    while(loop->closed != NULL)
+    {
+      conn_t *conn = loop->closed;
+      loop->closed = conn->next_closed;
+      Free(conn);
+    }
+  }
+  return NULL;
+}
+
+/* 엣지 트리거이므로 EAGAIN이 나올 때까지 accept */
+void conn_accept(event_loop_t *loop)
+{
+  while(1)
+  {
+    int client_fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if(client_fd < 0)
+    {
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        fprintf(stderr, "accept4 error: %s\n", strerror(errno));
+      }
+      return;
+    }
+    __atomic_fetch_add(&loop->shard->accepted, 1, __ATOMIC_RELAXED);
+
+    conn_t *conn = Calloc(1, sizeof(conn_t));
+    conn->state = CONN_READ_REQUEST;
+    conn->client_fd = client_fd;
+    conn->server_fd = -1;
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+    {
+      fprintf(stderr, "epoll_ctl error: %s\n", strerror(errno));
+      close(client_fd);
+      Free(conn);
+      continue;
+    }
+
+    // 요청이 이미 도착해 있을 수 있으므로 바로 한 번 진행
+    conn_drive(loop, conn);
+  }
+}
+
+/* 각 상태 함수는 진행할 수 없으면(EAGAIN) 0, 다음 상태로 넘어갔으면 1을 반환 */
+void conn_drive(event_loop_t *loop, conn_t *conn)
+{
+  int progress = 1;
+
+  // 이미 닫힌 연결에 남은 이벤트
+  if(conn->client_fd < 0)
+  {
+    return;
+  }
+
+  while(progress)
+  {
+    switch(conn->state)
+    {
+      case CONN_READ_REQUEST:
+        progress = conn_read_request(conn);
+        break;
+      case CONN_PARSE:
+        progress = conn_parse(loop, conn);
+        break;
+      case CONN_RESOLVE:
+        progress = conn_resolve(loop, conn);
+        break;
+      case CONN_CONNECT:
+        progress = conn_connect(loop, conn);
+        break;
+      case CONN_SEND_REQUEST:
+        progress = conn_send_request(conn);
+        break;
+      case CONN_RELAY:
+        progress = conn_relay(conn);
+        break;
+      case CONN_CLOSE:
+        conn_close(loop, conn);
+        return;
+    }
+  }
+}
+
+/* 빈 줄(\r\n\r\n)이 나올 때까지 요청을 모음 */
+int conn_read_request(conn_t *conn)
+{
+  while(1)
+  {
+    if(conn->request_len >= sizeof(conn->request) - 1)
+    {
+      // 헤더가 너무 김
+      conn_error(conn, "400", "Bad Request", "Request headers are too long");
+      return 1;
+    }
+
+    ssize_t n = read(conn->client_fd, conn->request + conn->request_len, sizeof(conn->request) - 1 - conn->request_len);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return 0;
+      }
+      conn->state = CONN_CLOSE;
+      return 1;
+    }
+    if(n == 0)
+    {
+      conn->state = CONN_CLOSE;
+      return 1;
+    }
+
+    conn->request_len += n;
+    conn->request[conn->request_len] = '\0';
+    if(strstr(conn->request, "\r\n\r\n") != NULL)
+    {
+      conn->state = CONN_PARSE;
+      return 1;
+    }
+  }
+}
+
+/* 에러 응답을 중계 버퍼에 만들어 보내고 닫음 (thread 모드의 clienterror와 같은 응답) */
+void conn_error(conn_t *conn, char *errnum, char *shortmsg, char *longmsg)
+{
+  conn->out = conn->buf;
+  conn->out_len = error_response(conn->buf, sizeof(conn->buf), errnum, shortmsg, longmsg);
+  conn->out_off = 0;
+  conn->server_eof = 1;
+  conn->unread_input = 1;
+  conn->state = CONN_RELAY;
+}
+
+/* 요청 라인 파싱 -> 캐시 확인 -> 서버에 보낼 헤더 구성 */
+int conn_parse(event_loop_t *loop, conn_t *conn)
+{
+  char method[MAXLINE], version[MAXLINE], hostname[MAXLINE], path[MAXLINE];
+  int port;
+
+  char *headers = strstr(conn->request, "\r\n") + 2;
+  if(sscanf(conn->request, "%s %s %s", method, conn->uri, version) != 3)
+  {
+    conn_error(conn, "400", "Bad Request", "Proxy could not parse the request line");
+    return 1;
+  }
+  printf("Request headers:\n");
+  printf("%.*s", (int)(headers - conn->request), conn->request);
+
+  /* 캐시에서 먼저 찾기 (정규화한 키로) */
+  cache_key(conn->uri, conn->key);
+  cache_entry_t *hit = cache_find(&cache, conn->key);
+  if(hit != NULL && !cache_fresh(hit) && !request_no_cache(headers) && time(NULL) < cache_stale_until(hit, 0))
+  {
+    // stale-while-revalidate 기간 : 만료된 항목을 그대로 보내고 재검증은 백그라운드 스레드에 맡김
+    __atomic_fetch_add(&cache.stale_revalidate, 1, __ATOMIC_RELAXED);
+    refresh_queue(&refresher, hit);
+  }
+  else if(hit != NULL && (!cache_fresh(hit) || request_no_cache(headers)))
+  {
+    // 만료된 항목 : 참조를 잡아 둔 채 조건부 요청으로 재검증 (304면 이 항목으로 응답)
+    conn->hit = hit;
+    conn->revalidating = 1;
+    __atomic_fetch_add(&cache.revalidations, 1, __ATOMIC_RELAXED);
+    hit = NULL;
+  }
+  if(hit != NULL)
+  {
+    // 캐시 히트 : 참조를 잡은 채 캐시 항목에서 바로 쓰고, 응답을 다 쓰면 종료
+    conn->hit = hit;
+    conn_serve_hit(conn, hit->data, hit->size, __atomic_load_n(&hit->expires, __ATOMIC_RELAXED), NULL, headers);
+    return 1;
+  }
+
+  // 큰 객체 저장소 히트 : 참조를 잡은 채 페이지를 차례로 씀 (만료됐으면 미스로 처리)
+  large_object_t *obj = conn->hit != NULL ? NULL : large_find(&large, conn->key);
+  if(obj != NULL && (obj->expires <= time(NULL) || request_no_cache(headers)))
+  {
+    large_release(obj);
+    obj = NULL;
+  }
+  if(obj != NULL)
+  {
+    conn->large = obj;
+    conn_serve_hit(conn, NULL, 0, 0, obj, headers);
+    return 1;
+  }
+
+  // 디스크 2차 캐시 히트 : 세그먼트 참조를 잡은 채 mmap에서 바로 씀 (논블로킹 소켓이라 sendfile 대신 중계와 같은 경로)
+  char *disk_data;
+  int disk_size;
+  off_t disk_off;
+  long expires;
+  disk_segment_t *seg = conn->hit != NULL ? NULL : disk_find(&disk, conn->key, &disk_data, &disk_size, &disk_off, &expires);
+  if(seg != NULL && (expires <= time(NULL) || request_no_cache(headers)))
+  {
+    disk_release(seg);
+    seg = NULL;
+  }
+  if(seg != NULL)
+  {
+    cache_insert(&cache, conn->key, disk_data, disk_size, expires);
+    conn->disk_seg = seg;
+    conn_serve_hit(conn, disk_data, disk_size, expires, NULL, headers);
+    return 1;
+  }
+
+  /* 캐시 미스 -> 서버에 보낼 헤더 구성
+     Range 요청이면 범위를 서버에서 바로 받아 그대로 중계하고 (206은 저장하지 않음), 전체 객체는 백그라운드에서 채움 */
+  int ranged = !conn->revalidating && request_range(headers);
+  if(ranged)
+  {
+    __atomic_fetch_add(&cache.range_misses, 1, __ATOMIC_RELAXED);
+    refresh_fill(&refresher, conn->key);
+  }
+  parse_uri(conn->uri, hostname, path, &port);
+  makeHttpHeaderFromBuf(conn->http_header, hostname, path, port, headers, 0, ranged);
+  if(conn->revalidating)
+  {
+    http_conditional(conn->http_header, conn->hit);
+  }
+  conn->header_len = strlen(conn->http_header);
+  conn->header_off = 0;
+  if(strlen(hostname) >= sizeof(conn->hostname))
+  {
+    conn->state = CONN_CLOSE;
+    return 1;
+  }
+  strcpy(conn->hostname, hostname);
+  sprintf(conn->port, "%d", port);
+
+  conn->cache_buf = ranged ? NULL : Malloc(MAX_OBJECT_SIZE);
+  conn->cache_size = 0;
+  conn->state = CONN_RESOLVE;
+  return 1;
+}
+
+/* 서버 주소 조회 : DNS 캐시에 없으면 resolver 스레드가 조회하는 동안 loop->resolving에서 기다림 */
+int conn_resolve(event_loop_t *loop, conn_t *conn)
+{
+  int err;
+  int rc = dns_lookup(&dns, conn->hostname, conn->port, &conn->addrs, &err, loop->dns_fd);
+
+  if(rc == DNS_PENDING)
+  {
+    if(!conn->resolving)
+    {
+      conn->resolving = 1;
+      conn->next_resolving = loop->resolving;
+      loop->resolving = conn;
+    }
+    return 0;
+  }
+  if(rc == DNS_FAILED)
+  {
+    fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", conn->hostname, conn->port, gai_strerror(err));
+    if(!conn_serve_stale(conn))
+    {
+      conn->state = CONN_CLOSE;
+    }
+    return 1;
+  }
+
+  conn->addr_next = 0;
+  conn->state = CONN_CONNECT;
+  return 1;
+}
+
+/* eventfd 알림 : 조회를 기다리던 연결을 모두 다시 진행 (아직 끝나지 않은 조회를 기다리는 연결은 목록에 다시 들어감) */
+void conn_resolved(event_loop_t *loop)
+{
+  uint64_t count;
+
+  while(read(loop->dns_fd, &count, sizeof(count)) > 0)
+  {
+  }
+
+  conn_t *list = loop->resolving;
+  loop->resolving = NULL;
+  while(list != NULL)
+  {
+    conn_t *conn = list;
+    list = conn->next_resolving;
+    conn->resolving = 0;
+    conn_drive(loop, conn);
+  }
+}
+
+/* 논블로킹 connect (Happy Eyeballs) : 주소마다 connect_delay 간격으로 시도를 더하고, 먼저 연결된 소켓을 사용
+   시도 중인 소켓은 모두 이 conn으로 epoll에 등록되어 있고, 시간이 지나서 진행해야 하는 경우는 conn_timers가 깨움 */
+int conn_connect(event_loop_t *loop, conn_t *conn)
+{
+  long now = now_ms();
+  int active = 0;
+
+  if(conn->connect_deadline == 0)
+  {
+    addrs_interleave(&conn->addrs);
+    conn->connect_deadline = now + config.connect_timeout;
+    conn->next_attempt_at = now;
+  }
+
+  // 진행 중인 시도 확인 : 먼저 연결된 소켓이 이김
+  for(int i = 0; i < conn->addr_next; i++)
+  {
+    int fd = conn->attempt_fds[i];
+    if(fd < 0)
+    {
+      continue;
+    }
+
+    int rc = connect_result(fd);
+    if(rc > 0)
+    {
+      conn->attempt_fds[i] = -1;
+      conn->server_fd = fd;
+      conn_connect_done(loop, conn);
+      connect_count(&conn->addrs.addr[i], now - (conn->connect_deadline - config.connect_timeout));
+      conn->state = CONN_SEND_REQUEST;
+      return 1;
+    }
+    if(rc < 0)
+    {
+      // 이 주소는 실패 -> 다음 주소를 바로 시작
+      close(fd);
+      conn->attempt_fds[i] = -1;
+      conn->next_attempt_at = now;
+      continue;
+    }
+    active++;
+  }
+
+  if(now >= conn->connect_deadline)
+  {
+    fprintf(stderr, "connect to %s:%s timed out after %d ms\n", conn->hostname, conn->port, config.connect_timeout);
+    __atomic_fetch_add(&connect_stats.timeouts, 1, __ATOMIC_RELAXED);
+    conn_connect_done(loop, conn);
+    if(!conn_serve_stale(conn))
+    {
+      conn->state = CONN_CLOSE;
+    }
+    return 1;
+  }
+
+  // 시작할 차례가 된 주소 시도 (앞 시도가 바로 실패하면 기다리지 않고 다음 주소로)
+  while(conn->addr_next < conn->addrs.n && (active == 0 || now >= conn->next_attempt_at))
+  {
+    int i = conn->addr_next++;
+    int fd = connect_start(&conn->addrs.addr[i]);
+    conn->attempt_fds[i] = -1;
+    if(fd < 0)
+    {
+      continue;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+      close(fd);
+      continue;
+    }
+    conn->attempt_fds[i] = fd;
+    conn->next_attempt_at = now + config.connect_delay;
+    active++;
+    break;
+  }
+
+  if(active == 0)
+  {
+    fprintf(stderr, "Error: Unable to connect to server\n");
+    __atomic_fetch_add(&connect_stats.failures, 1, __ATOMIC_RELAXED);
+    conn_connect_done(loop, conn);
+    if(!conn_serve_stale(conn))
+    {
+      conn->state = CONN_CLOSE;
+    }
+    return 1;
+  }
+
+  // 소켓 이벤트나 타이머를 기다림
+  if(!conn->connecting)
+  {
+    conn->connecting = 1;
+    conn->next_connecting = loop->connecting;
+    loop->connecting = conn;
+  }
+  return 0;
+}
+
+/* 연결 단계가 끝남 : 남은 시도를 닫고 loop->connecting 목록에서 뺌 */
+void conn_connect_done(event_loop_t *loop, conn_t *conn)
+{
+  for(int i = 0; i < conn->addr_next; i++)
+  {
+    if(conn->attempt_fds[i] >= 0)
+    {
+      close(conn->attempt_fds[i]);
+      conn->attempt_fds[i] = -1;
+    }
+  }
+
+  if(conn->connecting)
+  {
+    conn_t **pp = &loop->connecting;
+    while(*pp != conn)
+    {
+      pp = &(*pp)->next_connecting;
+    }
+    *pp = conn->next_connecting;
+    conn->connecting = 0;
+  }
+}
+
+/* epoll_wait 제한 시간 : 연결 중인 conn의 다음 시도 시각과 제한 시각 중 가장 가까운 것 (없으면 무한정) */
+int loop_timeout(event_loop_t *loop)
+{
+  long now = now_ms(), nearest = -1;
+
+  for(conn_t *conn = loop->connecting; conn != NULL; conn = conn->next_connecting)
+  {
+    long at = conn->connect_deadline;
+    if(conn->addr_next < conn->addrs.n && conn->next_attempt_at < at)
+    {
+      at = conn->next_attempt_at;
+    }
+    if(nearest < 0 || at < nearest)
+    {
+      nearest = at;
+    }
+  }
+
+  if(nearest < 0)
+  {
+    return -1;
+  }
+  return (nearest > now) ? (int)(nearest - now) : 0;
+}
+
+/* 시각이 된 연결 진행 : 진행하다 목록에서 빠질 수 있으므로 목록을 떼어 내고 돌면서 아직 연결 중인 것은 conn_connect가 다시 넣음 */
+void conn_timers(event_loop_t *loop)
+{
+  long now = now_ms();
+  conn_t *list = loop->connecting;
+
+  loop->connecting = NULL;
+  while(list != NULL)
+  {
+    conn_t *conn = list;
+    list = conn->next_connecting;
+    conn->connecting = 0;
+
+    if(now >= conn->connect_deadline || (conn->addr_next < conn->addrs.n && now >= conn->next_attempt_at))
+    {
+      conn_drive(loop, conn);
+    }
+    else
+    {
+      conn->connecting = 1;
+      conn->next_connecting = loop->connecting;
+      loop->connecting = conn;
+    }
+  }
+}
+
+/* 재구성한 헤더를 서버로 전송 */
+int conn_send_request(conn_t *conn)
+{
+  while(conn->header_off < conn->header_len)
+  {
+    ssize_t n = write(conn->server_fd, conn->http_header + conn->header_off, conn->header_len - conn->header_off);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return 0;
+      }
+      if(!conn_serve_stale(conn))
+      {
+        conn->state = CONN_CLOSE;
+      }
+      return 1;
+    }
+    conn->header_off += n;
+  }
+
+  conn->out = conn->buf;
+  conn->out_len = 0;
+  conn->out_off = 0;
+  conn->state = CONN_RELAY;
+  return 1;
+}
+
+/* 서버 응답을 클라이언트로 중계하면서 캐시용으로 모아 둠 */
+int conn_relay(conn_t *conn)
+{
+  while(1)
+  {
+    // 버퍼에 남은 데이터부터 클라이언트에 쓰기
+    while(conn->out_off < conn->out_len)
+    {
+      ssize_t n = write(conn->client_fd, conn->out + conn->out_off, conn->out_len - conn->out_off);
+      if(n < 0)
+      {
+        if(errno == EINTR)
+        {
+          continue;
+        }
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          return 0;
+        }
+        conn->state = CONN_CLOSE;
+        return 1;
+      }
+      conn->out_off += n;
+    }
+
+    // 큰 객체 저장소 히트 : 다음 페이지
+    if(conn->large_page != NULL && conn->large_page->next != NULL)
+    {
+      conn->large_page = conn->large_page->next;
+      conn->out = conn->large_page->data;
+      conn->out_len = conn->large_page->len;
+      conn->out_off = 0;
+      continue;
+    }
+
+    if(conn->server_eof)
+    {
+      /* 끝까지 받았고 저장해도 되는 응답이면 캐시 저장 */
+      if(conn->cache_buf != NULL)
+      {
+        long expires = -1;
+        if(conn_cache_complete(conn, conn->cache_size, conn->cache_buf, conn->cache_size))
+        {
+          expires = cache_expires(conn->cache_buf, conn->cache_size);
+        }
+        if(expires >= 0)
+        {
+          cache_insert(&cache, conn->key, conn->cache_buf, conn->cache_size, expires);
+        }
+        else
+        {
+          __atomic_fetch_add(&cache.uncacheable, 1, __ATOMIC_RELAXED);
+        }
+      }
+      else if(conn->fill != NULL)
+      {
+        if(conn_cache_complete(conn, conn->fill->size, conn->fill->tail->data, conn->fill->tail->len))
+        {
+          large_commit(&large, conn->fill, conn->key);
+        }
+        else
+        {
+          __atomic_fetch_add(&large.dropped, 1, __ATOMIC_RELAXED);
+          large_release(conn->fill);
+        }
+        conn->fill = NULL;
+      }
+      conn->state = CONN_CLOSE;
+      return 1;
+    }
+
+    // 캐시를 포기한 큰 응답은 나머지를 splice로 중계
+    if(conn->cache_buf == NULL && conn->fill == NULL)
+    {
+      return conn_relay_splice(conn);
+    }
+
+    ssize_t n = read(conn->server_fd, conn->buf, sizeof(conn->buf));
+    if(n < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return 0;
+      }
+      if(conn_serve_stale(conn))
+      {
+        continue;
+      }
+      // 응답이 중간에 끊기면 캐시하지 않음
+      Free(conn->cache_buf);
+      conn->cache_buf = NULL;
+      conn->state = CONN_CLOSE;
+      return 1;
+    }
+    if(n == 0)
+    {
+      if(conn->revalidating)
+      {
+        // 응답 헤더도 다 오기 전에 끊김
+        if(!conn_serve_stale(conn))
+        {
+          conn->state = CONN_CLOSE;
+          return 1;
+        }
+        continue;
+      }
+      conn->server_eof = 1;
+      continue;
+    }
+
+    // 캐시 버퍼에 응답 저장 : 객체가 너무 크면 큰 객체 저장소 페이지로 옮겨 계속 모으고, 그것도 안 되면 캐시 포기
+    if(conn->cache_buf != NULL)
+    {
+      if(conn->cache_size + n <= MAX_OBJECT_SIZE)
+      {
+        memcpy(conn->cache_buf + conn->cache_size, conn->buf, n);
+        conn->cache_size += n;
+        if(conn->cache_head == 0)
+        {
+          conn_cache_head(conn);
+        }
+      }
+      else
+      {
+        if(!conn->revalidating && conn->cache_head > 0 && (conn->fill = large_start(&large)) != NULL &&
+           large_append(&large, conn->fill, conn->cache_buf, conn->cache_size) < 0)
+        {
+          large_release(conn->fill);
+          conn->fill = NULL;
+        }
+        Free(conn->cache_buf);
+        conn->cache_buf = NULL;
+      }
+    }
+    if(conn->fill != NULL && large_append(&large, conn->fill, conn->buf, n) < 0)
+    {
+      __atomic_fetch_add(&large.dropped, 1, __ATOMIC_RELAXED);
+      large_release(conn->fill);
+      conn->fill = NULL;
+    }
+
+    if(conn->revalidating)
+    {
+      // 재검증 중 : 응답 헤더를 다 받을 때까지 클라이언트에 쓰지 않고 모으기만 함
+      char *end;
+      int status = 0;
+      if(conn->cache_buf == NULL)
+      {
+        conn->state = CONN_CLOSE;
+        return 1;
+      }
+      if((end = memmem(conn->cache_buf, conn->cache_size, "\r\n\r\n", 4)) == NULL)
+      {
+        continue;
+      }
+      sscanf(conn->cache_buf, "%*s %d", &status);
+      if(status >= 500 && conn_serve_stale(conn))
+      {
+        continue;
+      }
+      conn->revalidating = 0;
+      if(status == 304)
+      {
+        // 304 : 만료 시각만 갱신하고 서버 연결을 닫은 뒤 캐시 항목으로 응답
+        __atomic_fetch_add(&cache.not_modified, 1, __ATOMIC_RELAXED);
+        cache_refresh(conn->hit, conn->cache_buf, end + 2 - conn->cache_buf);
+        close(conn->server_fd);
+        conn->server_fd = -1;
+        Free(conn->cache_buf);
+        conn->cache_buf = NULL;
+        conn_serve_hit(conn, conn->hit->data, conn->hit->size, __atomic_load_n(&conn->hit->expires, __ATOMIC_RELAXED), NULL, strstr(conn->request, "\r\n") + 2);
+        continue;
+      }
+      // 내용이 바뀜 : 예전 항목을 놓고 지금까지 모은 응답부터 그대로 중계
+      cache_release(&cache, conn->hit);
+      conn->hit = NULL;
+      conn->out = conn->cache_buf;
+      conn->out_len = conn->cache_size;
+      conn->out_off = 0;
+      continue;
+    }
+
+    conn->out = conn->buf;
+    conn->out_len = n;
+    conn->out_off = 0;
+  }
+}
+
+/* 모으는 응답의 헤더를 다 받았으면 hop-by-hop 헤더(Connection, Keep-Alive, Proxy-Connection)를 빼고 뒤를 당겨 둠
+   thread 모드의 relay_head가 모으는 것과 같은 blob이 되어야 send_cached가 붙이는 Connection 헤더와 겹치지 않음
+   클라이언트에는 conn->buf의 원래 응답을 그대로 씀 */
+void conn_cache_head(conn_t *conn)
+{
+  char line[MAXLINE], *p, *w, *end;
+  char *head_end = memmem(conn->cache_buf, conn->cache_size, "\r\n\r\n", 4);
+
+  if(head_end == NULL)
+  {
+    return;
+  }
+  conn->cache_info = (response_info_t){ 0, -1, 0, 0 };
+  sscanf(conn->cache_buf, "%*s %d", &conn->cache_info.status);
+  p = w = strstr(conn->cache_buf, "\r\n") + 2;
+  while(p < head_end + 2)
+  {
+    end = memmem(p, head_end + 2 - p, "\r\n", 2);
+    snprintf(line, sizeof(line), "%.*s", (int)(end - p + 2), p);
+    if(!response_header(line, &conn->cache_info))
+    {
+      memmove(w, p, end + 2 - p);
+      w += end + 2 - p;
+    }
+    p = end + 2;
+  }
+  // p는 마지막 빈 줄 : 빈 줄과 지금까지 받은 본문을 당김
+  memmove(w, p, conn->cache_buf + conn->cache_size - p);
+  conn->cache_size -= p - w;
+  conn->cache_head = w + 2 - conn->cache_buf;
+}
+
+/* 모은 응답(size바이트, 끝의 tail_len바이트가 tail)이 끝까지 왔는지 : 서버가 중간에 끊은 응답은 저장하지 않음
+   Content-Length가 있으면 그만큼, chunked면 마지막 청크까지, 둘 다 없으면 서버가 연결을 닫은 것이 끝 */
+int conn_cache_complete(conn_t *conn, size_t size, char *tail, size_t tail_len)
+{
+  response_info_t *info = &conn->cache_info;
+
+  if(conn->cache_head == 0)
+  {
+    return 0;
+  }
+  if(RESPONSE_NO_BODY(info))
+  {
+    return 1;
+  }
+  if(info->content_length >= 0)
+  {
+    return size == (size_t)conn->cache_head + info->content_length;
+  }
+  if(info->chunked)
+  {
+    return tail_len >= 5 && !memcmp(tail + tail_len - 5, "0\r\n\r\n", 5);
+  }
+  return 1;
+}
+
+/* 재검증이 서버 오류(이름 조회/연결 실패, 응답 없음, 5xx)로 실패 : stale-if-error 기간 안이면 서버 연결을 닫고 만료된 항목으로 응답
+   반환값 : 만료된 항목으로 바꿨으면 1, 재검증 중이 아니거나 기간이 지났으면 0 */
+int conn_serve_stale(conn_t *conn)
+{
+  if(!conn->revalidating || time(NULL) >= cache_stale_until(conn->hit, 1))
+  {
+    return 0;
+  }
+  __atomic_fetch_add(&cache.stale_error, 1, __ATOMIC_RELAXED);
+  conn->revalidating = 0;
+  if(conn->server_fd >= 0)
+  {
+    close(conn->server_fd);
+    conn->server_fd = -1;
+  }
+  if(conn->cache_buf != NULL)
+  {
+    Free(conn->cache_buf);
+    conn->cache_buf = NULL;
+  }
+  conn_serve_hit(conn, conn->hit->data, conn->hit->size, __atomic_load_n(&conn->hit->expires, __ATOMIC_RELAXED), NULL, strstr(conn->request, "\r\n") + 2);
+  return 1;
+}
+
+/* 캐시 히트로 응답할 준비 : gzip을 받는 클라이언트면 gzip 변형을, Range를 잘라 보낼 수 있으면 206 / 416 응답을 range_buf에 만들어 두고,
+   gzip 변형이 있을 수 있는 응답이면 Vary를 끼운 사본을, 아니면 blob을 그대로 (큰 객체면 첫 페이지부터) 씀 (항목 참조는 호출한 쪽이 conn에 잡아 둠) */
+void conn_serve_hit(conn_t *conn, char *data, int size, long expires, large_object_t *o, char *headers)
+{
+  blob_t b;
+  range_plan_t plan;
+  char *vary;
+  int header_len;
+
+  blob_init(&b, data, size, o);
+  if(o == NULL && gzip_variant(&conn->gzip, conn->key, data, size, expires, headers))
+  {
+    conn->out = conn->gzip.data;
+    conn->out_len = conn->gzip.size;
+  }
+  else if(range_plan(&plan, &b, headers, 0))
+  {
+    conn->range_buf = range_flatten(&plan, &b);
+    conn->out = conn->range_buf;
+    conn->out_len = plan.total;
+    Free(plan.text);
+  }
+  else if(o == NULL && *(vary = gzip_identity_vary(data, size)))
+  {
+    // 헤더 끝에 Vary를 끼운 사본을 range_buf에 만들어 보냄
+    header_len = (char *)memmem(data, size, "\r\n\r\n", 4) + 2 - data;
+    conn->range_buf = Malloc(size + strlen(vary));
+    memcpy(conn->range_buf, data, header_len);
+    memcpy(conn->range_buf + header_len, vary, strlen(vary));
+    memcpy(conn->range_buf + header_len + strlen(vary), data + header_len, size - header_len);
+    conn->out = conn->range_buf;
+    conn->out_len = size + strlen(vary);
+  }
+  else
+  {
+    conn->large_page = b.pages;
+    conn->out = b.data;
+    conn->out_len = b.len;
+  }
+  conn->out_off = 0;
+  conn->server_eof = 1;
+  conn->state = CONN_RELAY;
+}
+
+/* 서버 -> pipe -> 클라이언트 : 논블로킹 splice로 옮기고, 어느 쪽이든 EAGAIN이면 다음 이벤트를 기다림 */
+int conn_relay_splice(conn_t *conn)
+{
+  if(conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_NONBLOCK) < 0)
+  {
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    conn->state = CONN_CLOSE;
+    return 1;
+  }
+
+  while(1)
+  {
+    // pipe에 남은 데이터부터 클라이언트로
+    while(conn->pipe_bytes > 0)
+    {
+      ssize_t n = splice(conn->pipe_fds[0], NULL, conn->client_fd, NULL, conn->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if(n < 0)
+      {
+        if(errno == EINTR)
+        {
+          continue;
+        }
+        if(errno == EAGAIN)
+        {
+          return 0;
+        }
+        conn->state = CONN_CLOSE;
+        return 1;
+      }
+      conn->pipe_bytes -= n;
+    }
+
+    ssize_t n = splice(conn->server_fd, NULL, conn->pipe_fds[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      if(errno == EAGAIN)
+      {
+        return 0;
+      }
+      conn->state = CONN_CLOSE;
+      return 1;
+    }
+    if(n == 0)
+    {
+      conn->server_eof = 1;
+      conn->state = CONN_CLOSE;
+      return 1;
+    }
+    conn->pipe_bytes += n;
+  }
+}
+
+/* 소켓을 닫으면 epoll 관심 목록에서도 자동으로 빠짐 : conn 자체는 epoll_wait 묶음 처리가 끝난 뒤 해제 */
+void conn_close(event_loop_t *loop, conn_t *conn)
+{
+  if(conn->server_fd >= 0)
+  {
+    close(conn->server_fd);
+    conn->server_fd = -1;
+  }
+  if(conn->unread_input)
+  {
+    // 읽지 않은 입력이 남은 채 닫으면 RST가 나가서 클라이언트가 에러 응답을 읽기 전에 버려질 수 있음
+    shutdown(conn->client_fd, SHUT_WR);
+    for(int i = 0; i < 16 && read(conn->client_fd, conn->buf, sizeof(conn->buf)) > 0; i++)
+    {
+    }
+  }
+  close(conn->client_fd);
+  conn->client_fd = -1;
+  if(conn->pipe_fds[0] >= 0)
+  {
+    close(conn->pipe_fds[0]);
+    close(conn->pipe_fds[1]);
+  }
+
+  // 연결 중이었으면 남은 시도를 닫고 목록에서 뺌
+  conn_connect_done(loop, conn);
+
+  // 조회를 기다리던 중이면 목록에서 뺌 (해제된 뒤 알림이 오지 않도록)
+  if(conn->resolving)
+  {
+    conn_t **pp = &loop->resolving;
+    while(*pp != conn)
+    {
+      pp = &(*pp)->next_resolving;
+    }
+    *pp = conn->next_resolving;
+    conn->resolving = 0;
+  }
+  if(conn->hit != NULL)
+  {
+    cache_release(&cache, conn->hit);
+    conn->hit = NULL;
+  }
+  if(conn->disk_seg != NULL)
+  {
+    disk_release(conn->disk_seg);
+    conn->disk_seg = NULL;
+  }
+  if(conn->large != NULL)
+  {
+    large_release(conn->large);
+    conn->large = NULL;
+  }
+  if(conn->fill != NULL)
+  {
+    large_release(conn->fill); // 응답이 중간에 끊김 : 저장하지 않음
+    conn->fill = NULL;
+  }
+  if(conn->cache_buf != NULL)
+  {
+    Free(conn->cache_buf);
+  }
+  if(conn->range_buf != NULL)
+  {
+    Free(conn->range_buf);
+  }
+  gzip_variant_release(&conn->gzip);
+  conn->next_closed = loop->closed;
+  loop->closed = conn;
+}
+
+int set_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  if(flags < 0)
+  {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* 캐싱 프록시 함수들 */
+void cache_init(cache_t *cache)
+{
+  int n = config.cache_shards;
+
+  cache->budget = config.cache_size;
+  cache->policy = &cache_policies[config.cache_policy];
+  cache->lockfree = config.cache_index == CACHE_INDEX_LOCKFREE && !cache->policy->write_on_hit; // --bench=index도 실제로 쓰는 인덱스로 표시
+  cache->admission = config.cache_admission;
+  cache->l2 = NULL;
+  // 가장 큰 항목 : 헤더 + 최대 길이 uri + 최대 크기 객체
+  slab_init(&cache->slab, sizeof(cache_entry_t) + MAXLINE + MAX_OBJECT_SIZE, cache->budget / 8);
+  // 샤드마다 예산을 나눠 가지므로 샤드 하나에 가장 큰 항목이 들어갈 수 있을 만큼만 나눔
+  while(n > 1 && cache->budget / n < cache->slab.chunk_size[cache->slab.nclasses - 1])
+  {
+    n--;
+  }
+  cache->nshards = n;
+
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  // 읽기가 계속 들어와도 삽입(쓰기)이 굶지 않도록 쓰기 쪽을 우선
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  for(int i = 0; i < n; i++)
+  {
+    cache_shard_t *shard = &cache->shards[i];
+    shard->nbuckets = CACHE_INIT_BUCKETS;
+    shard->buckets = Calloc(shard->nbuckets, sizeof(cache_entry_t *));
+    shard->count = 0;
+    shard->used = 0;
+    shard->budget = cache->budget / n;
+    for(int l = 0; l < 2; l++)
+    {
+      shard->lists[l].lru_prev = &shard->lists[l];
+      shard->lists[l].lru_next = &shard->lists[l];
+      shard->list_bytes[l] = 0;
+    }
+    memset(shard->ghosts, 0, sizeof(shard->ghosts));
+    shard->ghost_hit = 0;
+    shard->arc_target = 0;
+    shard->heap = NULL;
+    shard->heap_len = 0;
+    shard->heap_cap = 0;
+    shard->inflation = 0;
+    shard->hits = 0;
+    shard->misses = 0;
+    shard->hit_bytes = 0;
+    shard->miss_bytes = 0;
+    shard->admitted = 0;
+    shard->rejected = 0;
+    if(cache->admission)
+    {
+      sketch_init(&shard->sketch, shard->budget / SKETCH_AVG_OBJECT);
+    }
+    shard->evictions = 0;
+    shard->inserts = 0;
+    shard->insert_lock_ns = 0;
+    shard->insert_lock_max_ns = 0;
+    memset(shard->limbo, 0, sizeof(shard->limbo));
+    memset(shard->limbo_buckets, 0, sizeof(shard->limbo_buckets));
+    memset(shard->limbo_epoch, 0, sizeof(shard->limbo_epoch));
+    pthread_rwlock_init(&shard->lock, &attr);
+    if(cache->policy->init != NULL)
+    {
+      cache->policy->init(shard);
+    }
+  }
+  pthread_rwlockattr_destroy(&attr);
+}
+
+/* uri의 캐시 항목에 참조를 하나 잡아서 돌려줌 (없으면 NULL) : 다 쓰면 cache_release */
+cache_entry_t *cache_find(cache_t *cache, char *uri)
+{
+  return cache_get(cache, uri, 1);
+}
+
+/* cache_find와 같지만 count가 0이면 히트/미스 통계와 TinyLFU 빈도에 세지 않음
+   (gzip 변형처럼 이미 센 원본 요청에 딸린 조회용) */
+cache_entry_t *cache_get(cache_t *cache, char *uri, int count)
+{
+  int len;
+  unsigned long long hash = cache_hash(uri, &len); // 해시는 락 밖에서 계산
+  cache_shard_t *shard = cache_shard(cache, hash);
+  cache_policy_t *policy = cache->policy;
+  reclaim_thread_t *self = NULL;
+
+  if(cache->admission && count)
+  {
+    // 히트든 미스든 요청 빈도를 셈 (sketch는 락 없이 atomic으로)
+    sketch_add(&shard->sketch, hash);
+  }
+
+  if(policy->write_on_hit)
+  {
+    // 히트마다 정책 리스트를 고치는 정책(LRU, 2Q, ARC)은 쓰기 락
+    pthread_rwlock_wrlock(&shard->lock);
+  }
+  else if(cache->lockfree)
+  {
+    // 락 없이 찾음 : epoch 안에 있는 동안은 그 사이에 떼어낸 항목도 캐시의 참조가 남아 있음
+    self = reclaim_enter(&reclaim);
+  }
+  else
+  {
+    // 찾기만 하므로 읽기 락 : 같은 샤드의 다른 히트와 동시에 진행
+    pthread_rwlock_rdlock(&shard->lock);
+  }
+
+  cache_entry_t *e = cache_lookup(shard, uri, hash, len);
+  if(e != NULL)
+  {
+    // 복사 없이 참조만 잡음 : 그 사이에 축출되어도 참조를 놓을 때까지 청크는 그대로
+    __atomic_fetch_add(&e->refs, 1, __ATOMIC_RELAXED);
+    policy->hit(shard, e);
+  }
+
+  if(cache->lockfree && !policy->write_on_hit)
+  {
+    reclaim_exit(self);
+  }
+  else
+  {
+    pthread_rwlock_unlock(&shard->lock);
+  }
+
+  if(!count)
+  {
+    return e;
+  }
+  if(e == NULL)
+  {
+    __atomic_fetch_add(&shard->misses, 1, __ATOMIC_RELAXED);
+    return NULL; // 캐시 미스
+  }
+  __atomic_fetch_add(&shard->hits, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&shard->hit_bytes, e->size, __ATOMIC_RELAXED);
+  return e;
+}
+
+/* 참조 반납 : 마지막 참조였으면(이미 캐시에서 빠진 항목) 청크 반납 */
+void cache_release(cache_t *cache, cache_entry_t *e)
+{
+  if(__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    if(e->snapshot != NULL)
+    {
+      snapshot_release(e->snapshot);
+    }
+    slab_free(&cache->slab, e, e->cls);
+  }
+}
+
+void cache_insert(cache_t *cache, char *uri, char *data, int size, long expires)
+{
+  // 데이터(객체) 사이즈가 너무 크면 삽입 안 하고 종료
+  if(size > MAX_OBJECT_SIZE)
+  {
+    return;
+  }
+
+  // 항목 전체(헤더 + uri + 본문)를 청크 하나에 만들어 두고 락 안에서는 연결만 함
+  int len;
+  unsigned long long hash = cache_hash(uri, &len);
+  cache_shard_t *shard = cache_shard(cache, hash);
+  // gzip 변형은 조회를 sketch에 세지 않으므로 빈도로 거르지 않음 (원본이 이미 받아들여진 뒤에만 만들어짐)
+  int variant = gzip_variant_key(uri, len);
+  if(cache->admission && !variant && !cache_admit(cache, shard, uri, hash, len, cache->slab.chunk_size[slab_class(&cache->slab, sizeof(cache_entry_t) + len + 1 + size)]))
+  {
+    // 들어가면 더 자주 쓰이는 항목을 밀어낼 삽입 : 청크를 잡거나 본문을 복사하기 전에 포기
+    // 메모리에 못 들어간 객체도 디스크 2차 캐시에는 넣어 둠 (디스크는 공간이 넉넉하므로 빈도로 거르지 않음)
+    __atomic_fetch_add(&shard->rejected, 1, __ATOMIC_RELAXED);
+    if(cache->l2 != NULL)
+    {
+      disk_put(cache->l2, uri, hash, len, data, size, expires);
+    }
+    return;
+  }
+  int cls;
+  cache_entry_t *e = slab_alloc(&cache->slab, sizeof(cache_entry_t) + len + 1 + size, &cls);
+  e->hash = hash;
+  e->uri_len = len;
+  e->uri = (char *)(e + 1);
+  memcpy(e->uri, uri, len + 1);
+  e->data = e->uri + len + 1;
+  memcpy(e->data, data, size);
+  e->size = size;
+  e->cls = cls;
+  e->refs = 1; // 캐시가 잡고 있는 참조
+  e->charge = cache->slab.chunk_size[cls];
+  e->freq = 0;
+  e->list = 0;
+  e->expires = expires;
+  e->refreshing = 0;
+  e->snapshot = NULL;
+  if(!variant)
+  {
+    __atomic_fetch_add(&shard->miss_bytes, size, __ATOMIC_RELAXED); // 변형은 서버에서 받은 바이트가 아님
+  }
+  cache_link(cache, shard, e);
+}
+
+/* 다 만든 항목을 샤드에 연결 : 같은 uri의 예전 항목을 빼고, 예산을 넘는 만큼 축출한 뒤 체인과 정책 구조에 넣음
+   축출한 항목의 참조 반납과 디스크 2차 캐시로 내려 보내는 것은 락을 놓은 뒤에 */
+void cache_link(cache_t *cache, cache_shard_t *shard, cache_entry_t *e)
+{
+  char *uri = e->uri;
+  unsigned long long hash = e->hash;
+  int len = e->uri_len;
+  size_t charge = e->charge;
+  if(charge > shard->budget)
+  {
+    cache_release(cache, e);
+    return;
+  }
+
+  pthread_rwlock_wrlock(&shard->lock);
+  long start = now_ns();
+
+  // 락 안에서는 리스트에서 떼어내기만 하고, 캐시의 참조 반납은 락을 놓은 뒤에 (retired_next로 연결)
+  cache_entry_t *victims = NULL;
+  cache_entry_t *demote = NULL;
+  cache_entry_t **old_buckets = NULL; // 락 없는 인덱스에서 테이블을 늘리면 바로 해제하지 못하는 예전 배열
+
+  // 같은 uri가 이미 있으면(동시에 가져온 경우) 새 항목으로 교체
+  cache_entry_t **slot = cache_slot(shard, uri, hash, len);
+  cache_entry_t *old = *slot;
+  if(old != NULL)
+  {
+    __atomic_store_n(slot, old->next, __ATOMIC_RELEASE);
+    cache->policy->remove(shard, old);
+    shard->count -= 1;
+    shard->used -= old->charge;
+    old->retired_next = victims;
+    victims = old;
+  }
+
+  // 바이트 예산을 넘으면 evict(축출) 수행 : 정책이 ghost를 보고 자리를 정하는 것은 축출보다 먼저
+  if(cache->policy->prepare != NULL)
+  {
+    cache->policy->prepare(shard, hash, charge);
+  }
+  while(shard->used + charge > shard->budget && shard->count > 0)
+  {
+    cache_entry_t *victim = cache_evict(cache, shard);
+    victim->retired_next = victims;
+    victims = victim;
+    if(cache->l2 != NULL)
+    {
+      // 디스크에 쓸 때까지 참조를 하나 더 잡음 (락 없는 인덱스면 victims는 limbo로 넘어가므로 따로 연결)
+      __atomic_fetch_add(&victim->refs, 1, __ATOMIC_RELAXED);
+      victim->demote_next = demote;
+      demote = victim;
+    }
+  }
+  if(shard->count >= shard->nbuckets)
+  {
+    old_buckets = cache_grow(cache, shard);
+  }
+
+  // 새로운 엔트리 추가 (버킷 체인 맨 앞)
+  // 축출이나 테이블 확장으로 체인이 바뀌었을 수 있으므로 칸을 다시 찾음
+  // 항목을 다 채운 뒤에 release로 걸어서, 락 없이 찾는 쪽이 반쯤 만든 항목을 보지 않게 함
+  slot = cache_slot(shard, uri, hash, len);
+  e->next = *slot;
+  __atomic_store_n(slot, e, __ATOMIC_RELEASE);
+  cache->policy->admit(shard, e);
+  shard->count += 1;
+  shard->used += charge;
+
+  if(cache->lockfree && (victims != NULL || old_buckets != NULL ||
+                         shard->limbo[0] != NULL || shard->limbo[1] != NULL || shard->limbo[2] != NULL ||
+                         shard->limbo_buckets[0] != NULL || shard->limbo_buckets[1] != NULL || shard->limbo_buckets[2] != NULL))
+  {
+    // 방금 뗀 항목과 예전 버킷 배열은 아직 따라오는 쪽이 있을 수 있으므로 limbo에 두고, 충분히 오래된 limbo만 반납
+    victims = cache_retire(shard, victims, old_buckets);
+  }
+
+  long held = now_ns() - start;
+  shard->inserts += 1;
+  shard->insert_lock_ns += held;
+  if(held > shard->insert_lock_max_ns)
+  {
+    shard->insert_lock_max_ns = held;
+  }
+  pthread_rwlock_unlock(&shard->lock);
+
+  while(victims != NULL)
+  {
+    cache_entry_t *next = victims->retired_next;
+    cache_release(cache, victims);
+    victims = next;
+  }
+
+  // 축출한 항목은 락을 놓은 뒤 디스크 2차 캐시로 내려 보냄 (교체로 빠진 예전 항목과 gzip 변형은 내려 보내지 않음)
+  while(demote != NULL)
+  {
+    cache_entry_t *next = demote->demote_next;
+    if(!gzip_variant_key(demote->uri, demote->uri_len))
+    {
+      disk_put(cache->l2, demote->uri, demote->hash, demote->uri_len, demote->data, demote->size, demote->expires);
+    }
+    cache_release(cache, demote);
+    demote = next;
+  }
+  return;
+}
+
+/* 축출할 항목을 샤드에서 떼어내 돌려줌 : 캐시의 참조 반납은 호출한 쪽이 락을 놓은 뒤에 (샤드가 비어 있으면 NULL)
+   shard->lock을 쓰기로 잡은 상태로 호출 */
+cache_entry_t *cache_evict(cache_t *cache, cache_shard_t *shard)
+{
+  // 어떤 항목을 내보낼지는 시작할 때 고른 축출 정책이 정하고, 정책 구조에서도 떼어서 돌려줌
+  cache_entry_t *e = cache->policy->victim(shard);
+  if(e == NULL)
+  {
+    return NULL;
+  }
+
+  // 버킷 체인에서 떼어내기
+  // 항목은 청크 안에서 움직이지 않으므로 다른 항목을 옮길 필요 없이 포인터만 바꿈
+  cache_entry_t **slot = cache_slot(shard, e->uri, e->hash, e->uri_len);
+  __atomic_store_n(slot, e->next, __ATOMIC_RELEASE);
+  shard->count -= 1;
+  shard->used -= e->charge;
+  shard->evictions += 1;
+  return e;
+}
+
+/* uri의 64비트 FNV-1a 지문과 길이 */
+unsigned long long cache_hash(char *uri, int *len)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  char *p;
+
+  for(p = uri; *p; p++)
+  {
+    h ^= (unsigned char)*p;
+    h *= 1099511628211ULL;
+  }
+  *len = p - uri;
+  return h;
+}
+
+/* 지문의 상위 비트로 샤드 선택 (하위 비트는 샤드 안 버킷 선택에 씀) */
+cache_shard_t *cache_shard(cache_t *cache, unsigned long long hash)
+{
+  return &cache->shards[(hash >> 32) % cache->nshards];
+}
+
+/* uri가 들어 있는(없으면 들어갈) 버킷 체인의 칸 : *반환값이 NULL이면 캐시에 없음 (shard->lock을 쓰기로 잡은 상태로 호출) */
+cache_entry_t **cache_slot(cache_shard_t *shard, char *uri, unsigned long long hash, int len)
+{
+  cache_entry_t **slot = &shard->buckets[hash & (shard->nbuckets - 1)];
+
+  while(*slot != NULL)
+  {
+    cache_entry_t *e = *slot;
+    // 지문과 길이로 대부분 걸러내고, 둘 다 같을 때만 전체 비교
+    if(e->hash == hash && e->uri_len == len && memcmp(e->uri, uri, len) == 0)
+    {
+      break;
+    }
+    slot = &e->next;
+  }
+  return slot;
+}
+
+/* 찾기 전용 : 읽기 락 또는 epoch 안에서 호출
+   쓰는 쪽이 동시에 체인을 바꿔도 안전하도록 포인터는 모두 acquire로 읽음
+   (테이블을 늘리는 도중이면 다른 체인으로 넘어가 못 찾을 수 있지만, 그건 캐시 미스로 처리됨) */
+cache_entry_t *cache_lookup(cache_shard_t *shard, char *uri, unsigned long long hash, int len)
+{
+  // 버킷 수를 먼저 읽음 : 늘어난 버킷 수를 봤다면 배열도 늘어난 것 (cache_grow가 배열을 먼저 바꿈)
+  unsigned long n = __atomic_load_n(&shard->nbuckets, __ATOMIC_ACQUIRE);
+  cache_entry_t **buckets = __atomic_load_n(&shard->buckets, __ATOMIC_ACQUIRE);
+  cache_entry_t *e = __atomic_load_n(&buckets[hash & (n - 1)], __ATOMIC_ACQUIRE);
+
+  while(e != NULL)
+  {
+    if(e->hash == hash && e->uri_len == len && memcmp(e->uri, uri, len) == 0)
+    {
+      return e;
+    }
+    e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE);
+  }
+  return NULL;
+}
+
+/* 버킷 수를 두 배로 늘리고 항목을 다시 나눔 (shard->lock을 쓰기로 잡은 상태로 호출)
+   락 없는 인덱스면 예전 배열을 아직 읽는 쪽이 있을 수 있으므로 해제하지 않고 돌려줌 (cache_retire로 넘김, 아니면 NULL) */
+cache_entry_t **cache_grow(cache_t *cache, cache_shard_t *shard)
+{
+  unsigned long n = shard->nbuckets * 2;
+  cache_entry_t **old = shard->buckets;
+  cache_entry_t **buckets = Calloc(n, sizeof(cache_entry_t *));
+
+  for(unsigned long b = 0; b < shard->nbuckets; b++)
+  {
+    cache_entry_t *e = old[b];
+    while(e != NULL)
+    {
+      cache_entry_t *next = e->next;
+      __atomic_store_n(&e->next, buckets[e->hash & (n - 1)], __ATOMIC_RELEASE);
+      buckets[e->hash & (n - 1)] = e;
+      e = next;
+    }
+  }
+  __atomic_store_n(&shard->buckets, buckets, __ATOMIC_RELEASE);
+  __atomic_store_n(&shard->nbuckets, n, __ATOMIC_RELEASE);
+  if(cache->lockfree)
+  {
+    return old;
+  }
+  Free(old);
+  return NULL;
+}
+
+/* 정책 리스트 맨 앞(가장 최근)에 넣기 */
+void cache_list_push(cache_shard_t *shard, int list, cache_entry_t *e)
+{
+  cache_entry_t *head = &shard->lists[list];
+
+  e->list = list;
+  e->lru_prev = head;
+  e->lru_next = head->lru_next;
+  head->lru_next->lru_prev = e;
+  head->lru_next = e;
+  shard->list_bytes[list] += e->charge;
+}
+
+void cache_list_unlink(cache_shard_t *shard, cache_entry_t *e)
+{
+  e->lru_prev->lru_next = e->lru_next;
+  e->lru_next->lru_prev = e->lru_prev;
+  shard->list_bytes[e->list] -= e->charge;
+}
+
+/* 정책 리스트의 가장 오래된 항목 (비어 있으면 NULL) */
+cache_entry_t *cache_list_tail(cache_shard_t *shard, int list)
+{
+  cache_entry_t *e = shard->lists[list].lru_prev;
+  return e == &shard->lists[list] ? NULL : e;
+}
+
+/* 락 없는 인덱스 : 방금 떼어낸 항목(victims)과 예전 버킷 배열(old_buckets)을 현재 epoch의 limbo에 넣고,
+   전역 epoch가 두 번 이상 넘어간 limbo는 이제 읽는 쪽이 없으므로 배열은 해제하고 항목은 꺼내서 돌려줌 (shard->lock을 쓰기로 잡은 상태로 호출) */
+cache_entry_t *cache_retire(cache_shard_t *shard, cache_entry_t *victims, cache_entry_t **old_buckets)
+{
+  unsigned long epoch = reclaim_advance(&reclaim);
+  cache_entry_t *done = NULL;
+
+  for(int i = 0; i < 3; i++)
+  {
+    if(shard->limbo_epoch[i] + 2 > epoch)
+    {
+      continue;
+    }
+    if(shard->limbo[i] != NULL)
+    {
+      cache_entry_t *tail = shard->limbo[i];
+      while(tail->retired_next != NULL)
+      {
+        tail = tail->retired_next;
+      }
+      tail->retired_next = done;
+      done = shard->limbo[i];
+      shard->limbo[i] = NULL;
+    }
+    while(shard->limbo_buckets[i] != NULL)
+    {
+      retired_buckets_t *r = shard->limbo_buckets[i];
+      shard->limbo_buckets[i] = r->next;
+      Free(r->buckets);
+      Free(r);
+    }
+  }
+
+  // 같은 칸에 남아 있는 limbo는 같은 epoch의 것 (더 오래된 것은 위에서 꺼냄)
+  if(victims != NULL)
+  {
+    int i = epoch % 3;
+    cache_entry_t *tail = victims;
+    while(tail->retired_next != NULL)
+    {
+      tail = tail->retired_next;
+    }
+    tail->retired_next = shard->limbo[i];
+    shard->limbo[i] = victims;
+    shard->limbo_epoch[i] = epoch;
+  }
+  if(old_buckets != NULL)
+  {
+    int i = epoch % 3;
+    retired_buckets_t *r = Malloc(sizeof(retired_buckets_t));
+    r->buckets = old_buckets;
+    r->next = shard->limbo_buckets[i];
+    shard->limbo_buckets[i] = r;
+    shard->limbo_epoch[i] = epoch;
+  }
+  return done;
+}
+
+/* 벤치마크 스레드 인자 */
+typedef struct cache_bench_arg_t
+{
+  cache_t *cache;
+  unsigned int seed;
+  unsigned long hits;
+} cache_bench_arg_t;
+
+static char cache_bench_keys[CACHE_BENCH_KEYS][32];
+
+/* --bench=index : 미리 채운 캐시에서 찾기(64번에 한 번은 같은 키로 다시 삽입)를 스레드 수를 늘려 가며 측정
+   락 인덱스와 락 없는 인덱스를 같은 샤드 수(--cache-shards)로 비교 */
+void cache_bench(void)
+{
+  char data[64];
+  int index[2] = { CACHE_INDEX_LOCKED, CACHE_INDEX_LOCKFREE };
+  pthread_t tids[CACHE_BENCH_MAX_THREADS];
+  cache_bench_arg_t args[CACHE_BENCH_MAX_THREADS];
+
+  memset(data, 'x', sizeof(data));
+  for(int k = 0; k < CACHE_BENCH_KEYS; k++)
+  {
+    snprintf(cache_bench_keys[k], sizeof(cache_bench_keys[k]), "http://bench/%d", k);
+  }
+
+  for(int m = 0; m < 2; m++)
+  {
+    config.cache_index = index[m];
+    cache_t *c = Calloc(1, sizeof(cache_t)); // 벤치마크가 끝나면 프로세스가 종료되므로 해제하지 않음
+    cache_init(c);
+    for(int k = 0; k < CACHE_BENCH_KEYS; k++)
+    {
+      cache_insert(c, cache_bench_keys[k], data, sizeof(data), LONG_MAX);
+    }
+
+    for(int nthreads = 1; nthreads <= CACHE_BENCH_MAX_THREADS; nthreads *= 2)
+    {
+      long start = now_ns();
+      for(int t = 0; t < nthreads; t++)
+      {
+        args[t].cache = c;
+        args[t].seed = t + 1;
+        args[t].hits = 0;
+        Pthread_create(&tids[t], NULL, cache_bench_thread, &args[t]);
+      }
+      unsigned long hits = 0;
+      for(int t = 0; t < nthreads; t++)
+      {
+        Pthread_join(tids[t], NULL);
+        hits += args[t].hits;
+      }
+      long elapsed = now_ns() - start;
+      double ops = (double)nthreads * CACHE_BENCH_OPS;
+      printf("index %s, shards %d, threads %2d: %.2f Mops/s, hit %.1f%%\n",
+             c->lockfree ? "lockfree" : "locked", c->nshards, nthreads,
+             ops * 1000.0 / elapsed, hits * 100.0 / ops);
+      fflush(stdout);
+    }
+  }
+}
+
+void* cache_bench_thread(void* arg)
+{
+  cache_bench_arg_t *a = (cache_bench_arg_t *)arg;
+  char data[64];
+
+  memset(data, 'y', sizeof(data));
+  for(int i = 0; i < CACHE_BENCH_OPS; i++)
+  {
+    char *key = cache_bench_keys[rand_r(&a->seed) % CACHE_BENCH_KEYS];
+    if(i % 64 == 63)
+    {
+      cache_insert(a->cache, key, data, sizeof(data), LONG_MAX);
+      continue;
+    }
+    cache_entry_t *e = cache_find(a->cache, key);
+    if(e != NULL)
+    {
+      a->hits += 1;
+      cache_release(a->cache, e);
+    }
+  }
+  return NULL;
+}
+
+/* 크기 클래스 만들기 : SLAB_MIN_CHUNK부터 1.25배씩 (8바이트 정렬) max_chunk가 들어갈 때까지 */
+void slab_init(slab_t *slab, size_t max_chunk, size_t max_free)
+{
+  size_t size = SLAB_MIN_CHUNK;
+
+  slab->nclasses = 0;
+  while(slab->nclasses < SLAB_MAX_CLASSES - 1 && size < max_chunk)
+  {
+    slab->chunk_size[slab->nclasses++] = size;
+    size = (size * 5 / 4 + 7) & ~(size_t)7;
+  }
+  slab->chunk_size[slab->nclasses++] = (max_chunk + 7) & ~(size_t)7;
+  memset(slab->free_list, 0, sizeof(slab->free_list));
+  slab->free_bytes = 0;
+  slab->max_free = max_free;
+  pthread_mutex_init(&slab->lock, NULL);
+}
+
+/* size 바이트가 들어가는 가장 작은 클래스의 청크 (free list에 있으면 재사용) */
+void *slab_alloc(slab_t *slab, size_t size, int *cls)
+{
+  int c = slab_class(slab, size);
+  void *chunk;
+
+  *cls = c;
+
+  pthread_mutex_lock(&slab->lock);
+  chunk = slab->free_list[c];
+  if(chunk != NULL)
+  {
+    slab->free_list[c] = *(void **)chunk;
+    slab->free_bytes -= slab->chunk_size[c];
+  }
+  pthread_mutex_unlock(&slab->lock);
+
+  if(chunk == NULL)
+  {
+    chunk = Malloc(slab->chunk_size[c]);
+  }
+  return chunk;
+}
+
+/* size 바이트가 들어가는 가장 작은 클래스 */
+int slab_class(slab_t *slab, size_t size)
+{
+  int c = 0;
+
+  while(slab->chunk_size[c] < size)
+  {
+    c++;
+  }
+  return c;
+}
+
+/* 청크 반납 : free list가 max_free를 넘으면 시스템에 돌려줌 */
+void slab_free(slab_t *slab, void *chunk, int cls)
+{
+  pthread_mutex_lock(&slab->lock);
+  if(slab->free_bytes + slab->chunk_size[cls] <= slab->max_free)
+  {
+    *(void **)chunk = slab->free_list[cls];
+    slab->free_list[cls] = chunk;
+    slab->free_bytes += slab->chunk_size[cls];
+    chunk = NULL;
+  }
+  pthread_mutex_unlock(&slab->lock);
+
+  if(chunk != NULL)
+  {
+    Free(chunk);
+  }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* epoch 기반 회수 함수들 */
+
+void reclaim_init(reclaim_t *r)
+{
+  r->epoch = 1;
+  r->threads = NULL;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_key_create(&r->key, reclaim_thread_done);
+}
+
+/* 찾기 시작 : 이 스레드의 기록에 현재 전역 epoch를 적음 (처음이면 기록을 만들거나 놓인 기록을 재사용) */
+reclaim_thread_t *reclaim_enter(reclaim_t *r)
+{
+  reclaim_thread_t *t = reclaim_self;
+
+  if(t == NULL)
+  {
+    pthread_mutex_lock(&r->lock);
+    for(t = r->threads; t != NULL; t = t->next)
+    {
+      if(!t->in_use)
+      {
+        break;
+      }
+    }
+    if(t == NULL)
+    {
+      t = Calloc(1, sizeof(reclaim_thread_t));
+      t->next = r->threads;
+      __atomic_store_n(&r->threads, t, __ATOMIC_RELEASE);
+    }
+    t->in_use = 1;
+    pthread_mutex_unlock(&r->lock);
+    pthread_setspecific(r->key, t);
+    reclaim_self = t;
+  }
+
+  __atomic_store_n(&t->epoch, __atomic_load_n(&r->epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  // epoch를 적은 것이 체인을 읽는 것보다 먼저 보이도록 (reclaim_advance의 fence와 짝)
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return t;
+}
+
+/* 찾기 끝 */
+void reclaim_exit(reclaim_thread_t *t)
+{
+  __atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* 찾는 중인 스레드가 모두 현재 epoch에 들어와 있으면 전역 epoch를 하나 올림 : 올린 뒤(또는 그대로)의 epoch를 돌려줌 */
+unsigned long reclaim_advance(reclaim_t *r)
+{
+  // 항목을 떼어낸 것이 기록을 훑는 것보다 먼저 보이도록 (reclaim_enter의 fence와 짝)
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  unsigned long epoch = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+
+  for(reclaim_thread_t *t = __atomic_load_n(&r->threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+  {
+    unsigned long e = __atomic_load_n(&t->epoch, __ATOMIC_ACQUIRE);
+    if(e != 0 && e != epoch)
+    {
+      return epoch; // 아직 이전 epoch에서 찾는 중인 스레드가 있음
+    }
+  }
+  if(__atomic_compare_exchange_n(&r->epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+  {
+    return epoch + 1;
+  }
+  return epoch; // 다른 스레드가 먼저 올림 (epoch에는 현재 값이 들어 있음)
+}
+
+/* 스레드가 끝날 때 기록을 놓아 새 스레드가 재사용하게 함 */
+void reclaim_thread_done(void *t)
+{
+  reclaim_thread_t *rec = (reclaim_thread_t *)t;
+
+  pthread_mutex_lock(&reclaim.lock);
+  rec->epoch = 0;
+  rec->in_use = 0;
+  pthread_mutex_unlock(&reclaim.lock);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* 축출 정책 함수들 */
+
+/* 리스트를 쓰는 정책 공통 : 교체로 빠지는 항목을 리스트에서 떼어냄 */
+void policy_list_remove(cache_shard_t *shard, cache_entry_t *e)
+{
+  cache_list_unlink(shard, e);
+}
+
+/* 리스트를 쓰는 정책 공통 : 축출 순서에서 e 다음으로 볼 항목 (같은 리스트에서 한 칸 더 최근 쪽, list 0을 다 보면 list 1의 tail부터)
+   축출하면서 바뀌는 리스트 선택과 CLOCK/S3-FIFO의 재삽입은 흉내 내지 않는 근사 */
+cache_entry_t *policy_list_next(cache_shard_t *shard, cache_entry_t *e)
+{
+  if(e->lru_prev != &shard->lists[e->list])
+  {
+    return e->lru_prev;
+  }
+  return e->list == 0 ? cache_list_tail(shard, 1) : NULL;
+}
+
+/* LRU : 히트마다 리스트 맨 앞으로 옮기고 tail을 축출 */
+void policy_lru_hit(cache_shard_t *shard, cache_entry_t *e)
+{
+  cache_list_unlink(shard, e);
+  cache_list_push(shard, 0, e);
+}
+
+void policy_lru_admit(cache_shard_t *shard, cache_entry_t *e)
+{
+  cache_list_push(shard, 0, e);
+}
+
+cache_entry_t *policy_lru_peek(cache_shard_t *shard, cache_entry_t *after)
+{
+  return after != NULL ? policy_list_next(shard, after) : cache_list_tail(shard, 0);
+}
+
+cache_entry_t *policy_lru_victim(cache_shard_t *shard)
+{
+  cache_entry_t *e = cache_list_tail(shard, 0);
+
+  if(e != NULL)
+  {
+    cache_list_unlink(shard, e);
+  }
+  return e;
+}
+
+/* CLOCK : 히트는 참조 비트만 세우고(읽기 락), 축출할 때 tail에서 비트가 선 항목은 비트를 지우고 head로 옮겨 한 번 더 기회를 줌
+   한 바퀴 돌면 모든 비트가 지워지므로 반드시 끝남 */
+void policy_clock_hit(cache_shard_t *shard, cache_entry_t *e)
+{
+  if(!__atomic_load_n(&e->freq, __ATOMIC_RELAXED))
+  {
+    __atomic_store_n(&e->freq, 1, __ATOMIC_RELAXED);
+  }
+}
+
+cache_entry_t *policy_clock_victim(cache_shard_t *shard)
+{
+  cache_entry_t *e;
+
+  while((e = cache_list_tail(shard, 0)) != NULL)
+  {
+    cache_list_unlink(shard, e);
+    if(!__atomic_load_n(&e->freq, __ATOMIC_RELAXED))
+    {
+      return e;
+    }
+    __atomic_store_n(&e->freq, 0, __ATOMIC_RELAXED);
+    cache_list_push(shard, 0, e);
+  }
+  return NULL;
+}
+
+/* ghost를 쓰는 정책(2Q, ARC, S3-FIFO) 공통 : ghost 두 개를 샤드 예산만큼의 바이트로 준비
+   개수 상한은 샤드에 동시에 들어갈 수 있는 최대 항목 수 (가장 작은 청크 기준) */
+void policy_ghost_init(cache_shard_t *shard)
+{
+  int cap = shard->budget / SLAB_MIN_CHUNK;
+
+  ghost_init(&shard->ghosts[0], cap, shard->budget);
+  ghost_init(&shard->ghosts[1], cap, shard->budget);
+}
+
+/* 2Q, S3-FIFO : 최근에 축출된 키(ghosts[0]에 있음)가 다시 들어오면 보호 구역(list 1)으로 바로 넣음 */
+void policy_ghost_prepare(cache_shard_t *shard, unsigned long long hash, size_t charge)
+{
+  shard->ghost_hit = ghost_take(&shard->ghosts[0], hash) ? 1 : 0;
+}
+
+void policy_ghost_admit(cache_shard_t *shard, cache_entry_t *e)
+{
+  cache_list_push(shard, shard->ghost_hit ? 1 : 0, e);
+  shard->ghost_hit = 0;
+}
+
+/* 2Q (Johnson & Shasha) : 처음 들어온 항목은 A1in(list 0, FIFO, 예산의 1/4)에 두고,
+   A1in에서 밀려난 키를 A1out(ghosts[0])에 기억했다가 다시 오면 Am(list 1, LRU)으로
+   한 번만 쓰이고 마는 훑기(scan)는 A1in 안에서 끝나므로 Am의 hot 항목을 밀어내지 않음 */
+void policy_2q_hit(cache_shard_t *shard, cache_entry_t *e)
+{
+  // A1in 안에서의 히트는 순서를 바꾸지 않음 (짧은 시간 안의 연속 참조는 한 번으로 봄)
+  if(e->list == 1)
+  {
+    cache_list_unlink(shard, e);
+    cache_list_push(shard, 1, e);
+  }
+}
+
+/* A1in이 제 몫(예산의 1/4)보다 크거나 Am이 비었으면 A1in tail, 아니면 Am tail */
+cache_entry_t *policy_2q_peek(cache_shard_t *shard, cache_entry_t *after)
+{
+  cache_entry_t *e = cache_list_tail(shard, 0);
+
+  if(after != NULL)
+  {
+    return policy_list_next(shard, after);
+  }
+  if(e != NULL && (shard->list_bytes[0] > shard->budget / 4 || cache_list_tail(shard, 1) == NULL))
+  {
+    return e;
+  }
+  return cache_list_tail(shard, 1);
+}
+
+cache_entry_t *policy_2q_victim(cache_shard_t *shard)
+{
+  cache_entry_t *e = policy_2q_peek(shard, NULL);
+
+  if(e != NULL)
+  {
+    cache_list_unlink(shard, e);
+    if(e->list == 0)
+    {
+      ghost_add(&shard->ghosts[0], e->hash, e->charge);
+    }
+  }
+  return e;
+}
+
+/* ARC (Megiddo & Modha)를 바이트 단위로 : T1(list 0)은 한 번 쓰인 항목, T2(list 1)는 두 번 이상 쓰인 항목
+   B1/B2(ghosts[0]/[1])는 T1/T2에서 축출된 키이고, B1에서 다시 오면 T1 목표(arc_target)를 늘리고 B2에서 다시 오면 줄임 */
+void policy_arc_prepare(cache_shard_t *shard, unsigned long long hash, size_t charge)
+{
+  size_t b1 = shard->ghosts[0].bytes;
+  size_t b2 = shard->ghosts[1].bytes;
+  size_t delta;
+
+  shard->ghost_hit = 0;
+  if(ghost_take(&shard->ghosts[0], hash))
+  {
+    // 최근성 쪽이 모자랐음 : T1을 늘림
+    delta = b2 > b1 && b1 > 0 ? charge * (b2 / b1) : charge;
+    shard->arc_target = shard->arc_target + delta > shard->budget ? shard->budget : shard->arc_target + delta;
+    shard->ghost_hit = 1;
+  }
+  else if(ghost_take(&shard->ghosts[1], hash))
+  {
+    // 빈도 쪽이 모자랐음 : T1을 줄임
+    delta = b1 > b2 && b2 > 0 ? charge * (b1 / b2) : charge;
+    shard->arc_target = shard->arc_target > delta ? shard->arc_target - delta : 0;
+    shard->ghost_hit = 2;
+  }
+}
+
+void policy_arc_hit(cache_shard_t *shard, cache_entry_t *e)
+{
+  cache_list_unlink(shard, e);
+  cache_list_push(shard, 1, e);
+}
+
+/* REPLACE : T1이 목표보다 크면 T1에서, 아니면 T2에서 (B2에서 다시 온 경우에는 같아도 T1에서) */
+cache_entry_t *policy_arc_peek(cache_shard_t *shard, cache_entry_t *after)
+{
+  cache_entry_t *t1 = cache_list_tail(shard, 0);
+  cache_entry_t *t2 = cache_list_tail(shard, 1);
+  size_t t1_bytes = shard->list_bytes[0];
+
+  if(after != NULL)
+  {
+    return policy_list_next(shard, after);
+  }
+  if(t1 != NULL && (t2 == NULL || t1_bytes > shard->arc_target || (shard->ghost_hit == 2 && t1_bytes == shard->arc_target)))
+  {
+    return t1;
+  }
+  return t2;
+}
+
+cache_entry_t *policy_arc_victim(cache_shard_t *shard)
+{
+  cache_entry_t *e = policy_arc_peek(shard, NULL);
+
+  if(e != NULL)
+  {
+    // T1에서 나가면 B1, T2에서 나가면 B2에 기억
+    int list = e->list;
+    cache_list_unlink(shard, e);
+    ghost_add(&shard->ghosts[list], e->hash, e->charge);
+  }
+  return e;
+}
+
+/* S3-FIFO (Yang et al.) : 새 항목은 small FIFO(list 0, 예산의 10%)에, ghost에 있던 키와 small에서 두 번 넘게 쓰인 항목은 main FIFO(list 1)로
+   히트는 freq(최대 3)만 올리므로 읽기 락으로 충분하고, main에서는 freq가 남은 항목을 하나 깎아서 다시 넣음 */
+void policy_s3fifo_hit(cache_shard_t *shard, cache_entry_t *e)
+{
+  int f = __atomic_load_n(&e->freq, __ATOMIC_RELAXED);
+
+  if(f < 3)
+  {
+    __atomic_store_n(&e->freq, f + 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* freq를 보고 다시 넣는 것은 빼고, 지금 tail 중 어느 쪽에서 축출할지만 봄 */
+cache_entry_t *policy_s3fifo_peek(cache_shard_t *shard, cache_entry_t *after)
+{
+  cache_entry_t *e = cache_list_tail(shard, 0);
+
+  if(after != NULL)
+  {
+    return policy_list_next(shard, after);
+  }
+  if(e != NULL && (shard->list_bytes[0] >= shard->budget / 10 || cache_list_tail(shard, 1) == NULL))
+  {
+    return e;
+  }
+  return cache_list_tail(shard, 1);
+}
+
+cache_entry_t *policy_s3fifo_victim(cache_shard_t *shard)
+{
+  cache_entry_t *e;
+
+  while(1)
+  {
+    e = cache_list_tail(shard, 0);
+    if(e != NULL && (shard->list_bytes[0] >= shard->budget / 10 || cache_list_tail(shard, 1) == NULL))
+    {
+      cache_list_unlink(shard, e);
+      if(__atomic_load_n(&e->freq, __ATOMIC_RELAXED) > 1)
+      {
+        __atomic_store_n(&e->freq, 0, __ATOMIC_RELAXED);
+        cache_list_push(shard, 1, e);
+        continue;
+      }
+      ghost_add(&shard->ghosts[0], e->hash, e->charge);
+      return e;
+    }
+
+    e = cache_list_tail(shard, 1);
+    if(e == NULL)
+    {
+      return NULL;
+    }
+    cache_list_unlink(shard, e);
+    int f = __atomic_load_n(&e->freq, __ATOMIC_RELAXED);
+    if(f > 0)
+    {
+      __atomic_store_n(&e->freq, f - 1, __ATOMIC_RELAXED);
+      cache_list_push(shard, 1, e);
+      continue;
+    }
+    return e;
+  }
+}
+
+/* GDSF (Greedy-Dual-Size-Frequency) : priority = L + freq / 크기 가 가장 작은 항목을 축출하고 L을 그 값으로 올림
+   작은 객체와 자주 쓰이는 객체를 오래 남김 (모든 객체의 비용은 같다고 봄)
+   히트는 freq만 올리고(읽기 락), 힙은 축출할 때 freq가 바뀐 항목만 다시 계산해서 내려보냄 */
+void policy_gdsf_hit(cache_shard_t *shard, cache_entry_t *e)
+{
+  __atomic_fetch_add(&e->freq, 1, __ATOMIC_RELAXED);
+}
+
+void policy_gdsf_admit(cache_shard_t *shard, cache_entry_t *e)
+{
+  if(shard->heap_len == shard->heap_cap)
+  {
+    shard->heap_cap = shard->heap_cap ? shard->heap_cap * 2 : 1024;
+    shard->heap = Realloc(shard->heap, shard->heap_cap * sizeof(cache_entry_t *));
+  }
+  e->freq = 1;
+  e->heap_freq = 1;
+  e->priority = shard->inflation + 1.0 / e->charge;
+  e->heap_index = shard->heap_len;
+  shard->heap[shard->heap_len++] = e;
+  heap_up(shard, e->heap_index);
+}
+
+cache_entry_t *policy_gdsf_victim(cache_shard_t *shard)
+{
+  // freq가 바뀐 항목은 priority를 다시 계산해서 내려보냄 : 히트가 계속 들어와도 힙 크기만큼만 반복
+  for(int tries = 0; shard->heap_len > 0 && tries < shard->heap_len; tries++)
+  {
+    cache_entry_t *top = shard->heap[0];
+    int f = __atomic_load_n(&top->freq, __ATOMIC_RELAXED);
+    if(f == top->heap_freq)
+    {
+      break;
+    }
+    top->heap_freq = f;
+    top->priority = shard->inflation + (double)f / top->charge;
+    heap_down(shard, 0);
+  }
+  if(shard->heap_len == 0)
+  {
+    return NULL;
+  }
+
+  cache_entry_t *e = shard->heap[0];
+  shard->inflation = e->priority;
+  policy_gdsf_remove(shard, e);
+  return e;
+}
+
+/* 힙 배열 순서로 : 정렬된 순서는 아니지만 앞쪽일수록 priority가 작은 근사 (부모는 자식보다 항상 작음) */
+cache_entry_t *policy_gdsf_peek(cache_shard_t *shard, cache_entry_t *after)
+{
+  int i = after != NULL ? after->heap_index + 1 : 0;
+
+  return i < shard->heap_len ? shard->heap[i] : NULL;
+}
+
+void policy_gdsf_remove(cache_shard_t *shard, cache_entry_t *e)
+{
+  int i = e->heap_index;
+
+  shard->heap_len -= 1;
+  if(i != shard->heap_len)
+  {
+    heap_swap(shard, i, shard->heap_len);
+    heap_down(shard, i);
+    heap_up(shard, i);
+  }
+}
+
+void heap_swap(cache_shard_t *shard, int i, int j)
+{
+  cache_entry_t *t = shard->heap[i];
+
+  shard->heap[i] = shard->heap[j];
+  shard->heap[j] = t;
+  shard->heap[i]->heap_index = i;
+  shard->heap[j]->heap_index = j;
+}
+
+void heap_up(cache_shard_t *shard, int i)
+{
+  while(i > 0 && shard->heap[(i - 1) / 2]->priority > shard->heap[i]->priority)
+  {
+    heap_swap(shard, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+void heap_down(cache_shard_t *shard, int i)
+{
+  while(1)
+  {
+    int min = i;
+    int l = 2 * i + 1;
+    int r = 2 * i + 2;
+    if(l < shard->heap_len && shard->heap[l]->priority < shard->heap[min]->priority)
+    {
+      min = l;
+    }
+    if(r < shard->heap_len && shard->heap[r]->priority < shard->heap[min]->priority)
+    {
+      min = r;
+    }
+    if(min == i)
+    {
+      return;
+    }
+    heap_swap(shard, i, min);
+    i = min;
+  }
+}
+
+/* TinyLFU : 샤드가 꽉 차서 축출이 필요할 때, 새 키의 추정 빈도가 이 삽입으로 축출될 항목들의 추정 빈도 합보다 높을 때만 받아들임
+   (큰 객체 하나가 자주 쓰이는 작은 항목 여러 개를 밀어내는 것을 막음) 정책 구조는 보기만 하므로 읽기 락
+   같은 키의 항목을 바꾸는 삽입(재검증으로 받은 새 응답)은 거르지 않음 : 거르면 만료된 예전 항목이 남아 요청마다 다시 재검증함 */
+int cache_admit(cache_t *cache, cache_shard_t *shard, char *uri, unsigned long long hash, int len, size_t charge)
+{
+  int admit = 1;
+
+  pthread_rwlock_rdlock(&shard->lock);
+  if(shard->used + charge > shard->budget && cache_lookup(shard, uri, hash, len) == NULL)
+  {
+    size_t need = shard->used + charge - shard->budget, freed = 0;
+    long victims_freq = 0;
+    int freq = sketch_estimate(&shard->sketch, hash);
+    cache_entry_t *victim = cache->policy->peek(shard, NULL);
+
+    // 자리가 날 때까지 축출 순서대로 : 합이 새 키 빈도 이상이 되면 더 볼 필요 없음
+    while(victim != NULL && freed < need)
+    {
+      victims_freq += sketch_estimate(&shard->sketch, victim->hash);
+      freed += victim->charge;
+      if(victims_freq >= freq)
+      {
+        break;
+      }
+      victim = cache->policy->peek(shard, victim);
+    }
+    if(freed > 0 && freq <= victims_freq)
+    {
+      admit = 0;
+    }
+  }
+  pthread_rwlock_unlock(&shard->lock);
+
+  if(admit)
+  {
+    __atomic_fetch_add(&shard->admitted, 1, __ATOMIC_RELAXED);
+  }
+  return admit;
+}
+
+/* width는 2의 거듭제곱으로 올림, 도어키퍼는 카운터 수의 2배 비트 */
+void sketch_init(sketch_t *sk, size_t width)
+{
+  size_t w = 64;
+
+  while(w < width)
+  {
+    w *= 2;
+  }
+  sk->counters = Calloc(SKETCH_ROWS * w, 1);
+  sk->mask = w - 1;
+  sk->door = Calloc(w * SKETCH_ROWS * 2 / 64, sizeof(unsigned long long));
+  sk->door_mask = w * SKETCH_ROWS * 2 - 1;
+  sk->additions = 0;
+  sk->sample = 10 * w;
+}
+
+/* 키 한 번 요청 : 처음 보는 키는 도어키퍼에만 표시하고, 두 번째부터 sketch의 카운터 SKETCH_ROWS개를 올림 */
+void sketch_add(sketch_t *sk, unsigned long long hash)
+{
+  unsigned int a = (unsigned int)hash;
+  unsigned int b = (unsigned int)(hash >> 32) | 1;
+  int seen = 1;
+
+  for(int i = 0; i < 2; i++)
+  {
+    unsigned int bit = (b + i * a) & sk->door_mask;
+    unsigned long long m = 1ULL << (bit % 64);
+    if(!(__atomic_fetch_or(&sk->door[bit / 64], m, __ATOMIC_RELAXED) & m))
+    {
+      seen = 0;
+    }
+  }
+
+  if(seen)
+  {
+    for(int i = 0; i < SKETCH_ROWS; i++)
+    {
+      unsigned char *c = &sk->counters[i * (sk->mask + 1) + ((a + i * b) & sk->mask)];
+      unsigned char v = __atomic_load_n(c, __ATOMIC_RELAXED);
+      if(v < SKETCH_MAX)
+      {
+        __atomic_store_n(c, v + 1, __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  // sample만큼 셀 때마다 aging (정확히 sample번째로 센 스레드 하나만)
+  if(__atomic_add_fetch(&sk->additions, 1, __ATOMIC_RELAXED) == sk->sample)
+  {
+    sketch_age(sk);
+  }
+}
+
+/* 추정 빈도 = 카운터 중 최솟값 + 도어키퍼에 있으면 1 */
+int sketch_estimate(sketch_t *sk, unsigned long long hash)
+{
+  unsigned int a = (unsigned int)hash;
+  unsigned int b = (unsigned int)(hash >> 32) | 1;
+  int min = SKETCH_MAX;
+  int door = 1;
+
+  for(int i = 0; i < SKETCH_ROWS; i++)
+  {
+    int v = __atomic_load_n(&sk->counters[i * (sk->mask + 1) + ((a + i * b) & sk->mask)], __ATOMIC_RELAXED);
+    if(v < min)
+    {
+      min = v;
+    }
+  }
+  for(int i = 0; i < 2; i++)
+  {
+    unsigned int bit = (b + i * a) & sk->door_mask;
+    if(!(__atomic_load_n(&sk->door[bit / 64], __ATOMIC_RELAXED) & (1ULL << (bit % 64))))
+    {
+      door = 0;
+    }
+  }
+  return min + door;
+}
+
+/* 모든 카운터를 반으로, 도어키퍼는 비움 : 예전에 인기 있던 키가 계속 자리를 차지하지 않도록 */
+void sketch_age(sketch_t *sk)
+{
+  size_t n = SKETCH_ROWS * (size_t)(sk->mask + 1);
+
+  for(size_t i = 0; i < n; i++)
+  {
+    __atomic_store_n(&sk->counters[i], __atomic_load_n(&sk->counters[i], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+  }
+  for(size_t i = 0; i <= sk->door_mask / 64; i++)
+  {
+    __atomic_store_n(&sk->door[i], 0, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&sk->additions, sk->sample / 2, __ATOMIC_RELAXED);
+}
+
+void ghost_init(ghost_t *g, int cap, size_t max_bytes)
+{
+  int tsize = 16;
+
+  if(cap < 16)
+  {
+    cap = 16;
+  }
+  while(tsize < cap * 2)
+  {
+    tsize *= 2;
+  }
+  g->ring = Calloc(cap, sizeof(unsigned long long));
+  g->ring_size = Calloc(cap, sizeof(unsigned int));
+  g->cap = cap;
+  g->head = 0;
+  g->count = 0;
+  g->table = Calloc(tsize, sizeof(int));
+  g->mask = tsize - 1;
+  g->bytes = 0;
+  g->max_bytes = max_bytes;
+}
+
+/* 축출된 키 기억 : 칸이나 바이트가 모자라면 가장 오래된 것부터 잊음 */
+void ghost_add(ghost_t *g, unsigned long long hash, size_t size)
+{
+  hash = hash ? hash : 1; // 0은 꺼낸 칸 표시
+
+  while(g->count > 0 && (g->count == g->cap || g->bytes + size > g->max_bytes))
+  {
+    int oldest = (g->head - g->count + g->cap) % g->cap;
+    if(g->ring[oldest] != 0)
+    {
+      ghost_delete(g, ghost_find(g, g->ring[oldest]));
+      g->bytes -= g->ring_size[oldest];
+    }
+    g->count -= 1;
+  }
+
+  int pos = ghost_find(g, hash);
+  if(pos >= 0)
+  {
+    // 이미 기억하고 있는 키 : 예전 칸을 비우고 새로 기억
+    int idx = g->table[pos] - 1;
+    g->ring[idx] = 0;
+    g->bytes -= g->ring_size[idx];
+    ghost_delete(g, pos);
+  }
+
+  g->ring[g->head] = hash;
+  g->ring_size[g->head] = size;
+  g->bytes += size;
+  pos = hash & g->mask;
+  while(g->table[pos] != 0)
+  {
+    pos = (pos + 1) & g->mask;
+  }
+  g->table[pos] = g->head + 1;
+  g->head = (g->head + 1) % g->cap;
+  g->count += 1;
+}
+
+/* 키가 ghost에 있었으면 꺼내고 1 */
+int ghost_take(ghost_t *g, unsigned long long hash)
+{
+  hash = hash ? hash : 1;
+  int pos = ghost_find(g, hash);
+  if(pos < 0)
+  {
+    return 0;
+  }
+
+  int idx = g->table[pos] - 1;
+  g->ring[idx] = 0; // 링 칸은 오래되어 밀려날 때까지 비워 둠
+  g->bytes -= g->ring_size[idx];
+  ghost_delete(g, pos);
+  return 1;
+}
+
+/* 해시 테이블에서 키의 위치 (없으면 -1) */
+int ghost_find(ghost_t *g, unsigned long long hash)
+{
+  int pos = hash & g->mask;
+
+  while(g->table[pos] != 0)
+  {
+    if(g->ring[g->table[pos] - 1] == hash)
+    {
+      return pos;
+    }
+    pos = (pos + 1) & g->mask;
+  }
+  return -1;
+}
+
+/* 열린 주소 해시에서 pos 칸을 지우고, 뒤따르는 칸을 당겨 탐색 경로가 끊기지 않게 함 */
+void ghost_delete(ghost_t *g, int pos)
+{
+  int next = pos;
+
+  while(1)
+  {
+    next = (next + 1) & g->mask;
+    if(g->table[next] == 0)
+    {
+      break;
+    }
+    int home = g->ring[g->table[next] - 1] & g->mask;
+    // next 칸의 키가 (pos, next] 사이에서 시작하지 않았으면 pos로 당길 수 있음
+    if((next > pos && (home <= pos || home > next)) || (next < pos && home <= pos && home > next))
+    {
+      g->table[pos] = g->table[next];
+      pos = next;
+    }
+  }
+  g->table[pos] = 0;
+}
+
+/* --bench=policy : 같은 합성 트레이스를 정책마다 돌려 히트율과 바이트 히트율 비교
+   인기 객체는 Zipf(0.8)로 고르고, 크기는 1KB~MAX_OBJECT_SIZE 사이 로그 균등 (키마다 고정)
+   POLICY_BENCH_SCAN_EVERY 요청마다 한 번씩만 쓰이는 객체 POLICY_BENCH_SCAN_LEN개를 훑음 (hot 항목을 밀어내는 패턴)
+   캐시 크기는 --cache-size, 샤드 수는 --cache-shards로 */
+void policy_bench(void)
+{
+  static char body[MAX_OBJECT_SIZE];
+  double *cdf = Malloc(POLICY_BENCH_OBJECTS * sizeof(double));
+  double sum = 0;
+  char key[64];
+
+  memset(body, 'z', sizeof(body));
+  for(int k = 0; k < POLICY_BENCH_OBJECTS; k++)
+  {
+    sum += 1.0 / pow(k + 1, 0.8);
+    cdf[k] = sum;
+  }
+
+  for(int p = 0; cache_policies[p].name != NULL; p++)
+  {
+    config.cache_policy = p;
+    cache_t *c = Calloc(1, sizeof(cache_t)); // 벤치마크가 끝나면 프로세스가 종료되므로 해제하지 않음
+    cache_init(c);
+
+    unsigned int seed = 1;
+    unsigned long hits = 0, requests = 0, hit_bytes = 0, bytes = 0;
+    long scan_id = POLICY_BENCH_OBJECTS;
+    long start = now_ns();
+    for(int i = 0; i < POLICY_BENCH_REQUESTS; i++)
+    {
+      int burst = i % POLICY_BENCH_SCAN_EVERY == 0 ? POLICY_BENCH_SCAN_LEN : 0;
+      for(int b = 0; b <= burst; b++)
+      {
+        long id;
+        if(b < burst)
+        {
+          id = scan_id++;
+        }
+        else
+        {
+          // 누적 분포에서 이분 탐색
+          double u = (double)rand_r(&seed) / RAND_MAX * sum;
+          int lo = 0, hi = POLICY_BENCH_OBJECTS - 1;
+          while(lo < hi)
+          {
+            int mid = (lo + hi) / 2;
+            if(cdf[mid] < u)
+            {
+              lo = mid + 1;
+            }
+            else
+            {
+              hi = mid;
+            }
+          }
+          id = lo;
+        }
+        // 키마다 고정된 크기 : 1KB * (MAX_OBJECT_SIZE / 1KB)^x, x는 id로 정한 [0, 1) 값
+        double x = (double)((id * 2654435761UL) % 1000) / 1000;
+        int size = (int)(1024 * pow((double)MAX_OBJECT_SIZE / 1024, x));
+        snprintf(key, sizeof(key), "http://bench/%ld", id);
+
+        requests += 1;
+        bytes += size;
+        cache_entry_t *e = cache_find(c, key);
+        if(e != NULL)
+        {
+          hits += 1;
+          hit_bytes += size;
+          cache_release(c, e);
+        }
+        else
+        {
+          cache_insert(c, key, body, size, LONG_MAX);
+        }
+      }
+    }
+    long elapsed = now_ns() - start;
+    printf("policy %-6s: cache %zu bytes, %d shards, hit ratio %5.1f%%, byte hit ratio %5.1f%%, %ld ms\n",
+           c->policy->name, c->budget, c->nshards, hits * 100.0 / requests, hit_bytes * 100.0 / bytes,
+           elapsed / 1000000);
+    fflush(stdout);
+  }
+  Free(cdf);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* 디스크 2차 캐시 함수들 */
+
+/* 디스크 2차 캐시 초기화 : --disk-cache가 없으면 꺼 둠
+   이전 실행이 남긴 세그먼트 파일은 지우고 빈 로그로 시작 */
+void disk_init(disk_cache_t *dc)
+{
+  char path[MAXLINE * 2];
+  DIR *dir;
+  struct dirent *de;
+  int id;
+
+  dc->enabled = config.disk_dir != NULL;
+  if(!dc->enabled)
+  {
+    return;
+  }
+  snprintf(dc->dir, sizeof(dc->dir), "%s", config.disk_dir);
+  if(mkdir(dc->dir, 0755) < 0 && errno != EEXIST)
+  {
+    fprintf(stderr, "Error: cannot create disk cache directory %s: %s\n", dc->dir, strerror(errno));
+    exit(1);
+  }
+  if((dir = opendir(dc->dir)) == NULL)
+  {
+    fprintf(stderr, "Error: cannot open disk cache directory %s: %s\n", dc->dir, strerror(errno));
+    exit(1);
+  }
+  while((de = readdir(dir)) != NULL)
+  {
+    if(sscanf(de->d_name, "seg-%d.log", &id) == 1)
+    {
+      snprintf(path, sizeof(path), "%s/%s", dc->dir, de->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dir);
+
+  dc->budget = (size_t)config.disk_size << 20;
+  dc->nbuckets = DISK_INIT_BUCKETS;
+  dc->buckets = Calloc(dc->nbuckets, sizeof(disk_entry_t *));
+  dc->count = 0;
+  dc->bytes = 0;
+  dc->oldest = NULL;
+  dc->active = NULL;
+  dc->nsegments = 0;
+  dc->next_id = 0;
+  pthread_mutex_init(&dc->lock, NULL);
+  if(disk_segment_open(dc) == NULL)
+  {
+    fprintf(stderr, "Error: cannot create disk cache segment in %s: %s\n", dc->dir, strerror(errno));
+    exit(1);
+  }
+}
+
+/* 2차 캐시에서 uri를 찾음 : 있으면 세그먼트 참조를 잡아 반환하고 blob의 mmap 주소, 크기, 파일 오프셋을 알려 줌
+   다 보낸 뒤 disk_release로 반납 (그사이 GC가 세그먼트를 지워도 파일은 열려 있음) */
+disk_segment_t *disk_find(disk_cache_t *dc, char *uri, char **data, int *size, off_t *file_off, long *expires)
+{
+  int len;
+  unsigned long long hash;
+  disk_entry_t *e;
+  disk_segment_t *seg;
+
+  if(!dc->enabled)
+  {
+    return NULL;
+  }
+  hash = cache_hash(uri, &len);
+  pthread_mutex_lock(&dc->lock);
+  e = *disk_slot(dc, uri, hash, len);
+  if(e == NULL)
+  {
+    dc->misses += 1;
+    pthread_mutex_unlock(&dc->lock);
+    return NULL;
+  }
+  seg = e->seg;
+  __atomic_fetch_add(&seg->refs, 1, __ATOMIC_RELAXED);
+  e->hits += 1;
+  dc->hits += 1;
+  *file_off = e->off + sizeof(disk_record_t) + e->uri_len + 1;
+  *data = seg->map + *file_off;
+  *size = e->size;
+  *expires = e->expires;
+  pthread_mutex_unlock(&dc->lock);
+  return seg;
+}
+
+/* 세그먼트 참조 반납 : 목록에서 빠진 세그먼트의 마지막 참조면 mmap을 풀고 파일을 닫음 */
+void disk_release(disk_segment_t *seg)
+{
+  if(__atomic_sub_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    munmap(seg->map, DISK_SEGMENT_SIZE);
+    close(seg->fd);
+    Free(seg);
+  }
+}
+
+/* 메모리 캐시에서 축출된 항목을 활성 세그먼트 끝에 덧붙임
+   같은 uri의 같은 blob이 이미 있으면(디스크에서 올려 보냈다가 다시 축출된 경우) 쓰지 않고 만료 시각만 반영
+   활성 세그먼트가 가득 차면 새 세그먼트를 열고, 예산을 넘는 동안 가장 오래된 세그먼트를 GC */
+void disk_put(disk_cache_t *dc, char *uri, unsigned long long hash, int uri_len, char *data, int size, long expires)
+{
+  size_t need = DISK_RECORD_LEN(uri_len, size);
+  disk_entry_t *e;
+
+  pthread_mutex_lock(&dc->lock);
+  e = *disk_slot(dc, uri, hash, uri_len);
+  // 크기만 같고 본문이 바뀐 객체는 새로 씀 (304로 갱신된 만료 시각은 같은 객체일 때만 반영)
+  if(e != NULL && disk_same(e, data, size))
+  {
+    e->expires = expires;
+    dc->skipped += 1;
+    pthread_mutex_unlock(&dc->lock);
+    return;
+  }
+  if(dc->active->len + need > DISK_SEGMENT_SIZE)
+  {
+    // 새 세그먼트를 먼저 열어서 GC가 살릴 레코드를 그쪽으로 다시 쓸 수 있게 함
+    if(disk_segment_open(dc) == NULL)
+    {
+      pthread_mutex_unlock(&dc->lock);
+      return;
+    }
+    while(dc->nsegments > 1 && (size_t)dc->nsegments * DISK_SEGMENT_SIZE > dc->budget)
+    {
+      disk_gc(dc);
+    }
+  }
+  disk_append(dc, uri, hash, uri_len, data, size, expires);
+  dc->writes += 1;
+  pthread_mutex_unlock(&dc->lock);
+}
+
+/* 인덱스 항목이 가리키는 레코드의 blob이 data와 바이트 단위로 같은지 (디스크 락 안) */
+int disk_same(disk_entry_t *e, char *data, int size)
+{
+  return e->size == size && !memcmp(e->seg->map + e->off + sizeof(disk_record_t) + e->uri_len + 1, data, size);
+}
+
+/* 활성 세그먼트 끝에 레코드를 쓰고 인덱스 항목이 새 위치를 가리키게 함 (디스크 락 안, 자리는 호출한 쪽이 확인)
+   페이지는 MAP_SHARED로 매핑돼 있으므로 memcpy가 곧 페이지 캐시에 쓰는 것이고, 디스크로 내보내는 것은 커널에 맡김 */
+void disk_append(disk_cache_t *dc, char *uri, unsigned long long hash, int uri_len, char *data, int size, long expires)
+{
+  disk_segment_t *seg = dc->active;
+  disk_record_t *rec = (disk_record_t *)(seg->map + seg->len);
+  disk_entry_t **slot, *e;
+
+  rec->magic = DISK_MAGIC;
+  rec->uri_len = uri_len;
+  rec->size = size;
+  rec->reserved = 0;
+  rec->hash = hash;
+  rec->expires = expires;
+  memcpy((char *)(rec + 1), uri, uri_len + 1);
+  memcpy((char *)(rec + 1) + uri_len + 1, data, size);
+
+  slot = disk_slot(dc, uri, hash, uri_len);
+  e = *slot;
+  if(e == NULL)
+  {
+    e = Malloc(sizeof(disk_entry_t));
+    e->hash = hash;
+    e->uri_len = uri_len;
+    e->uri = Malloc(uri_len + 1);
+    memcpy(e->uri, uri, uri_len + 1);
+    e->next = *slot;
+    *slot = e;
+    dc->count += 1;
+  }
+  else
+  {
+    dc->bytes -= e->size; // 예전 레코드는 그대로 두고 (세그먼트째 GC될 때 사라짐) 인덱스만 옮김
+  }
+  e->seg = seg;
+  e->off = seg->len;
+  e->size = size;
+  e->hits = 0;
+  e->expires = expires;
+  dc->bytes += size;
+  seg->len += DISK_RECORD_LEN(uri_len, size);
+
+  if(dc->count >= dc->nbuckets)
+  {
+    disk_grow(dc);
+  }
+}
+
+/* uri가 들어 있는(없으면 들어갈) 버킷 체인의 칸 : 지문과 길이가 같을 때만 uri 전체를 비교 */
+disk_entry_t **disk_slot(disk_cache_t *dc, char *uri, unsigned long long hash, int len)
+{
+  disk_entry_t **pp = &dc->buckets[hash & (dc->nbuckets - 1)];
+
+  while(*pp != NULL && ((*pp)->hash != hash || (*pp)->uri_len != len || memcmp((*pp)->uri, uri, len)))
+  {
+    pp = &(*pp)->next;
+  }
+  return pp;
+}
+
+/* 인덱스 항목 수가 버킷 수를 넘으면 버킷을 두 배로 늘려 다시 나눔 */
+void disk_grow(disk_cache_t *dc)
+{
+  unsigned long n = dc->nbuckets * 2;
+  disk_entry_t **buckets = Calloc(n, sizeof(disk_entry_t *));
+
+  for(unsigned long i = 0; i < dc->nbuckets; i++)
+  {
+    disk_entry_t *e = dc->buckets[i];
+    while(e != NULL)
+    {
+      disk_entry_t *next = e->next;
+      e->next = buckets[e->hash & (n - 1)];
+      buckets[e->hash & (n - 1)] = e;
+      e = next;
+    }
+  }
+  Free(dc->buckets);
+  dc->buckets = buckets;
+  dc->nbuckets = n;
+}
+
+/* 새 세그먼트 파일을 만들어 목록 끝(활성)에 붙임 : 크기만 잡아 둔 sparse 파일이라 실제 디스크는 쓴 만큼만 씀 */
+disk_segment_t *disk_segment_open(disk_cache_t *dc)
+{
+  char path[MAXLINE * 2];
+  int fd;
+  char *map;
+  disk_segment_t *seg;
+
+  snprintf(path, sizeof(path), "%s/seg-%08d.log", dc->dir, dc->next_id);
+  if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+  {
+    return NULL;
+  }
+  if(ftruncate(fd, DISK_SEGMENT_SIZE) < 0 ||
+     (map = mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+  {
+    close(fd);
+    unlink(path);
+    return NULL;
+  }
+
+  seg = Malloc(sizeof(disk_segment_t));
+  seg->id = dc->next_id++;
+  seg->fd = fd;
+  seg->map = map;
+  seg->len = 0;
+  seg->refs = 1; // 목록이 잡고 있는 참조
+  seg->next = NULL;
+  if(dc->active != NULL)
+  {
+    dc->active->next = seg;
+  }
+  else
+  {
+    dc->oldest = seg;
+  }
+  dc->active = seg;
+  dc->nsegments += 1;
+  return seg;
+}
+
+/* 가장 오래된 세그먼트를 지움 (디스크 락 안)
+   레코드를 앞에서부터 훑어 인덱스가 아직 가리키는 것 중 그 자리에 쓴 뒤로 히트한 적이 있는 것은
+   활성 세그먼트로 다시 쓰고(세그먼트 절반까지), 나머지는 인덱스에서 뺌 */
+void disk_gc(disk_cache_t *dc)
+{
+  disk_segment_t *seg = dc->oldest;
+  size_t off = 0, rewritten = 0;
+  char path[MAXLINE * 2];
+
+  while(off < seg->len)
+  {
+    disk_record_t *rec = (disk_record_t *)(seg->map + off);
+    char *uri = (char *)(rec + 1);
+    size_t len = DISK_RECORD_LEN(rec->uri_len, rec->size);
+    disk_entry_t **slot = disk_slot(dc, uri, rec->hash, rec->uri_len);
+    disk_entry_t *e = *slot;
+
+    if(e != NULL && e->seg == seg && e->off == off)
+    {
+      if(e->hits > 0 && rewritten + len <= DISK_SEGMENT_SIZE / 2 && dc->active->len + len <= DISK_SEGMENT_SIZE)
+      {
+        disk_append(dc, uri, rec->hash, rec->uri_len, uri + rec->uri_len + 1, rec->size, e->expires);
+        rewritten += len;
+        dc->gc_rewrites += 1;
+      }
+      else
+      {
+        *slot = e->next;
+        dc->count -= 1;
+        dc->bytes -= e->size;
+        Free(e->uri);
+        Free(e);
+        dc->gc_dropped += 1;
+      }
+    }
+    off += len;
+  }
+
+  dc->oldest = seg->next;
+  dc->nsegments -= 1;
+  dc->gc_segments += 1;
+  // 파일 이름은 지금 지우고, 보내는 중인 요청이 있으면 파일 자체는 마지막 참조를 반납할 때 닫힘
+  snprintf(path, sizeof(path), "%s/seg-%08d.log", dc->dir, seg->id);
+  unlink(path);
+  disk_release(seg);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* 캐시 스냅샷 함수들 */
+
+/* 캐시 항목 전체를 스냅샷 파일로 씀 : 반환값은 쓴 항목 수 (실패하면 -1)
+   gzip 변형은 원본 히트에서 다시 만들 수 있고 디스크 / 스냅샷 히트에서는 찾지 않으므로 빼고 씀
+   샤드마다 읽기 락을 잡은 동안 참조만 잡아 두고, 파일에 쓰는 것은 락을 놓은 뒤에
+   임시 파일에 다 쓴 뒤 rename으로 바꾸므로 도중에 죽어도, 예전 스냅샷을 mmap한 채 돌고 있어도 온전한 파일만 보임 */
+int cache_save(cache_t *cache, char *path)
+{
+  char tmp[MAXLINE * 2];
+  FILE *fp;
+  snapshot_header_t hdr = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0 };
+  cache_entry_t **entries = NULL;
+  size_t n = 0, cap = 0;
+  unsigned long long off;
+  int ok = 1;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if((fp = fopen(tmp, "w")) == NULL)
+  {
+    return -1;
+  }
+
+  for(int i = 0; i < cache->nshards; i++)
+  {
+    cache_shard_t *shard = &cache->shards[i];
+    pthread_rwlock_rdlock(&shard->lock);
+    if(n + shard->count > cap)
+    {
+      cap = (n + shard->count) * 2;
+      entries = Realloc(entries, cap * sizeof(cache_entry_t *));
+    }
+    for(unsigned long b = 0; b < shard->nbuckets; b++)
+    {
+      for(cache_entry_t *e = shard->buckets[b]; e != NULL; e = e->next)
+      {
+        if(gzip_variant_key(e->uri, e->uri_len))
+        {
+          continue;
+        }
+        __atomic_fetch_add(&e->refs, 1, __ATOMIC_RELAXED);
+        entries[n++] = e;
+      }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+  }
+
+  // 헤더, 색인, 데이터 영역 순서 : 색인의 off는 데이터 영역에 쌓일 위치를 미리 계산
+  hdr.count = n;
+  ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+  off = sizeof(hdr) + n * sizeof(snapshot_index_t);
+  for(size_t i = 0; i < n && ok; i++)
+  {
+    snapshot_index_t idx = { entries[i]->hash, off, __atomic_load_n(&entries[i]->expires, __ATOMIC_RELAXED), entries[i]->uri_len, entries[i]->size };
+    ok = fwrite(&idx, sizeof(idx), 1, fp) == 1;
+    off += entries[i]->uri_len + 1 + entries[i]->size;
+  }
+  for(size_t i = 0; i < n; i++)
+  {
+    if(ok)
+    {
+      ok = fwrite(entries[i]->uri, entries[i]->uri_len + 1, 1, fp) == 1 &&
+           (entries[i]->size == 0 || fwrite(entries[i]->data, entries[i]->size, 1, fp) == 1);
+    }
+    cache_release(cache, entries[i]);
+  }
+  Free(entries);
+
+  if(fclose(fp) != 0 || !ok || rename(tmp, path) < 0)
+  {
+    unlink(tmp);
+    return -1;
+  }
+  return n;
+}
+
+/* 시작할 때 스냅샷을 mmap해서 캐시를 채움 : 반환값은 넣은 항목 수 (파일이 없거나 형식이 다르면 -1)
+   항목 헤더만 청크로 새로 만들고 uri와 본문은 매핑을 그대로 가리키므로, 읽어 들이는 동안 건드리는 것은 색인 페이지뿐이고
+   본문 페이지는 처음 히트할 때 읽힘 (lazy page-in) : 읽어 들인 항목이 모두 축출되거나 바뀌면 매핑을 풂 */
+int cache_load(cache_t *cache, char *path)
+{
+  int fd, cls, loaded = 0;
+  struct stat st;
+  char *map;
+  snapshot_header_t *hdr;
+  snapshot_index_t *idx;
+  snapshot_map_t *m;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+  {
+    return -1;
+  }
+  if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snapshot_header_t) ||
+     (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+  {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  hdr = (snapshot_header_t *)map;
+  if(hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION ||
+     hdr->count > (st.st_size - sizeof(snapshot_header_t)) / sizeof(snapshot_index_t))
+  {
+    fprintf(stderr, "Error: %s is not a cache snapshot\n", path);
+    munmap(map, st.st_size);
+    return -1;
+  }
+  idx = (snapshot_index_t *)(hdr + 1);
+  m = Malloc(sizeof(snapshot_map_t));
+  m->map = map;
+  m->len = st.st_size;
+  m->refs = 1; // 읽어 들이는 동안의 참조
+  for(unsigned long long i = 0; i < hdr->count; i++)
+  {
+    if(idx[i].size > MAX_OBJECT_SIZE || idx[i].uri_len >= MAXLINE ||
+       idx[i].off + idx[i].uri_len + 1 + idx[i].size > (unsigned long long)st.st_size)
+    {
+      continue;
+    }
+    cache_entry_t *e = slab_alloc(&cache->slab, sizeof(cache_entry_t), &cls);
+    e->hash = idx[i].hash;
+    e->uri_len = idx[i].uri_len;
+    e->uri = map + idx[i].off;
+    e->data = e->uri + e->uri_len + 1;
+    e->size = idx[i].size;
+    e->cls = cls;
+    e->refs = 1;
+    // 캐시 사용량은 청크 하나에 담았을 때와 같게 잡음
+    e->charge = cache->slab.chunk_size[slab_class(&cache->slab, sizeof(cache_entry_t) + e->uri_len + 1 + e->size)];
+    e->freq = 0;
+    e->list = 0;
+    e->expires = idx[i].expires;
+    e->refreshing = 0;
+    e->snapshot = m;
+    __atomic_fetch_add(&m->refs, 1, __ATOMIC_RELAXED);
+    cache_link(cache, cache_shard(cache, e->hash), e);
+    loaded++;
+  }
+  snapshot_release(m); // 캐시에 하나도 남지 않았으면 여기서 풂
+  return loaded;
+}
+
+/* 스냅샷 매핑 참조 반납 : 마지막이면 munmap */
+void snapshot_release(snapshot_map_t *m)
+{
+  if(__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    munmap(m->map, m->len);
+    Free(m);
+  }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* HTTP 캐시 신선도 함수들 */
+
+void freshness_init(freshness_t *f)
+{
+  f->status = 0;
+  f->date = -1;
+  f->expires = -1;
+  f->last_modified = -1;
+  f->age = -1;
+  f->max_age = -1;
+  f->s_maxage = -1;
+  f->no_store = 0;
+  f->no_cache = 0;
+  f->private = 0;
+  f->validator = 0;
+  f->vary_star = 0;
+  f->stale_while = -1;
+  f->stale_if_error = -1;
+  f->must_revalidate = 0;
+}
+
+/* 상태 라인 + 헤더(head부터 len바이트)에서 캐시 관련 헤더를 읽어 f에 반영 (이미 있는 값은 뒤에 읽은 헤더가 덮어씀) */
+void freshness_parse(char *head, int len, freshness_t *f)
+{
+  char line[MAXLINE], *p = head, *end, *v, *tok, *save;
+  size_t n;
+
+  if(len >= 5 && !strncmp(head, "HTTP/", 5))
+  {
+    sscanf(head, "%*s %d", &f->status);
+  }
+  while(p < head + len && (end = memmem(p, head + len - p, "\r\n", 2)) != NULL)
+  {
+    n = end - p;
+    if(n >= sizeof(line) || (v = memchr(p, ':', n)) == NULL)
+    {
+      p = end + 2;
+      continue;
+    }
+    memcpy(line, p, n);
+    line[n] = '\0';
+    v = line + (v - p) + 1;
+    while(*v == ' ' || *v == '\t')
+    {
+      v++;
+    }
+
+    if(!strncasecmp(line, "Cache-Control:", strlen("Cache-Control:")))
+    {
+      for(tok = strtok_r(v, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+      {
+        while(*tok == ' ' || *tok == '\t')
+        {
+          tok++;
+        }
+        if(!strncasecmp(tok, "no-store", 8))
+        {
+          f->no_store = 1;
+        }
+        else if(!strncasecmp(tok, "no-cache", 8))
+        {
+          f->no_cache = 1;
+        }
+        else if(!strncasecmp(tok, "private", 7))
+        {
+          f->private = 1;
+        }
+        else if(!strncasecmp(tok, "s-maxage=", 9))
+        {
+          f->s_maxage = atol(tok + 9);
+        }
+        else if(!strncasecmp(tok, "max-age=", 8))
+        {
+          f->max_age = atol(tok + 8);
+        }
+        else if(!strncasecmp(tok, "stale-while-revalidate=", 23))
+        {
+          f->stale_while = atol(tok + 23);
+        }
+        else if(!strncasecmp(tok, "stale-if-error=", 15))
+        {
+          f->stale_if_error = atol(tok + 15);
+        }
+        else if(!strncasecmp(tok, "must-revalidate", 15) || !strncasecmp(tok, "proxy-revalidate", 16))
+        {
+          f->must_revalidate = 1;
+        }
+      }
+    }
+    else if(!strncasecmp(line, "Pragma:", strlen("Pragma:")) && strcasestr(v, "no-cache"))
+    {
+      f->no_cache = 1;
+    }
+    else if(!strncasecmp(line, "Expires:", strlen("Expires:")))
+    {
+      // 날짜 형식이 아닌 값(예: "0")은 이미 만료된 것으로 봄
+      if(!http_date(v, &f->expires))
+      {
+        f->expires = 0;
+      }
+    }
+    else if(!strncasecmp(line, "Date:", strlen("Date:")))
+    {
+      http_date(v, &f->date);
+    }
+    else if(!strncasecmp(line, "Last-Modified:", strlen("Last-Modified:")))
+    {
+      http_date(v, &f->last_modified);
+      f->validator = 1;
+    }
+    else if(!strncasecmp(line, "ETag:", strlen("ETag:")))
+    {
+      f->validator = 1;
+    }
+    else if(!strncasecmp(line, "Age:", strlen("Age:")))
+    {
+      f->age = atol(v);
+    }
+    else if(!strncasecmp(line, "Vary:", strlen("Vary:")) && strchr(v, '*'))
+    {
+      // 다른 Vary 값은 그대로 캐시 : 프록시는 서버에 Host와 User-Agent만 보내므로 어느 클라이언트가 요청해도 같은 변형을 받음
+      f->vary_star = 1;
+    }
+    p = end + 2;
+  }
+}
+
+/* 응답을 now에 받았을 때 fresh로 볼 수 있는 마지막 시각 : 저장하면 안 되는 응답이면 -1
+   fresh 기간은 s-maxage > max-age > Expires - Date 순서, 셋 다 없으면 Last-Modified 나이의 10% (최대 cache_default_ttl)
+   이미 만료된 응답도 ETag / Last-Modified가 있으면 저장해 두고 다음 요청에서 재검증 */
+long freshness_expires(freshness_t *f, long now)
+{
+  long date, age, lifetime;
+
+  if(f->no_store || f->private || f->vary_star || f->status < 200 || f->status == 206 || f->status == 304)
+  {
+    return -1;
+  }
+  date = f->date >= 0 && f->date <= now ? f->date : now;
+  age = now - date;
+  if(f->age > age)
+  {
+    age = f->age;
+  }
+
+  if(f->s_maxage >= 0)
+  {
+    lifetime = f->s_maxage;
+  }
+  else if(f->max_age >= 0)
+  {
+    lifetime = f->max_age;
+  }
+  else if(f->expires >= 0)
+  {
+    lifetime = f->expires - date;
+  }
+  else if(!HTTP_HEURISTIC_STATUS(f->status))
+  {
+    return -1;
+  }
+  else
+  {
+    lifetime = config.cache_default_ttl;
+    if(f->last_modified >= 0 && f->last_modified <= date && (date - f->last_modified) / 10 < lifetime)
+    {
+      lifetime = (date - f->last_modified) / 10;
+    }
+  }
+  if(f->no_cache)
+  {
+    lifetime = 0;
+  }
+  if(lifetime <= age && !f->validator)
+  {
+    return -1; // 저장하자마자 만료인데 재검증할 방법도 없음
+  }
+  return now - age + lifetime;
+}
+
+/* 캐시 blob(상태 라인 + 헤더 + 본문)의 만료 시각 : 저장하면 안 되는 응답이면 -1 */
+long cache_expires(char *data, int size)
+{
+  freshness_t f;
+  char *end = memmem(data, size, "\r\n\r\n", 4);
+
+  if(end == NULL)
+  {
+    return -1;
+  }
+  freshness_init(&f);
+  freshness_parse(data, end + 2 - data, &f);
+  return freshness_expires(&f, time(NULL));
+}
+
+int cache_fresh(cache_entry_t *e)
+{
+  return __atomic_load_n(&e->expires, __ATOMIC_RELAXED) > time(NULL);
+}
+
+/* 재검증에 304를 받음 : 캐시된 헤더 위에 304의 헤더(Date, Cache-Control, Expires 등)를 덮어 만료 시각을 다시 계산
+   본문과 저장된 헤더는 그대로 두고 expires만 바꿈 (읽는 쪽은 락 없이 보므로 atomic) */
+void cache_refresh(cache_entry_t *e, char *head, int len)
+{
+  freshness_t f;
+  char *end = memmem(e->data, e->size, "\r\n\r\n", 4);
+  int status;
+  long now = time(NULL), expires;
+
+  freshness_init(&f);
+  if(end != NULL)
+  {
+    freshness_parse(e->data, end + 2 - e->data, &f);
+  }
+  status = f.status;
+  f.age = -1;  // 예전 Age는 새 Date 기준으로 의미가 없음
+  f.date = -1; // 예전 Date도 : 304에 Date가 없으면 지금 받은 것으로 봄 (남겨 두면 나이가 예전 그대로라 계속 만료 상태)
+  freshness_parse(head, len, &f);
+  f.status = status;
+  expires = freshness_expires(&f, now);
+  __atomic_store_n(&e->expires, expires < 0 ? now : expires, __ATOMIC_RELAXED);
+}
+
+/* blob 헤더에서 name 헤더의 값을 찾아 value에 복사 (앞뒤 공백 제외) : 없으면 0 */
+int http_header_value(char *data, int size, char *name, char *value, size_t cap)
+{
+  char *p, *end, *head_end = memmem(data, size, "\r\n\r\n", 4);
+  size_t name_len = strlen(name);
+
+  if(head_end == NULL || (p = memmem(data, head_end - data, "\r\n", 2)) == NULL)
+  {
+    return 0;
+  }
+  for(p += 2; p < head_end + 2; p = end + 2)
+  {
+    end = memmem(p, head_end + 2 - p, "\r\n", 2);
+    if(end - p > (long)name_len && !strncasecmp(p, name, name_len) && p[name_len] == ':')
+    {
+      char *v = p + name_len + 1;
+      while(v < end && (*v == ' ' || *v == '\t'))
+      {
+        v++;
+      }
+      if((size_t)(end - v) >= cap)
+      {
+        return 0;
+      }
+      memcpy(value, v, end - v);
+      value[end - v] = '\0';
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* HTTP 날짜(IMF-fixdate, RFC 850, asctime 형식)를 초로 : 형식이 틀리면 0 */
+int http_date(char *s, long *t)
+{
+  static const char *formats[] = { "%a, %d %b %Y %H:%M:%S", "%A, %d-%b-%y %H:%M:%S", "%a %b %e %H:%M:%S %Y" };
+  struct tm tm;
+
+  for(int i = 0; i < 3; i++)
+  {
+    memset(&tm, 0, sizeof(tm));
+    if(strptime(s, formats[i], &tm) != NULL)
+    {
+      *t = timegm(&tm);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* 재검증 요청 : 캐시된 응답의 ETag / Last-Modified로 If-None-Match / If-Modified-Since를 서버 요청 헤더 끝(빈 줄 앞)에 붙임 */
+void http_conditional(char *http_header, cache_entry_t *e)
+{
+  char value[MAXLINE];
+  size_t len = strlen(http_header) - 2; // 마지막 빈 줄
+
+  if(http_header_value(e->data, e->size, "ETag", value, sizeof(value)) &&
+     len + strlen("If-None-Match: \r\n") + strlen(value) + 2 < MAXLINE)
+  {
+    len += sprintf(http_header + len, "If-None-Match: %s\r\n", value);
+  }
+  if(http_header_value(e->data, e->size, "Last-Modified", value, sizeof(value)) &&
+     len + strlen("If-Modified-Since: \r\n") + strlen(value) + 2 < MAXLINE)
+  {
+    len += sprintf(http_header + len, "If-Modified-Since: %s\r\n", value);
+  }
+  strcpy(http_header + len, "\r\n");
+}
+
+/* 클라이언트가 캐시된 응답을 그대로 받지 않겠다고 했는지 (Cache-Control: no-cache / max-age=0, Pragma: no-cache) */
+int request_no_cache(char *headers)
+{
+  char *line = headers, *next;
+
+  while(*line)
+  {
+    next = strstr(line, "\r\n");
+    size_t len = next ? (size_t)(next - line) : strlen(line);
+    char value[MAXLINE];
+
+    snprintf(value, sizeof(value), "%.*s", (int)len, line);
+    if((!strncasecmp(value, "Cache-Control:", strlen("Cache-Control:")) && (strcasestr(value, "no-cache") || strcasestr(value, "max-age=0"))) ||
+       (!strncasecmp(value, "Pragma:", strlen("Pragma:")) && strcasestr(value, "no-cache")))
+    {
+      return 1;
+    }
+    if(next == NULL)
+    {
+      break;
+    }
+    line = next + 2;
+  }
+  return 0;
+}
+
+/* 만료된 캐시 항목을 재검증하지 않고(on_error = 0 : stale-while-revalidate) 또는 재검증이 실패했을 때(on_error = 1 : stale-if-error)
+   보내도 되는 마지막 시각 : 기간은 응답의 Cache-Control 값이 있으면 그것, 없으면 --stale-while-revalidate / --stale-if-error
+   must-revalidate, proxy-revalidate, no-cache가 있는 응답은 만료되면 항상 재검증해야 하므로 0 */
+long cache_stale_until(cache_entry_t *e, int on_error)
+{
+  freshness_t f;
+  char *end = memmem(e->data, e->size, "\r\n\r\n", 4);
+  long window;
+
+  if(end == NULL)
+  {
+    return 0;
+  }
+  freshness_init(&f);
+  freshness_parse(e->data, end + 2 - e->data, &f);
+  if(f.must_revalidate || f.no_cache)
+  {
+    return 0;
+  }
+  if(on_error)
+  {
+    window = f.stale_if_error >= 0 ? f.stale_if_error : config.stale_if_error;
+  }
+  else
+  {
+    window = f.stale_while >= 0 ? f.stale_while : config.stale_while_revalidate;
+  }
+  return __atomic_load_n(&e->expires, __ATOMIC_RELAXED) + window;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* stale-while-revalidate 백그라운드 갱신 함수들
+   만료된 항목을 받은 요청은 그대로 응답하고, 재검증은 refresh 스레드가 조건부 요청으로 대신 함 */
+
+void refresh_init(refresh_queue_t *rq)
+{
+  pthread_t tid;
+
+  rq->jobs = NULL;
+  pthread_mutex_init(&rq->lock, NULL);
+  pthread_cond_init(&rq->cond, NULL);
+  for(int i = 0; i < REFRESH_THREADS; i++)
+  {
+    Pthread_create(&tid, NULL, refresh_thread, rq);
+  }
+}
+
+/* 항목의 백그라운드 갱신을 큐에 넣음 : 이미 큐에 있거나 갱신 중이면 무시 (작업이 항목 참조를 하나 더 잡음) */
+void refresh_queue(refresh_queue_t *rq, cache_entry_t *e)
+{
+  if(__atomic_exchange_n(&e->refreshing, 1, __ATOMIC_ACQ_REL))
+  {
+    return;
+  }
+  __atomic_fetch_add(&e->refs, 1, __ATOMIC_RELAXED);
+
+  refresh_job_t *job = Malloc(sizeof(refresh_job_t));
+  job->e = e;
+  job->flight = NULL;
+  pthread_mutex_lock(&rq->lock);
+  job->next = rq->jobs;
+  rq->jobs = job;
+  pthread_cond_signal(&rq->cond);
+  pthread_mutex_unlock(&rq->lock);
+}
+
+/* 범위 미스 : uri의 전체 객체를 받아 캐시에 채우는 작업을 큐에 넣음
+   넣을 때 요청 합치기 리더가 되어 두므로 같은 uri를 이미 받아 오거나 채우는 중이면 무시하고,
+   채우는 동안 들어온 전체 요청은 이 작업에 따라붙음 */
+void refresh_fill(refresh_queue_t *rq, char *uri)
+{
+  int leader;
+  flight_t *flight = flight_join(&flights, uri, &leader);
+
+  if(!leader)
+  {
+    flight_release(&flights, flight);
+    return;
+  }
+
+  refresh_job_t *job = Malloc(sizeof(refresh_job_t));
+  job->e = NULL;
+  job->flight = flight;
+  pthread_mutex_lock(&rq->lock);
+  job->next = rq->jobs;
+  rq->jobs = job;
+  pthread_cond_signal(&rq->cond);
+  pthread_mutex_unlock(&rq->lock);
+}
+
+void* refresh_thread(void* rq_ptr)
+{
+  refresh_queue_t *rq = (refresh_queue_t *)rq_ptr;
+
+  Pthread_detach(pthread_self());
+  while(1)
+  {
+    pthread_mutex_lock(&rq->lock);
+    while(rq->jobs == NULL)
+    {
+      pthread_cond_wait(&rq->cond, &rq->lock);
+    }
+    refresh_job_t *job = rq->jobs;
+    rq->jobs = job->next;
+    pthread_mutex_unlock(&rq->lock);
+
+    if(job->e != NULL)
+    {
+      refresh_entry(job->e);
+      __atomic_store_n(&job->e->refreshing, 0, __ATOMIC_RELEASE);
+      cache_release(&cache, job->e);
+    }
+    else if(refresh_fetch(job->flight, NULL) == RELAY_OK)
+    {
+      __atomic_fetch_add(&cache.range_fills, 1, __ATOMIC_RELAXED);
+    }
+    Free(job);
+  }
+  return NULL;
+}
+
+/* 항목 하나를 조건부 요청으로 재검증 : 받을 클라이언트 없이 serve_request의 리더와 같은 경로로 가져옴
+   304면 relay_response가 만료 시각만 갱신하고, 새 응답이면 캐시에 다시 넣음
+   같은 uri를 이미 누가 받아 오는 중이면 그 결과가 캐시에 들어가므로 건너뜀
+   항목에는 정규화한 키만 남아 있으므로 서버에는 그 키(같은 객체를 가리키는 절대 URI)로 요청 */
+void refresh_entry(cache_entry_t *e)
+{
+  flight_t *flight;
+  int leader, rc;
+
+  flight = flight_join(&flights, e->uri, &leader);
+  if(!leader)
+  {
+    flight_release(&flights, flight);
+    return;
+  }
+
+  __atomic_fetch_add(&cache.revalidations, 1, __ATOMIC_RELAXED);
+  rc = refresh_fetch(flight, e);
+  if(rc == RELAY_NOT_MODIFIED)
+  {
+    __atomic_fetch_add(&cache.not_modified, 1, __ATOMIC_RELAXED);
+  }
+  if(rc == RELAY_OK || rc == RELAY_NOT_MODIFIED)
+  {
+    __atomic_fetch_add(&cache.refreshes, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* 리더로 잡아 둔 flight의 uri를 받을 클라이언트 없이 가져와 캐시에 넣고 flight를 끝냄 : 반환값은 fetch_origin과 같음
+   revalidate가 있으면 그 항목으로 조건부 요청 (304면 relay_response가 만료 시각만 갱신) */
+int refresh_fetch(flight_t *flight, cache_entry_t *revalidate)
+{
+  char uri[MAXLINE];
+  capture_t cap;
+  int keep_client = 0, rc, whole;
+
+  snprintf(uri, sizeof(uri), "%s", flight->uri); // parse_uri가 잠깐 고쳐 쓰는 동안 flight_join이 비교하지 않도록 복사
+  capture_init(&cap, flight->data, flight);
+  cap.client_ok = 0;
+  cap.revalidate = revalidate;
+  rc = fetch_origin(-1, uri, "", &keep_client, &cap);
+  whole = rc == RELAY_OK && (cap.on || cap.large != NULL);
+  if(rc == RELAY_OK)
+  {
+    capture_store(&cap, uri);
+  }
+  flight_finish(&flights, flight, whole);
+  return rc;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* 큰 객체 저장소 함수들
+   MAX_OBJECT_SIZE를 넘는 응답은 전달하면서 LARGE_PAGE_SIZE 페이지에 이어 담고, 끝까지 받으면 uri로 저장
+   객체 하나를 통째로 담을 연속 메모리가 필요 없고, 보낼 때도 페이지를 차례로 writev */
+
+void large_init(large_cache_t *lc)
+{
+  memset(lc, 0, sizeof(large_cache_t));
+  lc->enabled = config.large_cache_size > 0;
+  lc->budget = (size_t)config.large_cache_size << 20;
+  pthread_mutex_init(&lc->lock, NULL);
+}
+
+/* uri의 객체를 찾아 참조를 잡아 반환 (없으면 NULL) : 다 보낸 뒤 large_release로 반납 */
+large_object_t *large_find(large_cache_t *lc, char *uri)
+{
+  int len;
+  unsigned long long hash;
+  large_object_t *o;
+
+  if(!lc->enabled)
+  {
+    return NULL;
+  }
+  hash = cache_hash(uri, &len);
+  pthread_mutex_lock(&lc->lock);
+  for(o = lc->buckets[hash & (LARGE_BUCKETS - 1)]; o != NULL; o = o->next)
+  {
+    if(o->hash == hash && o->uri_len == len && !memcmp(o->uri, uri, len))
+    {
+      break;
+    }
+  }
+  if(o == NULL)
+  {
+    lc->misses += 1;
+    pthread_mutex_unlock(&lc->lock);
+    return NULL;
+  }
+
+  // LRU head로
+  if(lc->lru_head != o)
+  {
+    o->lru_prev->lru_next = o->lru_next;
+    if(o->lru_next != NULL)
+    {
+      o->lru_next->lru_prev = o->lru_prev;
+    }
+    else
+    {
+      lc->lru_tail = o->lru_prev;
+    }
+    o->lru_prev = NULL;
+    o->lru_next = lc->lru_head;
+    lc->lru_head->lru_prev = o;
+    lc->lru_head = o;
+  }
+  __atomic_fetch_add(&o->refs, 1, __ATOMIC_RELAXED);
+  lc->hits += 1;
+  pthread_mutex_unlock(&lc->lock);
+  return o;
+}
+
+/* 참조 반납 : 마지막 참조면 페이지까지 해제 */
+void large_release(large_object_t *o)
+{
+  if(__atomic_sub_fetch(&o->refs, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    large_page_t *p = o->pages;
+    while(p != NULL)
+    {
+      large_page_t *next = p->next;
+      Free(p);
+      p = next;
+    }
+    if(o->uri != NULL)
+    {
+      Free(o->uri);
+    }
+    Free(o);
+  }
+}
+
+/* size바이트 객체를 저장소에 담을 수 있는지 */
+int large_fits(large_cache_t *lc, size_t size)
+{
+  return lc->enabled && size <= lc->budget / LARGE_MAX_SHARE;
+}
+
+/* 채울 빈 객체 (저장소를 쓰지 않으면 NULL) : 채우는 쪽이 참조 하나를 잡고 있고, large_commit이 그 참조를 저장소로 넘김 */
+large_object_t *large_start(large_cache_t *lc)
+{
+  large_object_t *o;
+
+  if(!lc->enabled)
+  {
+    return NULL;
+  }
+  o = Calloc(1, sizeof(large_object_t));
+  o->refs = 1;
+  return o;
+}
+
+/* 객체 끝에 n바이트를 덧붙임 (마지막 페이지가 차면 새 페이지) : 객체 한도를 넘으면 -1 */
+int large_append(large_cache_t *lc, large_object_t *o, char *buf, size_t n)
+{
+  if(!large_fits(lc, o->size + n))
+  {
+    return -1;
+  }
+  while(n > 0)
+  {
+    if(o->tail == NULL || o->tail->len == LARGE_PAGE_SIZE)
+    {
+      large_page_t *p = Malloc(sizeof(large_page_t));
+      p->next = NULL;
+      p->len = 0;
+      if(o->tail != NULL)
+      {
+        o->tail->next = p;
+      }
+      else
+      {
+        o->pages = p;
+      }
+      o->tail = p;
+      o->npages += 1;
+    }
+    size_t m = LARGE_PAGE_SIZE - o->tail->len;
+    if(m > n)
+    {
+      m = n;
+    }
+    memcpy(o->tail->data + o->tail->len, buf, m);
+    o->tail->len += m;
+    o->size += m;
+    buf += m;
+    n -= m;
+  }
+  return 0;
+}
+
+/* 다 채운 객체를 uri로 저장 (호출한 쪽의 참조를 저장소가 넘겨받음)
+   저장하면 안 되는 응답이거나 헤더가 첫 페이지에 다 들어 있지 않으면 버림
+   같은 uri의 예전 객체는 빼고, 예산을 넘는 만큼 LRU tail부터 축출 */
+void large_commit(large_cache_t *lc, large_object_t *o, char *uri)
+{
+  long expires = o->pages != NULL ? cache_expires(o->pages->data, o->pages->len) : -1;
+  size_t charge = (size_t)o->npages * sizeof(large_page_t);
+  large_object_t *old;
+
+  if(expires < 0)
+  {
+    __atomic_fetch_add(&cache.uncacheable, 1, __ATOMIC_RELAXED);
+    large_release(o);
+    return;
+  }
+  o->expires = expires;
+  o->hash = cache_hash(uri, &o->uri_len);
+  o->uri = Malloc(o->uri_len + 1);
+  memcpy(o->uri, uri, o->uri_len + 1);
+
+  pthread_mutex_lock(&lc->lock);
+  for(old = lc->buckets[o->hash & (LARGE_BUCKETS - 1)]; old != NULL; old = old->next)
+  {
+    if(old->hash == o->hash && old->uri_len == o->uri_len && !memcmp(old->uri, uri, o->uri_len))
+    {
+      large_unlink(lc, old);
+      break;
+    }
+  }
+  while(lc->lru_tail != NULL && lc->bytes + charge > lc->budget)
+  {
+    large_unlink(lc, lc->lru_tail);
+    lc->evictions += 1;
+  }
+
+  o->next = lc->buckets[o->hash & (LARGE_BUCKETS - 1)];
+  lc->buckets[o->hash & (LARGE_BUCKETS - 1)] = o;
+  o->lru_prev = NULL;
+  o->lru_next = lc->lru_head;
+  if(lc->lru_head != NULL)
+  {
+    lc->lru_head->lru_prev = o;
+  }
+  else
+  {
+    lc->lru_tail = o;
+  }
+  lc->lru_head = o;
+  lc->bytes += charge;
+  lc->count += 1;
+  lc->fills += 1;
+  pthread_mutex_unlock(&lc->lock);
+}
 
-int main(int argc, char **argv)
+/* 객체를 버킷 체인과 LRU에서 빼고 저장소의 참조를 반납 (저장소 락 안) : 보내는 중인 요청이 있으면 해제는 그쪽이 반납할 때 */
+void large_unlink(large_cache_t *lc, large_object_t *o)
 {
-  int listen_fd;
-  char hostname[MAXLINE], port[MAXLINE];
-  socklen_t client_len;
-  struct sockaddr_storage client_addr;
-  pthread_t tid;
+  large_object_t **pp = &lc->buckets[o->hash & (LARGE_BUCKETS - 1)];
 
-  // 인자 개수가 알맞게 안 들어왔으면, 에러를 출력하고 종료
-  if(argc != 2)
+  while(*pp != o)
   {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
-    exit(1);
+    pp = &(*pp)->next;
+  }
+  *pp = o->next;
+  if(o->lru_prev != NULL)
+  {
+    o->lru_prev->lru_next = o->lru_next;
+  }
+  else
+  {
+    lc->lru_head = o->lru_next;
+  }
+  if(o->lru_next != NULL)
+  {
+    o->lru_next->lru_prev = o->lru_prev;
+  }
+  else
+  {
+    lc->lru_tail = o->lru_prev;
   }
+  lc->bytes -= (size_t)o->npages * sizeof(large_page_t);
+  lc->count -= 1;
+  large_release(o);
+}
 
-  // 캐시 초기화
-  cache_init(&cache);
+/* 큰 객체를 페이지 체인 그대로 전송 : 첫 페이지(헤더 포함)는 send_cached로 Connection 헤더를 붙여 보내고, 나머지 페이지는 여러 장씩 writev
+   반환값은 send_cached와 같음 */
+int send_large(int fd, large_object_t *o, int keep_client)
+{
+  struct iovec iov[16];
+  int cnt = 0;
 
-  listen_fd = Open_listenfd(argv[1]);
-  while(1)
+  keep_client = send_cached(fd, o->pages->data, o->pages->len, -1, 0, keep_client);
+  for(large_page_t *p = o->pages->next; p != NULL; p = p->next)
   {
-    client_len = sizeof(client_addr);
-    int* connection_fd = Malloc(sizeof(int)); // 클라이언트와 연결된 소켓의 파일 디스크립터를 저장할 포인터 : 매 스레드마다 독립적인 메모리 공간 사용
+    iov[cnt].iov_base = p->data;
+    iov[cnt].iov_len = p->len;
+    cnt++;
+    if(cnt == 16 || p->next == NULL)
+    {
+      if(writev_all(fd, iov, cnt) < 0)
+      {
+        return 0;
+      }
+      cnt = 0;
+    }
+  }
+  return keep_client;
+}
+
+/* 캐시 blob을 앞에서부터 또는 범위로 잘라 읽을 수 있게 묶음 : 큰 객체면 페이지 체인 (o가 NULL이면 data부터 size바이트가 이어져 있음) */
+void blob_init(blob_t *b, char *data, int size, large_object_t *o)
+{
+  b->pages = o != NULL ? o->pages : NULL;
+  b->data = o != NULL ? o->pages->data : data;
+  b->len = o != NULL ? (size_t)o->pages->len : (size_t)size;
+  b->size = o != NULL ? o->size : (size_t)size;
+}
 
-    if(connection_fd == NULL)
+/* blob의 off부터 len바이트를 fd로 씀 (페이지 체인이면 페이지마다 나눠서) : 실패하면 -1 */
+int blob_write(int fd, blob_t *b, size_t off, size_t len)
+{
+  if(b->pages == NULL)
+  {
+    return rio_writen(fd, b->data + off, len) == (ssize_t)len ? 0 : -1;
+  }
+  for(large_page_t *p = b->pages; p != NULL && len > 0; p = p->next)
+  {
+    if(off >= (size_t)p->len)
     {
-      fprintf(stderr, "Error: Unable to allocate memory for connection_fd\n");
+      off -= p->len;
       continue;
     }
+    size_t n = p->len - off < len ? p->len - off : len;
+    if(rio_writen(fd, p->data + off, n) != (ssize_t)n)
+    {
+      return -1;
+    }
+    off = 0;
+    len -= n;
+  }
+  return len == 0 ? 0 : -1;
+}
 
-    *connection_fd = Accept(listen_fd, (SA *)(&client_addr), &client_len);
-    Getnameinfo((SA *)(&client_addr), client_len, hostname, MAXLINE, port, MAXLINE, 0);
+// ---------------------------------------------------------------------------------------------------------
+/* Range 요청 함수들
+   서버에는 Range를 보내지 않고 전체 응답을 받아 저장해 두었다가, 캐시 히트에서 요청한 범위만 잘라 206으로 보냄
+   캐시에 없는 Range 요청은 범위를 서버에서 바로 받아 전달하고, 전체 객체는 refresh 스레드가 채움 */
 
-    printf("Accepted connection from (%s, %s)\n", hostname, port);
+/* 요청 헤더(요청 라인 다음부터)에서 name 헤더의 값을 찾아 value에 복사 (앞 공백 제외) : 없으면 0 */
+int request_header_value(char *headers, char *name, char *value, size_t cap)
+{
+  char *line = headers, *next, *v;
+  size_t name_len = strlen(name), len;
 
-    Pthread_create(&tid, NULL, thread, connection_fd);
-    // doit(connection_fd);
-    // Close(connection_fd);
+  while(*line)
+  {
+    next = strstr(line, "\r\n");
+    len = next ? (size_t)(next - line) : strlen(line);
+    if(len == 0)
+    {
+      break; // 빈 줄 : 헤더 끝
+    }
+    if(len > name_len && !strncasecmp(line, name, name_len) && line[name_len] == ':')
+    {
+      v = line + name_len + 1;
+      while(v < line + len && (*v == ' ' || *v == '\t'))
+      {
+        v++;
+      }
+      if((size_t)(line + len - v) >= cap)
+      {
+        return 0;
+      }
+      memcpy(value, v, line + len - v);
+      value[line + len - v] = '\0';
+      return 1;
+    }
+    if(next == NULL)
+    {
+      break;
+    }
+    line = next + 2;
   }
-
-  // printf("%s", user_agent_hdr);
   return 0;
 }
 
-/* fd(= connect_fd) : 클라이언트와 연결된 소켓의 파일 디스크립터 */
-void doit(int fd)
+/* 요청에 Range 헤더가 있는지 */
+int request_range(char *headers)
 {
-  char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-  char hostname[MAXLINE], path[MAXLINE], http_header[MAXLINE];
-  int port; // 서버의 포트 번호
-  char port_ch[10]; // port를 문자열로 저장한 변수
-  rio_t rio; // 클라이언트와의 통신을 위한 I/O 구조체
-  rio_t server_rio; // 서버와의 통신을 위한 I/O 구조체
-  int server_fd; // 프록시가 웹 서버와 연결할 때 사용하는 소켓의 파일 디스크립터
+  char value[MAXLINE];
 
-  // 캐시 버퍼 & 크기
-  char cache_data_buffer[MAX_OBJECT_SIZE];
-  int cache_data_size = 0;
+  return request_header_value(headers, "Range", value, sizeof(value));
+}
 
-  Rio_readinitb(&rio, fd);
-  Rio_readlineb(&rio, buf, MAXLINE);
-  printf("Request headers:\n");
-  printf("%s", buf);
-  sscanf(buf, "%s %s %s", method, uri, version);
+/* Range 값(bytes=a-b, a-, -n를 쉼표로 나열)을 본문 크기 size에 맞춰 r에 풂
+   반환값 : 만족할 수 있는 범위 수, 형식이 틀렸거나 bytes가 아니거나 RANGE_MAX개를 넘으면 0 (Range를 무시하고 전체),
+   만족할 수 있는 범위가 하나도 없으면 -1 (416) */
+int range_parse(char *value, long size, range_t *r)
+{
+  char buf[MAXLINE], *tok, *save, *dash, *endp, *tail;
+  int n = 0, specs = 0;
+  long a, b;
 
-  /* 캐시에서 먼저 찾기 */
-  if(cache_find(&cache, uri, cache_data_buffer, &cache_data_size))
+  if(strncasecmp(value, "bytes=", 6))
   {
-    // 캐시 히트
-    Rio_writen(fd, cache_data_buffer, cache_data_size);
-    return;
+    return 0;
   }
-  
-  /* 캐시 미스 -> 서버에 요청 전달해서 응답 받아오기 */
-  parse_uri(uri, hostname, path, &port);
-  makeHttpHeader(http_header, hostname, path, port, &rio);
-  sprintf(port_ch, "%d", port); // port를 문자열로 변환해 저장
+  snprintf(buf, sizeof(buf), "%s", value + 6);
+  for(tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+  {
+    while(*tok == ' ' || *tok == '\t')
+    {
+      tok++;
+    }
+    tail = tok + strlen(tok);
+    while(tail > tok && (tail[-1] == ' ' || tail[-1] == '\t'))
+    {
+      *--tail = '\0';
+    }
+    if(*tok == '\0')
+    {
+      continue;
+    }
+    if((dash = strchr(tok, '-')) == NULL)
+    {
+      return 0;
+    }
+    specs++;
+    if(dash == tok)
+    {
+      // -n : 마지막 n바이트
+      b = strtol(dash + 1, &endp, 10);
+      if(endp == dash + 1 || *endp != '\0' || b < 0)
+      {
+        return 0;
+      }
+      if(b == 0 || size == 0)
+      {
+        continue;
+      }
+      a = size > b ? size - b : 0;
+      b = size - 1;
+    }
+    else
+    {
+      a = strtol(tok, &endp, 10);
+      if(endp != dash || a < 0)
+      {
+        return 0;
+      }
+      if(dash[1] == '\0')
+      {
+        b = size - 1; // a- : 끝까지
+      }
+      else
+      {
+        b = strtol(dash + 1, &endp, 10);
+        if(*endp != '\0' || b < a)
+        {
+          return 0;
+        }
+        if(b >= size)
+        {
+          b = size - 1;
+        }
+      }
+      if(a >= size)
+      {
+        continue;
+      }
+    }
+    if(n == RANGE_MAX)
+    {
+      return 0;
+    }
+    r[n].start = a;
+    r[n].end = b;
+    n++;
+  }
+  if(specs == 0)
+  {
+    return 0;
+  }
+  return n > 0 ? n : -1;
+}
 
-  /* 서버와 연결 후, 재구성한 HTTP 헤더를 서버에 전송 */
-  server_fd = Open_clientfd(hostname, port_ch);
-  if(server_fd < 0)
+/* blob의 off부터 len바이트를 dst로 복사 */
+void blob_copy(blob_t *b, size_t off, size_t len, char *dst)
+{
+  if(b->pages == NULL)
   {
-    fprintf(stderr, "Error: Unable to connect to server\n");
+    memcpy(dst, b->data + off, len);
     return;
   }
-  Rio_readinitb(&server_rio, server_fd);
-  Rio_writen(server_fd, http_header, strlen(http_header)); // 재구성한 요청 헤더를 서버로 전송
-
-  size_t temp = rio_readlineb(&server_rio, buf, MAXLINE);
-  /* 서버 응답을 클라이언트에 전송하고 캐시에 저장 */
-  while(temp != 0)
+  for(large_page_t *p = b->pages; p != NULL && len > 0; p = p->next)
   {
-    Rio_writen(fd, buf, temp);
-
-    // 캐시 버퍼에 응답 저장
-    if(cache_data_size + temp <= MAX_OBJECT_SIZE)
+    if(off >= (size_t)p->len)
     {
-      memcpy(cache_data_buffer + cache_data_size, buf, temp);
-      cache_data_size += temp;
+      off -= p->len;
+      continue;
     }
-
-    temp = rio_readlineb(&server_rio, buf, MAXLINE);
-  }
-
-  /* 캐시 저장 */
-  if(cache_data_size <= MAX_OBJECT_SIZE)
-  {
-    cache_insert(&cache, uri, cache_data_buffer, cache_data_size);
+    size_t n = p->len - off < len ? p->len - off : len;
+    memcpy(dst, p->data + off, n);
+    dst += n;
+    off = 0;
+    len -= n;
   }
+}
 
-  /* 연결 종료 */
-  Close(server_fd);
+/* 응답 조각 하나를 계획 끝에 붙임 : text가 NULL이면 blob의 off부터 len바이트 */
+void range_add(range_plan_t *p, char *text, size_t off, size_t len)
+{
+  p->pieces[p->npieces].text = text;
+  p->pieces[p->npieces].off = off;
+  p->pieces[p->npieces].len = len;
+  p->npieces++;
+  p->total += len;
 }
 
-/* URI를 파싱해 호스트명, 경로, 포트 번호를 추출하고 대입 */
-int parse_uri(char* uri, char* hostname, char* path, int* port)
+/* 캐시된 응답 blob에서 요청의 Range만 잘라 보낼 계획을 세움 : 잘라 보낼 수 없으면 0 (전체를 그대로 보냄)
+   Range가 없거나, 캐시된 응답이 Content-Length가 맞는 200이 아니거나, If-Range가 캐시된 ETag / Last-Modified와 다르면 0
+   범위 하나면 원래 헤더에 Content-Range를 붙인 206, 여러 개면 multipart/byteranges, 만족할 수 없는 범위뿐이면 416
+   캐시에는 hop-by-hop 헤더를 빼고 저장하므로 Connection 헤더도 여기서 붙임 (p->text는 다 보낸 뒤 Free) */
+int range_plan(range_plan_t *p, blob_t *b, char *headers, int keep_client)
 {
-  // default 설정 : 80 포트, 루트 경로 사용
-  *port = 80;
-  strcpy(path, "/");
+  response_info_t info = { 0, -1, 0, 0 };
+  range_t r[RANGE_MAX];
+  char line[MAXLINE], value[MAXLINE], validator[MAXLINE], content_type[MAXLINE] = "", boundary[32];
+  char *head_end, *s, *end, *t, *parts;
+  char *connection = keep_client ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+  long body_off, body_size;
+  size_t len, part_len[RANGE_MAX], body_len;
+  int n;
 
-  char* hostname_idx = strstr(uri, "//");
-  if(hostname_idx != NULL)
+  if(!request_header_value(headers, "Range", value, sizeof(value)) ||
+     (head_end = memmem(b->data, b->len, "\r\n\r\n", 4)) == NULL)
   {
-    hostname_idx = hostname_idx + 2;
+    return 0;
   }
-  else
+  head_end += 2; // 마지막 헤더 줄의 CRLF까지
+  body_off = head_end + 2 - b->data;
+  body_size = b->size - body_off;
+  sscanf(b->data, "%*s %d", &info.status);
+  for(s = strstr(b->data, "\r\n") + 2; s < head_end; s = end + 2)
   {
-    hostname_idx = uri;
+    end = memmem(s, head_end - s, "\r\n", 2);
+    snprintf(line, sizeof(line), "%.*s", (int)(end - s + 2), s);
+    response_header(line, &info);
+    if(!strncasecmp(line, "Content-Type:", strlen("Content-Type:")))
+    {
+      snprintf(content_type, sizeof(content_type), "%.*s", (int)(end - s), s);
+    }
+  }
+  if(info.status != 200 || info.chunked || info.content_length != body_size)
+  {
+    return 0;
+  }
+  n = range_parse(value, body_size, r);
+  if(n == 0)
+  {
+    return 0;
+  }
+  // If-Range : 캐시된 응답이 클라이언트가 가진 것과 같을 때만 범위로 (약한 ETag는 비교하지 않음)
+  if(request_header_value(headers, "If-Range", value, sizeof(value)) &&
+     !(value[0] == '"' && http_header_value(b->data, b->len, "ETag", validator, sizeof(validator)) && !strcmp(value, validator)) &&
+     !(value[0] != '"' && value[0] != 'W' && http_header_value(b->data, b->len, "Last-Modified", validator, sizeof(validator)) && !strcmp(value, validator)))
+  {
+    return 0;
   }
 
-  char* port_idx = strstr(hostname_idx, ":");
-  char* path_idx = strstr(hostname_idx, "/");
-  
-  // 포트 번호가 있는 경우
-  if(port_idx != NULL && (path_idx == NULL || port_idx < path_idx))
+  __atomic_fetch_add(&cache.range_hits, 1, __ATOMIC_RELAXED);
+  p->npieces = 0;
+  p->total = 0;
+  p->text = Malloc((head_end - b->data) + 512 + (n > 0 ? n : 0) * (strlen(content_type) + 128));
+  t = p->text;
+  if(n < 0)
   {
-    // hostname 추출
-    *port_idx = '\0';
-    strcpy(hostname, hostname_idx);
-    *port_idx = ':';
-    
-    // 포트 번호 추출
-    port_idx++;
-    char* port_end_idx = strstr(port_idx, "/");
-    // 포트 번호 뒤에 "/"가 있는 경우
-    if(port_end_idx != NULL)
+    len = sprintf(t, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%ld\r\nContent-Length: 0\r\n%s\r\n", body_size, connection);
+    range_add(p, t, 0, len);
+    return 1;
+  }
+
+  // 상태 라인 + 원래 헤더 (길이와 범위는 새로 쓰고, 여러 범위면 Content-Type은 부분마다 옮김)
+  len = sprintf(t, "HTTP/1.1 206 Partial Content\r\n");
+  for(s = strstr(b->data, "\r\n") + 2; s < head_end; s = end + 2)
+  {
+    end = memmem(s, head_end - s, "\r\n", 2);
+    if(!strncasecmp(s, "Content-Length:", strlen("Content-Length:")) || !strncasecmp(s, "Content-Range:", strlen("Content-Range:")) ||
+       (n > 1 && !strncasecmp(s, "Content-Type:", strlen("Content-Type:"))))
     {
-      *port_end_idx = '\0';
-      *port = atoi(port_idx);
-      *port_end_idx = '/';
-      strcpy(path, port_end_idx);
+      continue;
     }
-    else
+    memcpy(t + len, s, end + 2 - s);
+    len += end + 2 - s;
+  }
+  if(n == 1)
+  {
+    len += sprintf(t + len, "Content-Range: bytes %ld-%ld/%ld\r\nContent-Length: %ld\r\n%s\r\n",
+                   r[0].start, r[0].end, body_size, r[0].end - r[0].start + 1, connection);
+    range_add(p, t, 0, len);
+    range_add(p, NULL, body_off + r[0].start, r[0].end - r[0].start + 1);
+    return 1;
+  }
+
+  // multipart/byteranges : 본문 길이를 헤더에 먼저 써야 하므로 부분 헤더들을 헤더 끝 자리(160바이트) 뒤에 먼저 만들어 둠
+  sprintf(boundary, "%016lx", (unsigned long)now_ns());
+  parts = s = t + len + 160;
+  body_len = 0;
+  for(int i = 0; i < n; i++)
+  {
+    part_len[i] = sprintf(s, "\r\n--%s\r\n%s%sContent-Range: bytes %ld-%ld/%ld\r\n\r\n", boundary,
+                          content_type, content_type[0] ? "\r\n" : "", r[i].start, r[i].end, body_size);
+    body_len += part_len[i] + r[i].end - r[i].start + 1;
+    s += part_len[i];
+  }
+  body_len += sprintf(s, "\r\n--%s--\r\n", boundary);
+  len += sprintf(t + len, "Content-Type: multipart/byteranges; boundary=%s\r\nContent-Length: %zu\r\n%s\r\n",
+                 boundary, body_len, connection);
+  range_add(p, t, 0, len);
+  s = parts;
+  for(int i = 0; i < n; i++)
+  {
+    range_add(p, s, 0, part_len[i]);
+    range_add(p, NULL, body_off + r[i].start, r[i].end - r[i].start + 1);
+    s += part_len[i];
+  }
+  range_add(p, s, 0, strlen(s));
+  return 1;
+}
+
+/* 계획대로 조각들을 차례로 보냄 : 실패하면 -1 */
+int range_send(int fd, range_plan_t *p, blob_t *b)
+{
+  for(int i = 0; i < p->npieces; i++)
+  {
+    range_piece_t *c = &p->pieces[i];
+    if(c->text != NULL ? rio_writen(fd, c->text, c->len) != (ssize_t)c->len : blob_write(fd, b, c->off, c->len) < 0)
     {
-      // 포트 번호는 있지만 경로가 없는 경우
-      *port = atoi(port_idx);
-      strcpy(path, "/");
+      return -1;
     }
   }
-  // 포트 번호가 없는 경우
-  else
+  return 0;
+}
+
+/* 계획한 응답 전체를 한 버퍼로 (epoll 모드는 논블로킹으로 나눠 쓰므로 미리 만들어 둠) : 다 쓴 뒤 Free */
+char *range_flatten(range_plan_t *p, blob_t *b)
+{
+  char *buf = Malloc(p->total > 0 ? p->total : 1), *d = buf;
+
+  for(int i = 0; i < p->npieces; i++)
   {
-    // 경로는 있는 경우
-    if(path_idx != NULL)
+    range_piece_t *c = &p->pieces[i];
+    if(c->text != NULL)
     {
-      // hostname 추출
-      *path_idx = '\0';
-      strcpy(hostname, hostname_idx);
-      *path_idx = '/';
-      strcpy(path, path_idx);
+      memcpy(d, c->text, c->len);
     }
     else
     {
-      // 경로도 없는 경우
-      strcpy(hostname, hostname_idx);
-      strcpy(path, "/");
+      blob_copy(b, c->off, c->len, d);
     }
+    d += c->len;
   }
-
-  return 0;
+  return buf;
 }
 
-/* 프록시에서 웹 서버로 전달할 HTTP 헤더를 생성(재구성) */
-void makeHttpHeader(char* http_header, char* hostname, char* path, int port, rio_t* client_rio)
+/* 캐시 히트 응답 : gzip을 받는 클라이언트면 gzip 변형, Range를 잘라 보낼 수 있으면 206 / 416,
+   아니면 큰 객체는 send_large, 나머지는 send_cached (key가 NULL이면 gzip 변형을 찾지 않음)
+   반환값은 send_cached와 같음 */
+int send_hit(int fd, char *key, char *data, int size, long expires, large_object_t *o, int file_fd, off_t file_off, char *headers, int keep_client)
 {
-  char buf[MAXLINE], request_header[MAXLINE], other_header[MAXLINE], host_header[MAXLINE];
+  blob_t b;
+  range_plan_t plan;
+  gzip_variant_t v;
+  int ok;
 
-  // 요청 라인 생성
-  sprintf(request_header, "GET %s HTTP/1.0\r\n", path);
+  if(o == NULL && gzip_variant(&v, key, data, size, expires, headers))
+  {
+    keep_client = send_cached(fd, v.data, v.size, -1, 0, keep_client);
+    gzip_variant_release(&v);
+    return keep_client;
+  }
+  blob_init(&b, data, size, o);
+  if(range_plan(&plan, &b, headers, keep_client))
+  {
+    ok = range_send(fd, &plan, &b) == 0;
+    Free(plan.text);
+    return ok && keep_client;
+  }
+  if(o != NULL)
+  {
+    return send_large(fd, o, keep_client);
+  }
+  return send_cached(fd, data, size, file_fd, file_off, keep_client);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+/* gzip 압축 함수들
+   서버에는 Accept-Encoding을 보내지 않으므로 캐시에는 늘 압축하지 않은 응답이 들어 있음
+   gzip을 받는 클라이언트가 압축할 만한 응답을 히트하면 한 번만 압축해서 "키 + GZIP_KEY_SUFFIX"로 옆에 저장해 두고 같이 씀 */
+
+/* 클라이언트가 gzip을 받겠다고 했는지 (Accept-Encoding에 q=0이 아닌 gzip) */
+int request_accepts_gzip(char *headers)
+{
+  char value[MAXLINE], *tok, *save, *q;
 
-  // 클라이언트 헤더를 파싱하고 복사 
-  while(rio_readlineb(client_rio, buf, MAXLINE) > 0)
+  if(!request_header_value(headers, "Accept-Encoding", value, sizeof(value)))
   {
-    // 빈 텍스트 라인 : 종료
-    if(strcmp(buf, "\r\n") == 0)
+    return 0;
+  }
+  for(tok = strtok_r(value, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+  {
+    while(*tok == ' ' || *tok == '\t')
     {
-      break;
+      tok++;
     }
-
-    // Host 헤더는 host_header에 복사
-    if(!(strncasecmp(buf, "Host", strlen("Host"))))
+    if(strncasecmp(tok, "gzip", 4) || (tok[4] != '\0' && tok[4] != ';' && tok[4] != ' '))
     {
-      strcpy(host_header, buf);
       continue;
     }
-
-    // Connection, Proxy-Connection, User-Agent 헤더는 other_header에 복사
-    if(!(strncasecmp(buf, "Connection", strlen("Connection"))) || !(strncasecmp(buf, "Proxy-Connection", strlen("Proxy-Connection"))) || !(strncasecmp(buf, "User-Agent", strlen("User-Agent"))))
-    {
-      strcat(other_header, buf);
-    }
+    q = strstr(tok, "q=");
+    return q == NULL || atof(q + 2) > 0;
   }
+  return 0;
+}
 
-  // Host 헤더가 없는 경우 기본값 설정
-  if(!strlen(host_header))
-  {
-    snprintf(host_header, sizeof(host_header), "Host: %s\r\n", hostname);
-  }
-  
-  // 마지막에 헤더 조립
-  snprintf(http_header, MAXLINE, "%s%s%s%s%s%s%s", request_header, host_header, "Connection: close\r\n", "Proxy-Connection: close\r\n", user_agent_hdr, other_header, "\r\n");
+/* gzip 변형의 캐시 키인지 : 변형은 메모리 캐시에만 두고 디스크로 내려 보내거나 스냅샷에 쓰지 않음 */
+int gzip_variant_key(char *uri, int uri_len)
+{
+  int suffix_len = strlen(GZIP_KEY_SUFFIX);
 
-  return;
+  return uri_len > suffix_len && !memcmp(uri + uri_len - suffix_len, GZIP_KEY_SUFFIX, suffix_len);
 }
 
-/* 스레드 함수 */
-void* thread(void* connection_fd_ptr)
+/* 압축할 만한 응답인지 : Content-Length가 맞는 200이고, 이미 인코딩되지 않았고, 본문이 gzip_min_size 이상인 텍스트 계열
+   맞으면 본문 시작 위치, 아니면 -1 */
+int gzip_compressible(char *data, int size)
 {
-  int connection_fd = (*(int *)connection_fd_ptr);
-  
-  Pthread_detach(pthread_self()); // 스레드 분리 -> 자신의 메모리 자원들이 종료 후 반환될 수 있도록
-  Free(connection_fd_ptr); // 동적 할당된 메모리 해제
-  doit(connection_fd);
-  Close(connection_fd);
-  return NULL;
+  static const char *types[] = { "text/", "application/javascript", "application/json", "application/xml", "image/svg+xml", "+xml", "+json" };
+  response_info_t info = { 0, -1, 0, 0 };
+  char line[MAXLINE], value[MAXLINE];
+  char *p, *end, *header_end = memmem(data, size, "\r\n\r\n", 4);
+  int body_off, type_ok = 0;
+
+  if(header_end == NULL || http_header_value(data, size, "Content-Encoding", value, sizeof(value)) ||
+     !http_header_value(data, size, "Content-Type", value, sizeof(value)))
+  {
+    return -1;
+  }
+  body_off = header_end + 4 - data;
+  sscanf(data, "%*s %d", &info.status);
+  for(p = strstr(data, "\r\n") + 2; p < header_end + 2; p = end + 2)
+  {
+    end = memmem(p, header_end + 2 - p, "\r\n", 2);
+    snprintf(line, sizeof(line), "%.*s", (int)(end - p + 2), p);
+    response_header(line, &info);
+  }
+  for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+  {
+    type_ok |= strcasestr(value, types[i]) != NULL;
+  }
+  if(!type_ok || info.status != 200 || info.chunked || info.content_length != size - body_off ||
+     info.content_length < config.gzip_min_size)
+  {
+    return -1;
+  }
+  return body_off;
 }
 
-// ---------------------------------------------------------------------------------------------------------
-/* 캐싱 프록시 함수들 */
-void cache_init(cache_t *cache)
+/* 압축하지 않은 채로 보내는 응답에 붙일 헤더 : gzip 변형이 있을 수 있는 응답이면 "Vary: Accept-Encoding\r\n", 아니면 ""
+   (이미 Vary에 Accept-Encoding이 있으면 "") */
+char *gzip_identity_vary(char *data, int size)
 {
-  cache->count = 0;
-  cache->time = 0;
-  pthread_mutex_init(&(cache->lock), NULL);
+  char value[MAXLINE];
+
+  if(config.gzip_level == 0 || gzip_compressible(data, size) < 0 ||
+     (http_header_value(data, size, "Vary", value, sizeof(value)) && strcasestr(value, "Accept-Encoding")))
+  {
+    return "";
+  }
+  return "Vary: Accept-Encoding\r\n";
 }
 
-int cache_find(cache_t *cache, char *uri, char *data, int *size)
+/* 압축에 CPU를 더 써도 되는지 : 1초마다 gzip_cpu_ms 밀리초씩 (모든 스레드 합) */
+int gzip_budget_ok(void)
 {
-  pthread_mutex_lock(&(cache->lock));
+  long now = time(NULL), window = __atomic_load_n(&gz.window, __ATOMIC_RELAXED);
 
-  for(int i=0; i < cache->count; i++)
+  if(window != now && __atomic_compare_exchange_n(&gz.window, &window, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
   {
-    // 캐시 히트
-    if(strcmp(cache->entries[i].uri, uri) == 0)
-    {
-      // 캐시된 데이터를 복사하고 대입
-      memcpy(data, cache->entries[i].data, cache->entries[i].size);
-      *size = cache->entries[i].size;
-      cache->time += 1;
-      cache->entries[i].timestamp = cache->time; // 캐시 사용 시간 업데이트(LRU 갱신)
-
-      pthread_mutex_unlock(&(cache->lock));
-      return 1;
-    }
+    __atomic_store_n(&gz.spent_ns, 0, __ATOMIC_RELAXED);
   }
-
-  pthread_mutex_unlock(&(cache->lock));
-  return 0; // 캐시 미스
+  return __atomic_load_n(&gz.spent_ns, __ATOMIC_RELAXED) < (long)config.gzip_cpu_ms * 1000000;
 }
 
-void cache_insert(cache_t *cache, char *uri, char *data, int size)
+/* 캐시 blob의 본문(body_off부터)을 gzip으로 압축한 blob을 Malloc해서 돌려줌 : 작아지지 않거나 MAX_OBJECT_SIZE를 넘으면 NULL
+   헤더는 그대로 옮기되 Content-Length는 새로 쓰고, 강한 ETag는 표현이 달라지므로 약한 ETag로 바꾸고, 원본에 없으면 Vary: Accept-Encoding을 붙임 */
+char *gzip_blob(char *data, int size, int body_off, int *out_size)
 {
-  pthread_mutex_lock(&(cache->lock));
+  z_stream zs;
+  char *z = Malloc(MAX_OBJECT_SIZE), *out, *p, *end;
+  int zlen, len;
 
-  // 데이터(객체) 사이즈가 너무 크면 삽입 안 하고 종료
-  if(size > MAX_OBJECT_SIZE)
+  memset(&zs, 0, sizeof(zs));
+  if(deflateInit2(&zs, config.gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
   {
-    pthread_mutex_unlock(&(cache->lock));
-    return;
+    Free(z);
+    return NULL;
   }
-
-  // 최대 데이터 객체 개수보다 많으면 evict(축출) 수행
-  if(cache->count >= MAX_OBJ_NUM)
+  zs.next_in = (unsigned char *)data + body_off;
+  zs.avail_in = size - body_off;
+  zs.next_out = (unsigned char *)z;
+  zs.avail_out = MAX_OBJECT_SIZE;
+  if(deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= (unsigned long)(size - body_off))
   {
-    cache_evict(cache);
+    deflateEnd(&zs);
+    Free(z);
+    return NULL;
   }
+  zlen = zs.total_out;
+  deflateEnd(&zs);
 
-  // 새로운 엔트리 추가
-  strcpy(cache->entries[cache->count].uri, uri);
-  memcpy(cache->entries[cache->count].data, data, size);
-  cache->entries[cache->count].size = size;
-  cache->time += 1;
-  cache->entries[cache->count].timestamp = cache->time;
-  cache->count += 1;
-
-  pthread_mutex_unlock(&(cache->lock));
-  return;
+  if(body_off + 128 + zlen > MAX_OBJECT_SIZE)
+  {
+    Free(z);
+    return NULL;
+  }
+  out = Malloc(body_off + 128 + zlen);
+  p = strstr(data, "\r\n") + 2;
+  len = p - data;
+  memcpy(out, data, len);
+  for(; p < data + body_off - 2; p = end + 2)
+  {
+    end = memmem(p, data + body_off - 2 - p, "\r\n", 2);
+    if(!strncasecmp(p, "Content-Length:", strlen("Content-Length:")))
+    {
+      continue;
+    }
+    if(!strncasecmp(p, "ETag:", strlen("ETag:")))
+    {
+      char *v = p + strlen("ETag:");
+      while(*v == ' ' || *v == '\t')
+      {
+        v++;
+      }
+      if(*v == '"')
+      {
+        len += sprintf(out + len, "ETag: W/");
+        p = v;
+      }
+    }
+    memcpy(out + len, p, end + 2 - p);
+    len += end + 2 - p;
+  }
+  len += sprintf(out + len, "Content-Encoding: gzip\r\n%sContent-Length: %d\r\n\r\n", gzip_identity_vary(data, size), zlen);
+  memcpy(out + len, z, zlen);
+  Free(z);
+  *out_size = len + zlen;
+  return out;
 }
 
-void cache_evict(cache_t *cache)
+/* key로 캐시된 blob의 gzip 변형을 v에 찾아 줌 : 쓸 수 없으면(gzip을 안 받음, Range 요청, 압축할 만하지 않음, 예산 초과) 0
+   변형은 원본과 같은 만료 시각으로 저장하므로 만료 시각이 다르면(원본이 갱신되거나 바뀜) 다시 압축
+   다 보낸 뒤 gzip_variant_release */
+int gzip_variant(gzip_variant_t *v, char *key, char *data, int size, long expires, char *headers)
 {
-  // LRU(Least Recently Used) 알고리즘(= 가장 오랫동안 참조되지 않은 부분을 교체하는 알고리즘)에 따라 엔트리 제거
-  int lru = 0;
+  char vkey[MAXLINE];
+  int body_off;
+  struct timespec start, stop;
 
-  // 제거할 엔트리 찾아내기(순차탐색)
-  for(int i=1; i < cache->count; i++)
+  v->entry = NULL;
+  v->buf = NULL;
+  if(config.gzip_level == 0 || key == NULL || !request_accepts_gzip(headers) || request_range(headers) ||
+     strlen(key) + strlen(GZIP_KEY_SUFFIX) >= sizeof(vkey))
+  {
+    return 0;
+  }
+  sprintf(vkey, "%s%s", key, GZIP_KEY_SUFFIX);
+  // 원본 조회에서 이미 셌으므로 변형 조회는 통계와 TinyLFU 빈도에 세지 않음
+  if((v->entry = cache_get(&cache, vkey, 0)) != NULL)
   {
-    if(cache->entries[i].timestamp < cache->entries[lru].timestamp)
+    if(__atomic_load_n(&v->entry->expires, __ATOMIC_RELAXED) == expires)
     {
-      lru = i;
+      __atomic_fetch_add(&gz.hits, 1, __ATOMIC_RELAXED);
+      v->data = v->entry->data;
+      v->size = v->entry->size;
+      return 1;
     }
+    cache_release(&cache, v->entry);
+    v->entry = NULL;
+  }
+  if((body_off = gzip_compressible(data, size)) < 0)
+  {
+    return 0;
+  }
+  if(!gzip_budget_ok())
+  {
+    __atomic_fetch_add(&gz.over_budget, 1, __ATOMIC_RELAXED);
+    return 0;
   }
 
-  // 엔트리 제거 및 앞으로 당기기
-  for(int i = lru; i < cache->count - 1; i++)
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+  v->buf = gzip_blob(data, size, body_off, &v->size);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stop);
+  __atomic_fetch_add(&gz.spent_ns, (stop.tv_sec - start.tv_sec) * 1000000000L + stop.tv_nsec - start.tv_nsec, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&gz.total_ns, (stop.tv_sec - start.tv_sec) * 1000000000L + stop.tv_nsec - start.tv_nsec, __ATOMIC_RELAXED);
+  if(v->buf == NULL)
   {
-    cache->entries[i] = cache->entries[i + 1];
+    return 0;
   }
+  __atomic_fetch_add(&gz.compressed, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&gz.bytes_in, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&gz.bytes_out, v->size, __ATOMIC_RELAXED);
+  v->data = v->buf;
+  cache_insert(&cache, vkey, v->buf, v->size, expires);
+  return 1;
+}
 
-  cache->count -= 1;
-}
\ No newline at end of file
+void gzip_variant_release(gzip_variant_t *v)
+{
+  if(v->entry != NULL)
+  {
+    cache_release(&cache, v->entry);
+    v->entry = NULL;
+  }
+  if(v->buf != NULL)
+  {
+    Free(v->buf);
+    v->buf = NULL;
+  }
+}
@@ -1,5 +1,10 @@
+#define _GNU_SOURCE // splice
 #include <stdio.h>
+#include <netdb.h>
+// _GNU_SOURCE에서는 netdb.h의 gai_error와 csapp.h의 gai_error가 충돌하므로 csapp 쪽 선언 이름만 바꿔서 include
+#define gai_error csapp_gai_error
 #include "csapp.h"
+#undef gai_error
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
@@ -8,6 +13,7 @@
 void doit(int fd);
 int parse_uri(char* uri, char* hostname, char* path, int* port);
 void makeHttpHeader(char* http_header, char* hostname, char* path, int port, rio_t* client_rio);
+void relay_splice(int from_fd, int to_fd);
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr =
@@ -53,7 +59,6 @@ void doit(int fd)
   int port; // 서버의 포트 번호
   char port_ch[10]; // port를 문자열로 저장한 변수
   rio_t rio; // 클라이언트와의 통신을 위한 I/O 구조체
-  rio_t server_rio; // 서버와의 통신을 위한 I/O 구조체
   int server_fd; // 프록시가 웹 서버와 연결할 때 사용하는 소켓의 파일 디스크립터
 
   Rio_readinitb(&rio, fd);
@@ -74,21 +79,71 @@ void doit(int fd)
     return;
   }
 
-  Rio_readinitb(&server_rio, server_fd);
   Rio_writen(server_fd, http_header, strlen(http_header));
 
-  /* 클라이언트가 보냈던 원문도 서버에 전송하고 close */
-  size_t temp = rio_readlineb(&server_rio, buf, MAXLINE);
-  while(temp != 0)
-  {
-    Rio_writen(fd, buf, temp);
-    temp = rio_readlineb(&server_rio, buf, MAXLINE);
-  }
+  /* 서버 응답을 그대로 클라이언트에 전달 : 캐시하지 않으므로 읽어서 다시 쓰지 않고 splice로 옮김 */
+  relay_splice(server_fd, fd);
 
   /* 연결 종료 */
   Close(server_fd);
 }
 
+/* 서버 -> pipe -> 클라이언트 : 응답이 사용자 공간 버퍼를 거치지 않도록 splice로 옮김
+   splice를 쓸 수 없는 fd면(EINVAL) 버퍼로 복사 */
+void relay_splice(int from_fd, int to_fd)
+{
+  int pipe_fds[2], err;
+  ssize_t n, m;
+  char buf[MAXBUF];
+
+  if(pipe(pipe_fds) == 0)
+  {
+    while(1)
+    {
+      n = splice(from_fd, NULL, pipe_fds[1], NULL, 65536, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if(n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if(n <= 0)
+      {
+        break;
+      }
+      // pipe에 들어간 만큼 모두 클라이언트로
+      while(n > 0)
+      {
+        m = splice(pipe_fds[0], NULL, to_fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(m < 0 && errno == EINTR)
+        {
+          continue;
+        }
+        if(m <= 0)
+        {
+          close(pipe_fds[0]);
+          close(pipe_fds[1]);
+          return; // 클라이언트가 끊김
+        }
+        n -= m;
+      }
+    }
+    err = n < 0 ? errno : 0;
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    if(err != EINVAL)
+    {
+      return; // 서버가 응답을 다 보냈거나 연결 오류
+    }
+  }
+
+  while((n = read(from_fd, buf, sizeof(buf))) > 0)
+  {
+    if(rio_writen(to_fd, buf, n) != n)
+    {
+      return;
+    }
+  }
+}
+
 /* URI를 파싱해 호스트명, 경로, 포트 번호를 추출하고 대입 */
 int parse_uri(char* uri, char* hostname, char* path, int* port)
 {